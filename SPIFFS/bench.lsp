@@ -0,0 +1,144 @@
+;; benchmarks, (load "bench.lsp") then call, results are in ms
+
+;; allocation: keep LIVE closures alive while allocating N more,
+;; time should stay flat as the heap grows
+;;   (bench-alloc 0 100000) (bench-alloc 1000 100000) (bench-alloc 10000 100000)
+(de mkclosures (n a)
+  (if (= n 0) a (mkclosures (- n 1) (cons (lambda (x) x) a))))
+
+(de churn (n)
+  (if (= n 0) 'ok (progn (lambda (x) x) (churn (- n 1)))))
+
+(de bench-alloc (live n)
+  (let ((keep (mkclosures live nil)))
+    (car (time (churn n)))))
+
+;; GC pauses: replace a big live list K times, then see (gc-stats)
+;;   (gc-stats t) (bench-pause 30) (gc-stats)
+(de mklist (n a) (if (= n 0) a (mklist (- n 1) (cons n a))))
+
+(define big nil)
+
+(de bench-pause (k)
+  (if (= k 0) 'ok (progn (set! big (mklist 30000 nil)) (bench-pause (- k 1)))))
+
+;; marking: N deep nested car chain, GC time, see depth in (gc-stats)
+;;   (gc-stats t) (bench-mark 100000) (gc-stats)
+(de mknest (n a) (if (= n 0) a (mknest (- n 1) (cons a nil))))
+
+(de bench-mark (n)
+  (define deep (mknest n nil))
+  (car (time (gc))))
+
+;; strings: concat, length and equal on strings N times
+;;   (bench-string 100000)
+(de churn-string (n s)
+  (if (= n 0) 'ok
+    (progn (length (concat "foo" n "barbazbarbazbarbaz"))
+           (equal s "abcdefghijklmnopqrstuvwxyZ")
+           (churn-string (- n 1) s))))
+
+(de bench-string (n)
+  (car (time (churn-string n "abcdefghijklmnopqrstuvwxyz"))))
+
+;; split: a 4KB body into 110 fields, N times
+;;   (bench-split 1000)
+(de mkbody (n s)
+  (if (= n 0) s (mkbody (- n 1) (concat s "field-number-" n "-with-some-padding-text,"))))
+
+(define body (mkbody 110 ""))
+
+(de churn-split (n)
+  (if (= n 0) 'ok (progn (split body ",") (churn-split (- n 1)))))
+
+(de bench-split (n)
+  (car (time (churn-split n))))
+
+;; lexical addressing: variable lookups in calls and closures
+;;   (bench-fibo 30) (bench-closure 100000)
+;;   (lexical 0), (load "bench.lsp") and run again to compare with lookups
+;; bytecode: (compile 1), (load "bench.lsp") and run again, or (compile 'bfibo)
+;; closure tree: same with (compile 2), or (compile 'bfibo 2)
+(de bfibo (n)
+  (if (< n 2) 1 (+ (bfibo (- n 1)) (bfibo (- n 2)))))
+
+(de bench-fibo (n)
+  (car (time (bfibo n))))
+
+(de adder (a) (lambda (x) (+ x a)))
+
+(de sum-adders (n s)
+  (if (= n 0) s (sum-adders (- n 1) ((adder n) s))))
+
+(de bench-closure (n)
+  (car (time (sum-adders n 0))))
+
+;; arithmetic: fixnum loops of + * = < <= > >= %, N iterations each
+;;   (bench-arith 20000) gives the ms of (sum poly cmp), keep N <= 20000,
+;;   above that sum and n*n leave the fixnum range and get boxed
+(de arith-sum (n s)
+  (if (= n 0) s (arith-sum (- n 1) (+ s n))))
+
+(de arith-poly (n s)
+  (if (= n 0) s (arith-poly (- n 1) (% (+ (* s 31) (* n n) 7) 65521))))
+
+(de arith-cmp (n c)
+  (if (<= n 0) c
+    (arith-cmp (- n 1) (if (and (>= (% n 7) 3) (< (% n 5) 4) (> n 2)) (+ c 1) c))))
+
+(de bench-arith (n)
+  (list (car (time (arith-sum n 0)))
+        (car (time (arith-poly n 1)))
+        (car (time (arith-cmp n 0)))))
+
+;; boxed ints: like arith-sum but every step overflows the fixnum,
+;;   (bench-bigint 20000) against the sum of (bench-arith 20000)
+(de arith-big (n s)
+  (if (= n 0) s (arith-big (- n 1) (+ s (* n 100000)))))
+
+(de bench-bigint (n)
+  (car (time (arith-big n 0))))
+
+;; fixed point: TMP36 celsius = adc * 0.322 - 50 smoothed over N readings,
+;;   against the same in integer milli-degrees, (bench-fixed 20000) gives (fixed scaled)
+(de fixed-temp (n s)
+  (if (= n 0) s (fixed-temp (- n 1) (/ (+ (* s 7) (- (* (% n 1024) 0.322) 50)) 8))))
+
+(de scaled-temp (n s)
+  (if (= n 0) s (scaled-temp (- n 1) (/ (+ (* s 7) (- (* (% n 1024) 322) 50000)) 8))))
+
+(de bench-fixed (n)
+  (list (car (time (fixed-temp n 0)))
+        (car (time (scaled-temp n 0)))))
+
+;; floats, unix build only: damped spring with step DT, every + * / boxes a double,
+;;   (bench-float 20000 0.01d0) gives the ms followed by (float-stats)
+(de float-osc (n x v dt)
+  (if (= n 0) x
+    (float-osc (- n 1) (+ x (* v dt)) (- v (* (+ (* x 4) (/ v 2)) dt)) dt)))
+
+(de bench-float (n dt)
+  (float-stats 1)
+  (cons (car (time (float-osc n (* dt 100) 0 dt))) (float-stats)))
+
+;; sort: N elements in lists of M with env.lsp merge sort, 10 times
+;;   (bench-sort 1000 25), interpreted it blows the eval stack above ~40,
+;;   compiled to C also (bench-sort 1000 1000)
+;; compiled: esp-lisp -c env.lsp env.c, link env.c into the image,
+;;   (load "./env.lsp") before (load "bench.lsp") reads the interpreted
+;;   functions back to compare, prims are resolved at the call site once
+(de mkrand (n s a)
+  (if (= n 0) a (mkrand (- n 1) (% (+ (* s 1103) 12345) 65521) (cons s a))))
+
+(de mkchunks (k m a)
+  (if (= k 0) a (mkchunks (- k 1) m (cons (mkrand m k nil) a))))
+
+(de sort-all (ls)
+  (if (null? ls) 'ok (progn (sort (car ls) <) (sort-all (cdr ls)))))
+
+(de churn-sort (n ls)
+  (if (= n 0) 'ok (progn (sort-all ls) (churn-sort (- n 1) ls))))
+
+(de bench-sort (n m)
+  (let ((ls (mkchunks (/ n m) m nil)))
+    (car (time (churn-sort 10 ls)))))
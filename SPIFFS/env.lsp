@@ -1,14 +1,16 @@
 ;; lisp envirnoment functions
 
-;; tracing functions
+;; tracing functions, *TR lists the names traced
 (define *TR)
 (de trace (f)
   (if (func? f) (trace (funame f))
-    (set! *TR (cons f *TR))))
+    (progn (trace-set! f t)
+           (set! *TR (cons f *TR)))))
 
 (de untrace (f)
   (if (func? f) (untrace (funame f))
-     (set! *TR (filter (lambda (x) (not (eq f x))) *TR))))
+     (progn (trace-set! f nil)
+            (set! *TR (filter (lambda (x) (not (eq f x))) *TR)))))
 
 ;; misc
 
@@ -5,6 +5,7 @@ typedef unsigned int uint32;
 typedef unsigned int uint32_t;
 
 int clock_ms();
+unsigned int clock_us(); // for measuring short times, wraps
 int delay_ms(int ms);
 void set_baud(int speed);
 
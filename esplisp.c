@@ -164,6 +164,10 @@ int clock_ms() {
     return xTaskGetTickCount() * 10;
 }
 
+unsigned int clock_us() {
+    return sdk_system_get_time();
+}
+
 void set_baud(int speed) {
     sdk_uart_div_modify(0, UART_CLK_FREQ / speed);
 }
@@ -95,6 +95,7 @@
 #include <setjmp.h>
 #ifndef UNIX
   #include "FreeRTOS.h"
+  #include <malloc.h> // memalign
 
   #define LOOP 99999
   #define LOOPS "99999"
@@ -164,7 +165,21 @@
 #include "compat.h"
 
 // forwards
-void gc_conses();
+void gc_conses(int major);
+void gc_conses_clean();
+void gc_longs_clean();
+void gc_longs();
+static int string_size(lisp x);
+#define FRAME_BYTES(n) (sizeof(frame) + (n) * sizeof(lisp))
+static void princ_binds(lisp env, lisp fargs, int n);
+static inline void remember(lisp x, lisp v);
+int needGC();
+void gc_live();
+int gc_old_grew();
+void mark_stack();
+void gc_step(int budget);
+void mark_deep(lisp next, int deep);
+extern int mark_depth_max;
 int kbhit();
 static inline lisp callfunc(lisp f, lisp args, lisp* envp, lisp e, int noeval);
 int lispreadchar(char *chp);
@@ -188,6 +203,7 @@ lisp* global_envp = NULL;
 // adding real debugging - http://software-lab.de/doc/tut.html#dbg
 static int traceGC = 0;
 static int trace = 0;
+static int trace_count = 0; // functions with trace flag set, see trace_set()
 
 static int level = 0;
 static int trace_level = 0;
@@ -200,20 +216,43 @@ static void indent(int n) {
 // handle errors, break
 jmp_buf lisp_break = {0};
 
+// what an error leaves behind, saved before a setjmp(lisp_break) that goes on, see unwind()
+typedef struct { int level, vm_sp, blockGC; lisp resolve_self; } unwind_state;
+static unwind_state unwind_save();
+static void unwind(unwind_state u);
+
 // use for list(mkint(1), symbol("foo"), mkint(3), END);
 
 // if non nil enables continous GC
 // TODO: remove
 static int dogc = 0;
 
+// the characters follow inline, zero terminated, one allocation
 typedef struct {
     char tag;
-    char xx;
+    char xx; // STRING_VIEW: it's a stringview
     short index;
 
-    char* p; // TODO: make it inline, not second allocation
+    int len;
+    unsigned int hash;
+    char s[];
 } string;
 
+// non-owning, for strings in flash or constant data, see mklenstring(),
+// or a substring of parent, see mksubstring(). Not zero terminated.
+typedef struct {
+    char tag;
+    char xx;
+    short index;
+
+    int len;
+    unsigned int hash;
+    char* p;
+    lisp parent; // keeps p alive, nil if constant
+} stringview;
+
+#define STRING_VIEW 1
+
 // conss name in order to be able to have a function named 'cons()'
 // these are special, not stored in the allocated array
 typedef struct {
@@ -235,8 +274,8 @@ typedef struct {
 //       11 symbol names stored inside the pointer
 //
 //      100 special pointer, see below...
-//     0100 UNUSED: ??? (IROM) symbol/string, n*16 bytes, zero terminated
-//     1100 UNUSED: ??? (IROM) longcons (array consequtive nil terminated list) n*16 bytes (n*8 cars)
+//     0100 fixed point Q16.12 number, see FIXEDP()
+//     1100 longcons (array consequtive list) index + count in pointer, see mklong()
 //
 //     x1yy cons style things? but with other type
 //     0110 UNUSED: maybe we have func/thunk/immediate
@@ -246,14 +285,23 @@ typedef struct {
 // - http://www.esp8266.com/viewtopic.php?f=44&t=6574
 // - uses 20KB, so 12 KB available for JS code + vars...
 
-// stored using inline pointer
+// stored using inline pointer (fixnum), only boxed when it doesn't fit in 30 bits, see mkint64()
+typedef struct {
+    char tag;
+    char xx;
+    short index;
+
+    long long v;
+} intint;
+
+// boxed double, see FLOATP(), they have slabs of their own, see SLAB_FLOAT
 typedef struct {
     char tag;
     char xx;
     short index;
 
-    int v;
-} intint; // TODO: handle overflow...
+    double v;
+} floatt;
 
 // TODO: can we merge this and symbol, as all prim:s have name
 typedef struct {
@@ -294,15 +342,66 @@ typedef struct func {
     lisp e;
     lisp env;
     lisp name; // TODO: recycle
+    lisp code; // compiled body, 0 if can't, see compile_func()
 } func;
 
+// environment of a function call, see frame_bind()
+typedef struct frame {
+    char tag;
+    char xx; // number of slots
+    short index;
+
+    lisp names; // fargs of the function (as thunk e)
+    lisp parent; // env it extends (as thunk env)
+    lisp slots[];
+} frame;
+
+// resolved variable reference in a func body, see resolve()
+// or the global binding cached at a call site, see eval_hlp()
+typedef struct var {
+    char tag;
+    char xx; // slot in frame, VAR_CACHE for call site cache (if global)
+    short index;
+
+    lisp name;
+    lisp bind; // frames to skip as int, or global binding (symbol_val)
+    unsigned int epoch; // global_epoch when cache was checked
+} var;
+
+#define VAR_CACHE 1
+
+// bytecode or a tree of nodes of a func body, see compile_func() and vm_run()
+typedef struct code {
+    char tag;
+    char xx; // number of args
+    short index;
+
+    unsigned char flags; // CODE_FRAME, CODE_REST, CODE_TREE
+    unsigned char locals; // let variables on the stack, after the args
+    short stack; // max slots used on vm_stack
+    short nconsts;
+    unsigned short nbytes;
+    lisp consts[]; // followed by the bytecode, or nodes
+} code;
+
+#define CODE_FRAME 1 // args in a frame (else on value stack)
+#define CODE_REST 2 // (a b . rest)
+#define CODE_TREE 4 // nodes, see nd_run()
+
+#define CODE_BYTES(n, nb) (sizeof(code) + (n) * sizeof(lisp) + (nb))
+#define CODE_BC(c) ((unsigned char*)&(c)->consts[(c)->nconsts])
+
+// bumped when define/de creates a binding, it may shadow a global cached
+// at a call site. set! doesn't change what a name refers to.
+static unsigned int global_epoch = 0;
+
 int tag_count[MAX_TAGS] = {0};
 int tag_bytes[MAX_TAGS] = {0};
 int tag_freed_count[MAX_TAGS] = {0};
 int tag_freed_bytes[MAX_TAGS] = {0};
 
-char* tag_name[MAX_TAGS] = { "total", "string", "cons", "int", "prim", "symbol", "thunk", "immediate", "func", 0 };
-int tag_size[MAX_TAGS] = { 0, sizeof(string), sizeof(conss), sizeof(intint), sizeof(prim), sizeof(thunk), sizeof(immediate), sizeof(func) };
+char* tag_name[MAX_TAGS] = { "total", "string", "cons", "int", "prim", "symbol", "thunk", "immediate", "func", "frame", "var", "code", "fixed", "float", 0 };
+int tag_size[MAX_TAGS] = { 0, sizeof(string), sizeof(conss), sizeof(intint), sizeof(prim), sizeof(thunk), sizeof(immediate), sizeof(func), sizeof(frame), sizeof(var), sizeof(code), 0, sizeof(floatt) };
 
 int gettag(lisp x) {
     return TAG(x);
@@ -317,89 +416,160 @@ int gettag(lisp x) {
 //#define MAX_ALLOCS 256 // keeps 21K free
 //#define MAX_ALLOCS 128 // keeps 21K free
 //#define MAX_ALLOCS 128 // make slower!!!
-#define MAX_ALLOCS 256 // make faster???
+//#define MAX_ALLOCS 256 // make faster???
+//
+// allocs[] grows (doubles) on demand, up to MAX_ALLOCS as index is a short.
+// Free positions are kept on a stack filled by the sweep in gc(), so
+// reuse() is O(1), instead of round-robin scan of allocs[].
+//
+// (bench-alloc LIVE 100000) in SPIFFS/bench.lsp, unix:
+//   LIVE            0      200     1000    10000
+//   reuse() scan    26ms   GC thrashing, then "Exhausted myMalloc array!"
+//   free stack      24ms   34ms    36ms    27ms
+#define MAX_ALLOCS 32767
+#define INIT_ALLOCS 256
 
 int allocs_count = 0; // number of elements currently in used in allocs array
 int allocs_next = 0; // top of allocations in allocs array
-void* allocs[MAX_ALLOCS] = { 0 };
-unsigned int used[MAX_ALLOCS/32 + 1] = { 0 };
-    
+int allocs_size = 0; // size of allocs array
+void** allocs = NULL;
+unsigned int* used = NULL; // mark bitmap, allocs_size bits
+short* allocs_free = NULL; // stack of free positions below allocs_next
+int allocs_free_count = 0;
+short* allocs_young = NULL; // positions allocated since last GC
+int allocs_young_count = 0;
+
+#define USED_BYTES(n) (((n)/32 + 1) * sizeof(unsigned int))
 #define SET_USED(i) ({int _i = (i); used[_i/32] |= 1 << _i%32;})
 #define IS_USED(i) ({int _i = (i); (used[_i/32] >> _i%32) & 1;})
 
 // any slot with no value/nil can be reused
-int reuse_pos = 0;
 int reuse() {
-    int n = allocs_next;
-    while(n--) {
-        if (!allocs[reuse_pos]) return reuse_pos;
-        reuse_pos++;
-        if (reuse_pos >= allocs_next) reuse_pos = 0;
-    }
-    return -1;
+    return allocs_free_count ? allocs_free[--allocs_free_count] : -1;
+}
+
+// double the size of allocs array, return 0 if can't
+static int allocs_grow() {
+    int n = allocs_size ? allocs_size * 2 : INIT_ALLOCS;
+    if (n > MAX_ALLOCS) n = MAX_ALLOCS;
+    if (n <= allocs_size) return 0;
+    void** a = realloc(allocs, n * sizeof(void*));
+    unsigned int* u = realloc(used, USED_BYTES(n));
+    short* f = realloc(allocs_free, n * sizeof(short));
+    short* y = realloc(allocs_young, n * sizeof(short));
+    if (a) allocs = a;
+    if (u) used = u;
+    if (f) allocs_free = f;
+    if (y) allocs_young = y;
+    if (!a || !u || !f || !y) return 0;
+    memset(allocs + allocs_size, 0, (n - allocs_size) * sizeof(void*));
+    memset((char*)used + USED_BYTES(allocs_size), 0, USED_BYTES(n) - USED_BYTES(allocs_size));
+    allocs_size = n;
+    return 1;
 }
 
 // total number of things in use
 int used_count = 0;
 int used_bytes = 0;
 
-// TODO: maybe not good idea, just pre allocate 12 and 16 bytes stuff 4 at a time and put on free list?
-// permanent malloc, no way to give back
-#define PERMALLOC_CHUNK 64
-
-// used_count=72 cons_count=354 free=19280 USED=12 bytes
-// used_count=72 cons_count=354 free=19580 USED=16 bytes
-// saved: (- 19368 19580) = -122
-// 84 mallocs = (* 84 4) 336 bytes "saved"?
-
-// used_count=72 cons_count=354 free=19288 USED=12 bytes
-// used_count=72 cons_count=354 free=19580 USED=16 bytes
-// used_count=72 cons_count=354 free=18892 USED=12 bytes
-
-// unmodified: used_count=72 cons_count=354 free=18900 USED=12 bytes startMem=34796 
-// this:       used_count=72 cons_count=354 free=19540 USED=16 bytes startMem=34796
-// (- 34796 19540) = 15256
-
-void* perMalloc(int bytes) {
-    if (bytes > PERMALLOC_CHUNK) return malloc(bytes);
-
-    static char* heap = NULL;
-    static int used = 0;
-    if (used + bytes > PERMALLOC_CHUNK) {
-//        printf("[perMalloc.more waste=%d]\n", PERMALLOC_CHUNK - used);
-        // TODO: how to handle waste? if too much, then not worth it...
-        heap = NULL;
-        used = 0;
-    }
-    if (!heap) heap = malloc(PERMALLOC_CHUNK);
-    void* r = heap;
-//    printf("[perMalloc %d]", bytes); fflush(stdout);
-    heap += bytes;
-    used += bytes;
-    return r;
+// Slab allocator
+// --------------
+// salloc() takes objects up to SLAB_MAX_SIZE bytes from slabs, SLAB_BYTES
+// aligned blocks each holding slots of one size class (multiple of 8, as heap
+// pointers need the 000 tag). Every slab has its own free list and count of
+// used slots, slabs with free slots are linked per size class, and a slab
+// that becomes totally free is given back, unless it's the only one with free
+// slots of its class. A new slab isn't carved up into a free list, slots
+// [fresh..count) are taken in order.
+//
+// Before, a size without a freed slot to reuse was malloc:ed, freed ones were
+// never given back, and on ESP each object had its own malloc header.
+//
+// (bench-alloc 1000 100000) in SPIFFS/bench.lsp, unix:
+//   malloc + slot lists: 35 ms
+//   slabs:               32 ms
+// "mem" shows slabs and % of their slots free, after startup 7 slabs, 82%.
+#ifdef UNIX
+  #define SLAB_BYTES 4096
+#else
+  #define SLAB_BYTES 1024
+#endif
+#define SLAB_MAX_SIZE 64
+#define SLAB_CLASSES (SLAB_MAX_SIZE / 8)
+
+// floats are allocated and freed at a high rate by arithmetic, they get a
+// class of their own so they are packed together and don't fragment the others
+#define SLAB_FLOAT SLAB_CLASSES
+#define SLAB_SIZE(c) ((c) == SLAB_FLOAT ? (int)((sizeof(floatt) + 7) & ~7) : ((c) + 1) * 8)
+
+typedef struct slab {
+    struct slab* next; // slabs with free slots of the same size
+    struct slab* prev;
+    void* free; // list of freed slots
+    short size; // bytes per slot
+    short count; // slots
+    short used;
+    short fresh; // slots from here never used
+    short cls; // size class
+    char cells[] __attribute__ ((aligned (8)));
+} slab;
+
+#define SLAB(p) ((slab*)(((unsigned int)(p)) & ~(SLAB_BYTES - 1)))
+#define SLAB_CLASS(bytes) (((bytes) - 1) / 8)
+
+slab* slab_partial[SLAB_CLASSES + 1] = {0}; // slabs with free slots
+int slab_count[SLAB_CLASSES + 1] = {0};
+int slab_used[SLAB_CLASSES + 1] = {0}; // slots
+int slabs_freed = 0;
+
+static void* aligned_malloc(int align, int bytes);
+
+static slab* slab_new(int c) {
+    slab* s = aligned_malloc(SLAB_BYTES, SLAB_BYTES);
+    if (!s) return NULL;
+    s->next = s->prev = NULL;
+    s->free = NULL;
+    s->size = SLAB_SIZE(c);
+    s->cls = c;
+    s->count = (SLAB_BYTES - sizeof(slab)) / s->size;
+    s->used = 0;
+    s->fresh = 0;
+    slab_partial[c] = s;
+    slab_count[c]++;
+    return s;
+}
+
+static void slab_unlink(slab* s, int c) {
+    if (s->prev) s->prev->next = s->next; else slab_partial[c] = s->next;
+    if (s->next) s->next->prev = s->prev;
+    s->next = s->prev = NULL;
 }
 
-// SLOT salloc/sfree, reuse mallocs of same size instead of free, saved 20% speed
-#define SALLOC_MAX_SIZE 32
-void* alloc_slot[SALLOC_MAX_SIZE] = {0}; // TODO: probably too many sizes...
-
 void sfree(void** p, int bytes, int tag) {
     if (IS((lisp)p, symboll) || CONSP((lisp)p)) {
         error("sfree.ERROR: symbol or cons!\n");
     }
-    if (bytes >= SALLOC_MAX_SIZE) {
-        used_bytes -= bytes;
-        return free(p);
-    }
-    /// TODO: use sfree?
-    if (IS((lisp)p, string)) {
-        free(((string*)p)->p);
+    used_bytes -= bytes;
+    if (bytes > SLAB_MAX_SIZE) {
+        free(p);
+    } else {
+        slab* s = SLAB(p);
+        int c = s->cls;
+        *p = s->free;
+        s->free = p;
+        if (s->used-- == s->count) { // was full, has free slots now
+            s->next = slab_partial[c];
+            if (s->next) s->next->prev = s;
+            slab_partial[c] = s;
+        }
+        slab_used[c]--;
+        if (!s->used && (s->next || s->prev)) { // give it back
+            slab_unlink(s, c);
+            slab_count[c]--;
+            slabs_freed++;
+            free(s);
+        }
     }
-
-    // store for reuse
-    void* n = alloc_slot[bytes];
-    *p = n;
-    alloc_slot[bytes] = p;
     // stats
     if (tag > 0) {
         tag_freed_count[tag]++;
@@ -409,31 +579,95 @@ void sfree(void** p, int bytes, int tag) {
     tag_freed_bytes[0] += bytes;
 }
 
-static void* salloc(int bytes) {
-    void** p = alloc_slot[bytes];
-    if (bytes >= SALLOC_MAX_SIZE) {
-        used_bytes += bytes;
-        return malloc(bytes);
-    } else if (!p) {
-        used_bytes += bytes;
-        return malloc(bytes);
-        int i = 8;
-        char* n = malloc(bytes * i);
-        while (i--) {
-            sfree((void*)n, bytes, -1);
-            n += bytes;
-        }
-        p = alloc_slot[bytes];
-    }
-    alloc_slot[bytes] = *p;
+// c is the size class, SLAB_CLASS(bytes) or SLAB_FLOAT
+static void* salloc(int bytes, int c) {
+    used_bytes += bytes;
+    if (bytes > SLAB_MAX_SIZE) return malloc(bytes);
+    slab* s = slab_partial[c];
+    if (!s && !(s = slab_new(c))) return NULL;
+    void* p = s->free;
+    if (p)
+        s->free = *(void**)p;
+    else
+        p = s->cells + s->fresh++ * s->size;
+    if (++s->used == s->count) slab_unlink(s, c); // full
+    slab_used[c]++;
     return p;
 }
 
+// Generational GC
+// ---------------
+// Marks are sticky: anything marked has survived a GC and is "old". Marks
+// are only cleared at a major GC. A minor GC marks from the roots, stopping
+// at old objects, and only sweeps what was allocated since the last GC:
+// allocs_young[] (unmarked conses are just free, see cons()). Old objects that point to
+// young ones are found in remembered[], which the write barrier in
+// setcar/setcdr (and thus _setqqbind/set!) fills.
+//
+// A major GC happens on (gc), when remembered[] overflows, or when a minor
+// GC didn't free enough.
+//
+// (time (loop 1000000)) with 200000 live conses, unix:
+//   only major GCs: 350ms, of which GC 55ms
+//   minor GCs:      281ms, of which GC 24ms
+#define REMEMBERED_MAX 256
+lisp remembered[REMEMBERED_MAX];
+int remembered_count = 0;
+static int gc_major = 1; // next GC is major
+static int gc_marking = 0; // marking has started
+int gc_minor_count = 0;
+int gc_major_count = 0;
+
+// Incremental GC
+// --------------
+// A major GC may run incrementally as a tri-color mark and sweep: gc_begin()
+// clears all marks (white) and shades the roots, i.e. marks them and puts
+// them on grey[]. Then gc_step() does a bounded amount of work each time
+// something is allocated and in idle(). It scans grey objects and shades
+// their children. While marking, the write barrier in setcar/setcdr shades
+// the stored value, so a scanned (black) object never points to a white
+// one. Once grey[] has been empty gc_finish() rescans the roots, at a safe
+// point (evalGC or idle), and drains what the barrier shaded since, as a loop
+// like (set! big (mklist 30000 nil)) may never leave grey[] empty there.
+// Sweeping is then also done in steps, and anything
+// allocated meanwhile is allocated marked (black).
+//
+// Minor GCs are still stop the world, they're short. (gc-stats) gives max
+// pauses, for (bench-pause 30) in SPIFFS/bench.lsp, unix:
+//   stop the world: major GC pause 1.6-2.0ms
+//   incremental:    longest step 0.7-0.9ms
+#define GC_IDLE 0
+#define GC_MARK 1
+#define GC_SWEEP 2
+
+#define GREY_MAX 512
+#define GC_ALLOC_BUDGET 32 // objects scanned/swept per allocation
+#define GC_IDLE_BUDGET 1024 // per idle() tick
+
+int gc_phase = GC_IDLE;
+int gc_incremental = 1;
+lisp grey[GREY_MAX];
+int grey_count = 0;
+int gc_drained = 0; // grey[] has been empty since gc_begin()
+
+// stats for (gc-stats), pauses in us
+int gc_incremental_count = 0;
+int gc_steps = 0;
+unsigned int gc_pause_max = 0; // stop the world gc()
+unsigned int gc_step_max = 0; // incremental gc_begin/gc_step/gc_finish
+
+static void gc_pause(unsigned int start, unsigned int* max) {
+    unsigned int us = clock_us() - start;
+    if (us > *max) *max = us;
+}
+
 // call this malloc using ALLOC(typename) macro
 // if tag < 0 no GC on these (don't keep pointer around)
 void* myMalloc(int bytes, int tag) {
     ///printf("MALLOC: %d %d %s\n", bytes, tag, tag_name[tag]);
 
+    if (gc_phase) gc_step(GC_ALLOC_BUDGET);
+
     if (1) { // 830ms -> 770ms 5% faster if removed, depends on the week!?
         if (tag > 0) {
             tag_count[tag]++;
@@ -449,7 +683,11 @@ void* myMalloc(int bytes, int tag) {
     //if (allocs_next == 269) { printf("\n==============ALLOC: %d bytes of tag %s ========================\n", bytes, tag_name[tag]); }
     //if ((int)p == 0x08050208) { printf("\n============================== ALLOC trouble pointer %d bytes of tag %d %s ===========\n", bytes, ag, tag_name[tag]); }
 
-    void* p = salloc(bytes);
+    void* p = salloc(bytes, tag == floatt_TAG ? SLAB_FLOAT : SLAB_CLASS(bytes));
+    if (!p) {
+        report_allocs(2);
+        error("myMalloc: out of memory\n");
+    }
 
     // immediate optimization, only used transiently, so given back fast, no need gc.
     // symbols and prims are never freed, so no need keep track of or GC
@@ -459,24 +697,84 @@ void* myMalloc(int bytes, int tag) {
     }
 
     int pos = reuse();
-    if (pos < 0) pos = allocs_next++;
+    if (pos < 0) {
+        if (allocs_next >= allocs_size && !allocs_grow()) {
+            report_allocs(2);
+            error("Exhausted myMalloc array!\n");
+        }
+        pos = allocs_next++;
+    }
 
     allocs[pos] = p;
     allocs_count++;
     ((lisp)p)->index = pos;
-
-    if (allocs_next >= MAX_ALLOCS) {
-        report_allocs(2);
-        error("Exhausted myMalloc array!\n");
-    }
+    if (gc_phase == GC_SWEEP) SET_USED(pos); // allocate black
+    if (allocs_young_count < allocs_size)
+        allocs_young[allocs_young_count++] = pos;
+    else
+        gc_major = 1; // lost track, need full sweep
     return p;
 }
 
 static void mark_clean() {
-    memset(used, 0, sizeof(used));
+    if (!used) allocs_grow();
+    memset(used, 0, USED_BYTES(allocs_size));
+}
+
+int blockGC = 0;
+
+// call before marking roots, clears all marks if it's a major GC
+static void gc_start() {
+    if (gc_marking) return;
+    gc_marking = 1;
+    if (gc_major) {
+        mark_clean();
+        gc_conses_clean();
+        gc_longs_clean();
+        remembered_count = 0;
+    }
+}
+
+// free allocs[i] unless marked, return 1 if freed
+static int gc_sweep(int i) {
+    lisp p = allocs[i];
+    if (!p) return 0;
+    if (INTP(p) || CONSP(p)) {
+        printf("GC.erronious pointer stored: %u, tag=%d\n", (int)p, TAG(p));
+        printf("VAL="); princ(p); terpri();
+        exit(1);
+    }
+        
+    // USE FOR DEBUGGING SPECIFIC PTR
+    //if ((int)p == 0x0804e528) { printf("\nGC----------------------%d ERROR! p=0x%x  ", i, p); princ(p); terpri(); }
+
+    if (TAG(p) > floatt_TAG || TAG(p) == 0) {
+        printf("\nGC----------------------%d ILLEGAL TAG! %d p=0x%x  ", i, TAG(p), (unsigned int)p); princ(p); terpri();
+    }
+    if (IS_USED(i)) {
+        // printf("%d used  ::  ", i); princ(p); terpri();
+        return 0;
+    }
+
+    if (1) {
+        int tag = TAG(p);
+        int bytes = tag == string_TAG ? string_size(p) : tag == frame_TAG ? FRAME_BYTES(p->xx) :
+            tag == code_TAG ? CODE_BYTES(ATTR(code, p, nconsts), ATTR(code, p, nbytes)) : tag_size[tag];
+        sfree((void*)p, bytes, tag);
+    } else {
+        printf("FREE: %d ", i); princ(p); terpri();
+        // simulate free
+        p->tag = 66;
+    }
+    allocs[i] = NULL;
+    allocs_free[allocs_free_count++] = i;
+    allocs_count--;
+    used_count--;
+    return 1;
 }
 
-static int blockGC = 0;
+static void gc_finish(lisp* envp);
+static void gc_work(int budget);
 
 PRIM gc(lisp* envp) {
     if (blockGC) {
@@ -484,54 +782,62 @@ PRIM gc(lisp* envp) {
         return nil;
     }
 
+    unsigned int start = clock_us();
+
+    // incremental GC going on, complete it
+    if (gc_phase) {
+        if (gc_phase == GC_MARK) gc_finish(envp);
+        gc_work(0x7fffffff);
+        gc_pause(start, &gc_pause_max);
+        return nil;
+    }
+
+    gc_start();
+
     // mark
     syms_mark();
+    mark_stack();
+
+    int i;
+    for(i = 0; i < remembered_count; i++) mark(remembered[i]);
+    remembered_count = 0;
 
     //if (envp) { printf("ENVP %u=", (unsigned int)*envp); princ(*envp); terpri();}
     if (envp) mark(*envp);
 
     // sweep
-    gc_conses();
+    gc_conses(gc_major);
     
     int count = 0;
-    int i ;
-    for(i = 0; i < allocs_next; i++) {
-        lisp p = allocs[i];
-        if (!p) continue;
-        if (INTP(p) || CONSP(p)) {
-            printf("GC.erronious pointer stored: %u, tag=%d\n", (int)p, TAG(p));
-            printf("VAL="); princ(p); terpri();
-            exit(1);
-        }
-        
-        // USE FOR DEBUGGING SPECIFIC PTR
-        //if ((int)p == 0x0804e528) { printf("\nGC----------------------%d ERROR! p=0x%x  ", i, p); princ(p); terpri(); }
+    if (gc_major) {
+        for(i = 0; i < allocs_next; i++) count += gc_sweep(i);
+    } else {
+        for(i = 0; i < allocs_young_count; i++) count += gc_sweep(allocs_young[i]);
+    }
+    allocs_young_count = 0;
 
-        if (TAG(p) > 8 || TAG(p) == 0) {
-            printf("\nGC----------------------%d ILLEGAL TAG! %d p=0x%x  ", i, TAG(p), (unsigned int)p); princ(p); terpri();
-        }
-        int u = (used[i/32] >> i%32) & 1;
-        if (u) {
-            // printf("%d used=%d  ::  ", i, u); princ(p); terpri();
-        } else {
-            count++;
-            if (1) {
-                sfree((void*)p, tag_size[TAG(p)], TAG(p));;
-            } else {
-                printf("FREE: %d ", i); princ(p); terpri();
-                // simulate free
-                p->tag = 66;
-            }
-            allocs[i] = NULL;
-            allocs_count--;
-            used_count--;
-        }
+    if (gc_major) {
+        gc_major_count++;
+        // grow if more than half used, to avoid GC thrashing
+        if (allocs_count > allocs_size / 2) allocs_grow();
+        gc_live();
+    } else {
+        gc_minor_count++;
     }
-    mark_clean();
+    lisp r = mem_usage(count);
 
-    return mem_usage(count);
+    // minor GC didn't free enough, or too much got old, next one is major
+    gc_major = !gc_major && (needGC() || gc_old_grew());
+    gc_marking = 0;
+    gc_pause(start, &gc_pause_max);
+    return r;
 }
 
+// (gc) always does a major GC
+PRIM gc_full(lisp* envp) {
+    if (!gc_marking) gc_major = 1;
+    return gc(envp);
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 // string
@@ -546,25 +852,120 @@ char* my_strndup(char* s, int len) {
     return r;
 }
 
+// A string is allocated as one block, header with length and hash followed
+// by the characters. Strings of similar length share a salloc() size class.
+// Before it was ALLOC(string) + my_strndup and length/concat/split did
+// strlen over and over.
+//
+// On ESP "foo" was 8 + 4 bytes in two mallocs, each with its own malloc
+// header, now it's 16 in one. (bench-string 100000) in SPIFFS/bench.lsp
+// takes 63 ms either way on unix, the interpreter dominates.
+static int string_size(lisp x) {
+    if (((string*)x)->xx == STRING_VIEW) return sizeof(stringview);
+    return (sizeof(string) + ((string*)x)->len + 1 + 3) & ~3;
+}
+
+// same as symbols.c
+static unsigned int string_hash(char* s, int len) {
+    unsigned int h = 0;
+    while (len-- > 0)
+        h = h * 101 + *(unsigned char*)s++;
+    return h;
+}
+
+// allocate uninitialized string for LEN chars, call string_done() after filling in
+static string* string_alloc(int len) {
+    string* r = myMalloc((sizeof(string) + len + 1 + 3) & ~3, string_TAG);
+    r->tag = string_TAG;
+    r->xx = 0;
+    r->len = len;
+    return r;
+}
+
+// set the final LEN and hash
+static lisp string_done(string* r, int len) {
+    r->len = len;
+    r->s[len] = 0;
+    r->hash = string_hash(r->s, len);
+    return (lisp)r;
+}
+
 // make a string from POINTER (inside other string) by copying LEN bytes
-// if len < 0 then it's already malloced elsewhere
+// if len < 0 then it's a view of -LEN bytes that are kept elsewhere (flash, constant), not freed
 PRIM mklenstring(char* s, int len) {
     if (!s) return nil;
-    string* r = ALLOC(string);
-    if (len >= 0) {
-        r->p = my_strndup(s, len); // TODO: how to deallocate?
-    } else {
+    if (len < 0) {
+        stringview* r = myMalloc(sizeof(stringview), string_TAG);
+        r->tag = string_TAG;
+        r->xx = STRING_VIEW;
+        r->len = -len;
+        r->hash = string_hash(s, -len);
         r->p = s;
+        r->parent = nil;
+        return (lisp)r;
     }
-    return (lisp)r;
+    string* r = string_alloc(len);
+    memcpy(r->s, s, len);
+    return string_done(r, len);
 }
 
 PRIM mkstring(char* s) {
     return mklenstring(s, strlen(s));
 }
 
+// Substrings
+// ----------
+// A substring is a view of LEN chars at P inside parent, which it keeps
+// alive, no copying. split() returns its fields as substrings. As views
+// aren't zero terminated, code here uses string_chars() + len, only
+// getstring() may need to copy it (once), see string_terminate().
+//
+// Short ones are just copied, a view is bigger than a short string.
+//
+// (bench-split 10000) in SPIFFS/bench.lsp, 4KB string, 111 fields of ~38 chars, unix:
+//   copying: 119-140 ms, 52 bytes per field (ESP 52)
+//   views:   118-122 ms, 32 bytes per field (ESP 20)
+#define SUBSTRING_MIN (sizeof(stringview) - sizeof(string))
+
+static inline char* string_chars(lisp s) {
+    return ((string*)s)->xx == STRING_VIEW ? ((stringview*)s)->p : ((string*)s)->s;
+}
+
+// substring of string s, p points inside it
+static lisp mksubstring(lisp s, char* p, int len) {
+    if (len < SUBSTRING_MIN) return mklenstring(p, len);
+    stringview* r = myMalloc(sizeof(stringview), string_TAG);
+    r->tag = string_TAG;
+    r->xx = STRING_VIEW;
+    r->len = len;
+    r->hash = string_hash(p, len);
+    r->p = p;
+    r->parent = ((string*)s)->xx == STRING_VIEW ? ((stringview*)s)->parent : s;
+    return (lisp)r;
+}
+
+// view that isn't zero terminated, copy it, the copy becomes parent
+static void string_terminate(stringview* v) {
+    if (!v->p[v->len]) return;
+    lisp c = mklenstring(v->p, v->len);
+    v->p = string_chars(c);
+    v->parent = c;
+    remember((lisp)v, c);
+}
+
 char* getstring(lisp s) {
-    return IS(s, string) ? ATTR(string, s, p) : "";
+    if (!IS(s, string)) return "";
+    if (ATTR(string, s, xx) == STRING_VIEW) string_terminate((stringview*)s);
+    return string_chars(s);
+}
+
+static int getstrlen(lisp s) {
+    return IS(s, string) ? ATTR(string, s, len) : 0;
+}
+
+static int string_equal(lisp a, lisp b) {
+    string* x = (string*)a, * y = (string*)b;
+    return x->len == y->len && x->hash == y->hash && !memcmp(string_chars(a), string_chars(b), x->len);
 }
     
 // TODO:
@@ -596,61 +997,170 @@ char* getstring(lisp s) {
 ////////////////////////////////////////////////////////////////////////////////
 // CONS
 
-//#define MAX_CONS 137 // allows allocation of (list 1 2)
-#define MAX_CONS 2048
-//#define MAX_CONS 512
-#define CONSES_BYTES (MAX_CONS * sizeof(conss))
+// The cons space is a list of segments, each CONS_SEGMENT_BYTES big and
+// aligned on that size, so the owning segment of a cons is found by just
+// masking the pointer. Each segment has its own cons_used bitmap. Segments
+// are added on demand (up to cons_max conses) and given back when they
+// are totally free after gc_conses(). Same binary can thus run a small
+// embedded heap or a multi-megabyte host workload.
+//
+// (length (mklist 100000 nil)) on unix:
+//   fixed MAX_CONS 2048     => Run out of conses
+//   segments                => 100000 in 47ms
+//
+// There is no free list. GC only marks, at the end the mark bitmap is copied
+// to the live bitmap, one word per 32 conses. cons() then bump allocates
+// through the runs of free conses, found one bitmap word at a time as it
+// advances. So sweeping is lazy and not part of the GC pause, and lists are
+// laid out mostly contiguously. The live bitmap is separate so an incremental
+// GC can clear the marks and still allocate.
+//
+// (bench-pause 30) in SPIFFS/bench.lsp, unix, longest GC pause from (gc-stats):
+//   free list:  240-280ms, pause 2.9-3.7ms
+//   bump:       260-310ms, pause 1.2-1.4ms (more GCs, survivors fragment the runs)
+#define CONS_SEGMENT_BYTES 4096
+
+#ifdef UNIX
+  #define MAX_CONS (1024*1024) // 8MB, ceiling, can be changed by (cons-max n)
+#else
+  #define MAX_CONS 4096 // more than we have RAM...
+#endif
+#define MIN_CONS 2048 // start with these, never shrink below
+
+typedef struct cons_segment {
+    struct cons_segment* self; // == this, to check it's a segment
+    struct cons_segment* next;
+    unsigned int used[CONS_SEGMENT_BYTES/sizeof(conss)/32 + 1]; // marks
+    unsigned int live[CONS_SEGMENT_BYTES/sizeof(conss)/32 + 1]; // after last GC, for cons()
+    conss cells[] __attribute__ ((aligned (8))); // 010 tag needs 8 byte alignment
+} cons_segment;
+
+#define CONS_SEGMENT_CELLS ((int)((CONS_SEGMENT_BYTES - sizeof(cons_segment)) / sizeof(conss)))
+#define CONS_SEGMENT(c) ((cons_segment*)(((unsigned int)(c)) & ~(CONS_SEGMENT_BYTES - 1)))
 
-conss* conses = NULL;
-unsigned int cons_used[MAX_CONS/32 + 1] = { 0 };
-lisp free_cons = 0;
-int cons_count = 0; // TODO: remove, used for GC indication
+cons_segment* cons_segments = NULL;
+cons_segment* cons_segments_last = NULL; // new segments are added last, for cons()
+int cons_segments_count = 0;
+int cons_max = MAX_CONS;
+int cons_count = 0; // number of free conses, used for GC indication
 
-#define CONS_SET_USED(i) ({int _i = (i); cons_used[_i/32] |= 1 << _i%32;})
-#define CONS_IS_USED(i) ({int _i = (i); (cons_used[_i/32] >> _i%32) & 1;})
+// cons() allocates cells[alloc_i..alloc_end-1] of alloc_seg
+cons_segment* alloc_seg = NULL;
+int alloc_i = 0;
+int alloc_end = 0;
+
+#define CONS_TOTAL (cons_segments_count * CONS_SEGMENT_CELLS)
+
+#define CONS_SET_USED(seg, i) ({int _i = (i); (seg)->used[_i/32] |= 1 << _i%32;})
+#define CONS_IS_USED(seg, i) ({int _i = (i); ((seg)->used[_i/32] >> _i%32) & 1;})
+#define CONS_IS_LIVE(seg, i) ({int _i = (i); ((seg)->live[_i/32] >> _i%32) & 1;})
+
+static void* aligned_malloc(int align, int bytes) {
+#ifdef UNIX
+    void* p = NULL;
+    if (posix_memalign(&p, align, bytes)) return NULL;
+    return p;
+#else
+    return memalign(align, bytes);
+#endif
+}
 
-// TODO: as alternative to free list we could just use the bitmap
-// this would allow us to allocate adjacent elements!
-void gc_conses() {
-    // make first pointer point to first position
-    free_cons = nil;
+// add a new segment last, unless we're at cons_max, return 1 if did
+static int cons_grow() {
+    if (CONS_TOTAL + CONS_SEGMENT_CELLS > cons_max) return 0;
+    cons_segment* seg = aligned_malloc(CONS_SEGMENT_BYTES, CONS_SEGMENT_BYTES);
+    if (!seg) return 0;
+    memset(seg, 0, CONS_SEGMENT_BYTES);
+    seg->self = seg;
+    if (cons_segments_last) cons_segments_last->next = seg; else cons_segments = seg;
+    cons_segments_last = seg;
+    cons_segments_count++;
+    cons_count += CONS_SEGMENT_CELLS;
+    if (!alloc_seg) alloc_seg = seg;
+    return 1;
+}
+
+// clear marks before a major GC
+void gc_conses_clean() {
+    cons_segment* seg;
+    for(seg = cons_segments; seg; seg = seg->next)
+        memset(seg->used, 0, sizeof(seg->used));
+}
+
+// after marking, unmarked conses are free: start allocating from the first
+// segment again, major GC also gives back totally free segments
+void gc_conses(int major) {
+    cons_segment* seg;
+    cons_segment** prev = &cons_segments;
     cons_count = 0;
-    int i;
-    for(i = MAX_CONS - 1; i >= 0; i--) {
-        if (!CONS_IS_USED(i)) {
-            conss* c = &conses[i];
-            //if (c->car && c->car == _FREE_) continue; // already in free list...
-            c->car = _FREE_;
-            c->cdr = free_cons;
-            free_cons = MKCONS(c);
-            //printf("%u CONS=%u CONSP=%d\n", (int)c, (int)free_cons, CONSP(free_cons));
-            cons_count++;
+    cons_segments_last = NULL;
+    while ((seg = *prev)) {
+        int i, n = 0;
+        for(i = 0; i < sizeof(seg->used)/sizeof(seg->used[0]); i++)
+            n += __builtin_popcount(seg->used[i]);
+        // keep MIN_CONS
+        if (major && !n && CONS_TOTAL - CONS_SEGMENT_CELLS >= MIN_CONS) {
+            *prev = seg->next;
+            cons_segments_count--;
+            seg->self = NULL;
+            free(seg);
+            continue;
         }
+        memcpy(seg->live, seg->used, sizeof(seg->live));
+        cons_count += CONS_SEGMENT_CELLS - n;
+        cons_segments_last = seg;
+        prev = &seg->next;
     }
-    memset(cons_used, 0, sizeof(cons_used));
+    alloc_seg = cons_segments;
+    alloc_i = alloc_end = 0;
+    if (major) gc_longs();
+    // grow if it'd be little free, this avoids GC thrashing
+    while (cons_count < CONS_TOTAL / 2 && cons_grow());
 }
 
 void gc_cons_init() {
-    conses = malloc(CONSES_BYTES); // we malloc, so it's pointer starts at xxx000
-    memset(conses, 0, CONSES_BYTES);
-    memset(cons_used, 0, sizeof(cons_used));
-    gc_conses();
+    while (CONS_TOTAL < MIN_CONS && cons_grow());
+}
+
+// first position >= i in bitmap with bit == bit, or CONS_SEGMENT_CELLS
+static inline int cons_scan(unsigned int* map, int i, int bit) {
+    while (i < CONS_SEGMENT_CELLS) {
+        unsigned int w = (bit ? map[i/32] : ~map[i/32]) & (~0u << i%32);
+        if (w) {
+            i = (i & ~31) + __builtin_ctz(w);
+            return i < CONS_SEGMENT_CELLS ? i : CONS_SEGMENT_CELLS;
+        }
+        i = (i & ~31) + 32;
+    }
+    return CONS_SEGMENT_CELLS;
+}
+
+// lazy sweep: find next run of free conses after alloc_end, a word at a time
+static int cons_next_run() {
+    while (alloc_seg) {
+        int i = cons_scan(alloc_seg->live, alloc_end, 0);
+        if (i < CONS_SEGMENT_CELLS) {
+            alloc_i = i;
+            alloc_end = cons_scan(alloc_seg->live, i, 1);
+            return 1;
+        }
+        alloc_seg = alloc_seg->next;
+        alloc_i = alloc_end = 0;
+    }
+    return 0;
 }
 
 PRIM cons(lisp a, lisp b) {
-    conss* c = GETCONS(free_cons);
-    cons_count--;
-    if (!c) {
-        error("Run out of conses\n");
+    if (gc_phase) gc_step(GC_ALLOC_BUDGET);
+    if (alloc_i >= alloc_end && !cons_next_run()) {
+        if (!cons_grow() || !cons_next_run()) error("Run out of conses\n");
     }
+    conss* c = &alloc_seg->cells[alloc_i++];
+    if (gc_phase == GC_SWEEP) CONS_SET_USED(alloc_seg, c - alloc_seg->cells); // allocate black
+    cons_count--;
     if (cons_count < 0) {
         error("Really ran out of conses\n");
     }
-    if (c->car != _FREE_) {
-        printf("Conses corruption error %u ... %u CONSP=%d\n", (int)c, (int)free_cons, CONSP(free_cons));
-        printf("CONS="); princ((lisp)c); terpri();
-        exit(1);
-    }
     // TODO: this is updating counter in myMalloc stats, maybe refactor...
     if (0) { // TOOD: enable this and it becomes very slow!!!!??? why compared to myMalloc shouldn't????
     used_count++; // not correct as cons are different...
@@ -660,24 +1170,222 @@ PRIM cons(lisp a, lisp b) {
     tag_bytes[0] += sizeof(conss);
     }
 
-    free_cons = c->cdr;
-
     c->car = a;
     c->cdr = b;
     return MKCONS(c);
 }
 
+// (cons-max) => current ceiling, (cons-max 100000) set ceiling number of conses
+PRIM cons_max_(lisp n) {
+    if (INTP(n)) cons_max = getint(n);
+    return mkint(cons_max);
+}
+
+// (gc-stats) => ((minor . 17) (major . 1) (incr . 2) (steps . 4711) (pause . 2345) (step . 67))
+// pause is longest stop the world GC, step longest incremental step, in us
+// (gc-stats t) resets the max values
+PRIM gc_stats(lisp reset) {
+    lisp r = list(cons(symbol("minor"), mkint(gc_minor_count)),
+                  cons(symbol("major"), mkint(gc_major_count)),
+                  cons(symbol("incr"), mkint(gc_incremental_count)),
+                  cons(symbol("steps"), mkint(gc_steps)),
+                  cons(symbol("pause"), mkint(gc_pause_max)),
+                  cons(symbol("step"), mkint(gc_step_max)),
+                  cons(symbol("depth"), mkint(mark_depth_max)),
+                  END);
+    if (reset) gc_pause_max = gc_step_max = mark_depth_max = 0;
+    return r;
+}
+
 PRIM recons(lisp a, lisp b, lisp ab) {
     if (a == car(ab) && b == cdr(ab)) return ab;
     return cons(a, b);
 }
 
+// Longcons
+// --------
+// A cdr-coded list, the cars are consecutive in longs[]. The pointer has tag
+// 1100, the index of its car and the number of cars left, so (cdr x) is just
+// the next index: car/cdr take no memory, nth/length are O(1). If the last
+// cdr isn't nil the T bit is set and it's stored after the last car (also
+// used to chain lists longer than LONG_N_MAX). reads() copies
+// what it read here, as code and quoted data are mostly not modified, that
+// takes 4 bytes per element instead of 8 for a cons.
+//
+// setcdr can't change the next index of a longcons (unless it's the last),
+// instead its car slot is replaced by a forward to a new ordinary cons. The
+// last car of the run is then marked in long_fwds, every pointer into a run
+// has the same LONG_END(), length/nthcdr only walk runs that are marked.
+//
+// longs[] grows by realloc, indices stay valid. It's GC:ed like conses,
+// marks in long_used, allocating from free runs in long_live, but only a
+// major GC frees any.
+//
+// SPIFFS/init.lsp loaded, cells used for code, unix 64 bit:
+//   conses:    311 * 16 = 4976 bytes (ESP 2488)
+//   longcons:  311 *  8 = 2488 bytes (ESP 1244)
+//
+// (length/nth in a loop over 1000 elements, 1000 times)
+//   conses:    476 ms
+//   longcons:    5 ms
+//
+// The price is evaluating code, car/cdr has to decode the pointer:
+// (bench-pause 30) 245 ms -> 290 ms, (bench-alloc 1000 100000) 48 ms -> 54 ms
+#define LONG_N_MAX 2047 // longer lists use several, chained by the cdr
+#ifdef UNIX
+  #define LONGS_MAX 65536
+#else
+  #define LONGS_MAX 4096
+#endif
+#define LONGS_INIT 256
+
+// iiiiiiii iiiiiiii Tnnnnnnn nnnn1100
+#define MKLONG(i, n, t) ((lisp)(((unsigned int)(i) << 16) | ((t) ? 0x8000 : 0) | ((unsigned int)(n) << 4) | 12))
+#define LONG_I(x) (((unsigned int)(x)) >> 16)
+#define LONG_N(x) ((((unsigned int)(x)) >> 4) & 0x7ff)
+#define LONG_T(x) ((((unsigned int)(x)) >> 15) & 1) // has last cdr slot
+#define LONG_TAIL(x) (LONG_T(x) ? longs[LONG_I(x) + LONG_N(x)] : nil) // the last cdr
+#define LONG_FWDP(v) ((((unsigned int)(v)) & 0xffff) == 12) // car slot forwarded to long_fwd[LONG_I(v)]
+#define LONG_END(x) (LONG_I(x) + LONG_N(x) - 1) // last car of the run
+
+#define LONG_SET(map, i) ({int _i = (i); (map)[_i/32] |= 1 << _i%32;})
+#define LONG_IS(map, i) ({int _i = (i); ((map)[_i/32] >> _i%32) & 1;})
+
+lisp* longs = NULL;
+unsigned int* long_used = NULL; // marks
+unsigned int* long_live = NULL; // after last major GC, for long_alloc()
+unsigned int* long_fwds = NULL; // LONG_END() of runs with a forwarded slot
+int longs_size = 0;
+int long_next = 0; // first free position to try
+int longs_count = 0; // used slots, for stats
+
+lisp* long_fwd = NULL; // conses that forwarded car slots points to
+int* long_fwd_slot = NULL; // the slot, if free < 0 and -2 - the next free
+int long_fwd_size = 0;
+int long_fwd_free = -1; // first free in long_fwd[]
+
+#define LONG_FWDS(x) LONG_IS(long_fwds, LONG_END(x)) // has forwards, walk it
+
+static int longs_grow() {
+    int n = longs_size ? longs_size * 2 : LONGS_INIT;
+    if (n > LONGS_MAX) return 0;
+    lisp* l = realloc(longs, n * sizeof(lisp));
+    if (!l) return 0;
+    longs = l;
+    unsigned int* u = realloc(long_used, n / 8);
+    if (!u) return 0;
+    long_used = u;
+    unsigned int* v = realloc(long_live, n / 8);
+    if (!v) return 0;
+    long_live = v;
+    unsigned int* w = realloc(long_fwds, n / 8);
+    if (!w) return 0;
+    long_fwds = w;
+    memset(long_used + longs_size / 32, 0, (n - longs_size) / 8);
+    memset(long_live + longs_size / 32, 0, (n - longs_size) / 8);
+    memset(long_fwds + longs_size / 32, 0, (n - longs_size) / 8);
+    longs_size = n;
+    return 1;
+}
+
+// find n consecutive free slots, -1 if none
+static int long_alloc(int n) {
+    int i = long_next;
+    while (1) {
+        while (i < longs_size && LONG_IS(long_live, i)) i++;
+        int j = i;
+        while (j < longs_size && j - i < n && !LONG_IS(long_live, j)) j++;
+        if (j - i == n) break;
+        if (j < longs_size) i = j;
+        else if (!longs_grow()) return -1;
+    }
+    long_next = i + n;
+    longs_count += n;
+    int k;
+    if (gc_phase == GC_SWEEP) for(k = i; k < i + n; k++) LONG_SET(long_used, k); // allocate black
+    return i;
+}
+
+// copy list x to longs[], sublists too, if no space x is returned
+lisp mklong(lisp x) {
+    if (!CONSP(x)) return x;
+    int n = 0;
+    lisp p = x;
+    while (CONSP(p) && n < LONG_N_MAX) {
+        n++;
+        p = GETCONS(p)->cdr;
+    }
+    int t = p ? 1 : 0;
+    int i = long_alloc(n + t);
+    if (i < 0) return x;
+    int k;
+    for(k = 0; k < n; k++) {
+        lisp v = mklong(GETCONS(x)->car); // may realloc longs
+        longs[i + k] = v;
+        x = GETCONS(x)->cdr;
+    }
+    if (t) {
+        lisp v = mklong(x);
+        longs[i + n] = v;
+    }
+    return MKLONG(i, n, t);
+}
+
+// value of slot, the cons if it's forwarded
+static inline lisp long_slot(int i) {
+    lisp v = longs[i];
+    return LONG_FWDP(v) ? long_fwd[LONG_I(v)] : v;
+}
+
+static inline lisp long_car(lisp x) {
+    lisp v = longs[LONG_I(x)];
+    return LONG_FWDP(v) ? GETCONS(long_fwd[LONG_I(v)])->car : v;
+}
+
+static inline lisp long_cdr(lisp x) {
+    lisp v = longs[LONG_I(x)];
+    if (LONG_FWDP(v)) return GETCONS(long_fwd[LONG_I(v)])->cdr;
+    // next index, one less left
+    return LONG_N(x) > 1 ? (lisp)((unsigned int)x + (1 << 16) - (1 << 4)) : LONG_TAIL(x);
+}
+
+// clear marks before a major GC
+void gc_longs_clean() {
+    if (longs_size) memset(long_used, 0, longs_size / 8);
+}
+
+// after a major GC, unmarked slots are free, and forwards from them
+void gc_longs() {
+    if (!longs_size) return;
+    memcpy(long_live, long_used, longs_size / 8);
+    long_next = 0;
+    longs_count = 0;
+    int i;
+    for(i = 0; i < longs_size / 32; i++) {
+        longs_count += __builtin_popcount(long_used[i]);
+        long_fwds[i] &= long_used[i];
+    }
+    for(i = 0; i < long_fwd_size; i++) {
+        if (long_fwd_slot[i] >= 0 && !LONG_IS(long_used, long_fwd_slot[i])) {
+            long_fwd_slot[i] = -2 - long_fwd_free;
+            long_fwd[i] = nil;
+            long_fwd_free = i;
+        }
+    }
+}
+
 // inline works on both unix/gcc and c99 for esp8266
-inline PRIM car(lisp x) { return CONSP(x) ? GETCONS(x)->car : nil; }
-inline PRIM cdr(lisp x) { return CONSP(x) ? GETCONS(x)->cdr : nil; }
+inline PRIM car(lisp x) { return CONSP(x) ? GETCONS(x)->car : LONGP(x) ? long_car(x) : nil; }
+inline PRIM cdr(lisp x) { return CONSP(x) ? GETCONS(x)->cdr : LONGP(x) ? long_cdr(x) : nil; }
 
 PRIM nthcdr(lisp n, lisp l) {
     int in = getint(n);
+    while (in > 0 && LONGP(l) && !LONG_FWDS(l)) {
+        int ln = LONG_N(l);
+        if (in < ln) return MKLONG(LONG_I(l) + in, ln - in, LONG_T(l));
+        in -= ln;
+        l = LONG_TAIL(l);
+    }
     while (in-- > 0) l = cdr(l);
     return l;
 }
@@ -699,8 +1407,116 @@ int cons_count; // forward
   PRIM cdr_(lisp x) { return cdr(x); }
 #endif
 
-PRIM setcar(lisp x, lisp v) { return IS(x, conss) ? GETCONS(x)->car = v : nil; }
-PRIM setcdr(lisp x, lisp v) { return IS(x, conss) ? GETCONS(x)->cdr = v : nil; }
+#define FLASHP(x) ((unsigned int)(x) >= (unsigned int)flash_memory && ((unsigned int)(x) <= (unsigned int)(flash_memory + SPI_FLASH_SIZE_BYTES - FS_ADDRESS)))
+
+// has x survived a GC? (things not GC:ed are always old)
+static inline int oldp(lisp x) {
+    if (LONGP(x)) return LONG_IS(long_used, LONG_I(x));
+    if (!x || INTP(x) || FIXEDP(x) || SYMP(x) || PRIMP(x) || FLASHP(x)) return 1;
+    if (CONSP(x)) {
+        cons_segment* seg = CONS_SEGMENT(x);
+        if (seg->self != seg) return 1; // symbol binding or flash
+        return CONS_IS_USED(seg, GETCONS(x) - seg->cells);
+    }
+    return x->index < 0 || IS_USED(x->index);
+}
+
+// mark x and put it on grey[] to be scanned by gc_step()
+static void shade(lisp x) {
+    if (oldp(x)) return;
+    if (grey_count >= GREY_MAX) { // overflow, mark it all now
+        mark_deep(x, 1);
+        return;
+    }
+    if (CONSP(x)) {
+        cons_segment* seg = CONS_SEGMENT(x);
+        CONS_SET_USED(seg, GETCONS(x) - seg->cells);
+    } else if (LONGP(x)) {
+        int i;
+        for(i = LONG_I(x); i < LONG_I(x) + LONG_N(x) + LONG_T(x); i++) LONG_SET(long_used, i);
+    } else {
+        SET_USED(x->index);
+    }
+    grey[grey_count++] = x;
+}
+
+// write barrier: remember young v stored into old cons (or substring) x,
+// for minor GC, when incremental marking, shade v
+static inline void remember(lisp x, lisp v) {
+    if (gc_phase == GC_MARK) {
+        shade(v);
+        return;
+    }
+    if (gc_major || oldp(v)) return;
+    if (LONGP(x)) {
+        if (!LONG_IS(long_used, LONG_I(x))) return; // young
+    } else if (!CONSP(x)) {
+        if (!oldp(x)) return;
+    } else {
+        cons_segment* seg = CONS_SEGMENT(x);
+        if (seg->self != seg) return; // symbol binding, syms_mark() marks all
+        if (!CONS_IS_USED(seg, GETCONS(x) - seg->cells)) return; // young
+    }
+    if (remembered_count >= REMEMBERED_MAX) {
+        gc_major = 1;
+        return;
+    }
+    remembered[remembered_count++] = v;
+}
+
+// make car slot of longcons x forward to a new cons, so its cdr can change
+static lisp long_forward(lisp x) {
+    lisp c = cons(car(x), cdr(x));
+    if (long_fwd_free < 0) {
+        int n = long_fwd_size ? long_fwd_size * 2 : 16;
+        lisp* f = realloc(long_fwd, n * sizeof(lisp));
+        if (!f) error("long_forward: out of memory\n");
+        long_fwd = f;
+        int* fs = realloc(long_fwd_slot, n * sizeof(int));
+        if (!fs) error("long_forward: out of memory\n");
+        long_fwd_slot = fs;
+        int k;
+        for(k = n - 1; k >= long_fwd_size; k--) {
+            long_fwd[k] = nil;
+            long_fwd_slot[k] = -2 - long_fwd_free;
+            long_fwd_free = k;
+        }
+        long_fwd_size = n;
+    }
+    int j = long_fwd_free;
+    long_fwd_free = -2 - long_fwd_slot[j];
+    long_fwd[j] = c;
+    long_fwd_slot[j] = LONG_I(x);
+    LONG_SET(long_fwds, LONG_END(x));
+    longs[LONG_I(x)] = MKLONG(j, 0, 0);
+    remember(x, c);
+    return c;
+}
+
+PRIM setcar(lisp x, lisp v) {
+    if (!IS(x, conss)) return nil;
+    if (LONGP(x)) {
+        lisp f = longs[LONG_I(x)];
+        if (LONG_FWDP(f)) return setcar(long_fwd[LONG_I(f)], v);
+        remember(x, v);
+        return longs[LONG_I(x)] = v;
+    }
+    remember(x, v);
+    return GETCONS(x)->car = v;
+}
+
+PRIM setcdr(lisp x, lisp v) {
+    if (!IS(x, conss)) return nil;
+    if (LONGP(x)) {
+        lisp f = longs[LONG_I(x)];
+        if (LONG_FWDP(f)) return setcdr(long_fwd[LONG_I(f)], v);
+        if (LONG_N(x) > 1 || !LONG_T(x)) return setcdr(long_forward(x), v);
+        remember(x, v);
+        return longs[LONG_I(x) + 1] = v;
+    }
+    remember(x, v);
+    return GETCONS(x)->cdr = v;
+}
 
 PRIM list(lisp first, ...) {
     va_list ap;
@@ -781,10 +1597,17 @@ void report_allocs(int verbose) {
         b = sizeof(tag_bytes); printf("tag_bytes: %d ", b); tot += b;
         b = sizeof(tag_freed_count); printf("tag_freed_count: %d ", b); tot += b;
         b = sizeof(tag_freed_bytes); printf("tag_freed_bytes: %d ", b); tot += b;
-        b = sizeof(allocs); printf("allocs: %d ", b); tot += b;
-        b = sizeof(alloc_slot); printf("alloc_slot: %d ", b); tot += b;
-        b = CONSES_BYTES; printf("conses: %d ", b); tot += b;
-        b = sizeof(cons_used); printf("cons_used: %d ", b); tot += b;
+        b = allocs_size * (sizeof(void*) + sizeof(short)) + USED_BYTES(allocs_size); printf("allocs: %d ", b); tot += b;
+        int c, n = 0, slots = 0, used = 0;
+        for(c = 0; c <= SLAB_FLOAT; c++) {
+            n += slab_count[c];
+            slots += slab_count[c] * ((SLAB_BYTES - sizeof(slab)) / SLAB_SIZE(c));
+            used += slab_used[c];
+        }
+        b = n * SLAB_BYTES; printf("slabs: %d (%d slabs, %d%% slots free, %d given back) ", b, n, slots ? 100 - used * 100 / slots : 0, slabs_freed); tot += b;
+        b = cons_segments_count * CONS_SEGMENT_BYTES; printf("conses: %d (%d segments) ", b, cons_segments_count); tot += b;
+        b = longs_size * sizeof(lisp) + longs_size * 3 / 8 + long_fwd_size * (sizeof(lisp) + sizeof(int)); printf("longs: %d (%d used) ", b, longs_count); tot += b;
+        b = syms_bytes(); printf("syms: %d ", b); tot += b;
         printf(" === TOTAL: %d\n", tot);
     }
 
@@ -795,20 +1618,122 @@ void report_allocs(int verbose) {
     }
 }
 
+#define FIXMIN (-(1 << 29))
+#define FIXMAX ((1 << 29) - 1)
+
 lisp mkint(int v) {
-    return MKINT(v);
+    return v >= FIXMIN && v <= FIXMAX ? MKINT(v) : mkint64(v);
+}
 
-    // TODO: add "bigint" or minusint...
+// integers that overflow the fixnum get boxed on the heap, they are normalized
+// so the same value is never both a fixnum and boxed
+lisp mkint64(long long v) {
+    if (v >= FIXMIN && v <= FIXMAX) return MKINT(v);
     intint* r = ALLOC(intint);
     r->v = v;
     return (lisp)r;
 }
 
+// fixed point numbers are truncated (floor), floats toward zero, a boxed
+// int that doesn't fit is an error, not wrapped
 int getint(lisp x) {
-    return INTP(x) ? GETINT(x) : 0;
+    if (INTP(x)) return GETINT(x);
+    long long v = getint64(x);
+    if (v != (int)v) error("getint.integer doesn't fit in 32 bits");
+    return v;
+}
+
+long long getint64(lisp x) {
+    return INTP(x) ? GETINT(x) : FIXEDP(x) ? GETFIXED(x) >> FIXED_BITS : IS(x, intint) ? ATTR(intint, x, v) :
+        FLOATP(x) ? (long long)ATTR(floatt, x, v) : 0;
+}
+
+#ifdef UNIX
+// float_allocs/float_ops is what (float-stats) shows, see float_ret()
+static int float_ops = 0, float_allocs = 0, float_reused = 0;
+
+lisp mkfloat(double v) {
+    floatt* r = ALLOC(floatt);
+    r->v = v;
+    float_allocs++;
+    return (lisp)r;
+}
+
+double getfloat(lisp x) {
+    return INTP(x) ? GETINT(x) : FLOATP(x) ? ATTR(floatt, x, v) : FIXEDP(x) ? GETFIXED(x) / (double)FIXED_ONE :
+        IS(x, intint) ? ATTR(intint, x, v) : 0;
+}
+
+// (float-stats) => ((ops . 7000) (alloc . 2000) (reused . 5000))
+// float arithmetic done, floats allocated and results stored in a temporary instead
+// (float-stats t) resets
+PRIM float_stats(lisp reset) {
+    lisp r = list(cons(symbol("ops"), mkint(float_ops)),
+                  cons(symbol("alloc"), mkint(float_allocs)),
+                  cons(symbol("reused"), mkint(float_reused)),
+                  END);
+    if (reset) float_ops = float_allocs = float_reused = 0;
+    return r;
+}
+#endif
+
+// decimal of a (boxed) int, without needing %lld from printf
+static char* int2str(lisp x, char s[22]) {
+    long long v = getint64(x);
+    unsigned long long u = v < 0 ? -(unsigned long long)v : v;
+    char* p = s + 21;
+    *p = 0;
+    do { *--p = '0' + u % 10; } while (u /= 10);
+    if (v < 0) *--p = '-';
+    return p;
+}
+
+#ifdef UNIX
+// shortest that reads back the same, with d for exponent so it reads as a float: 0.1d0 1d-07
+static char* float2str(lisp x, char s[32]) {
+    double v = ATTR(floatt, x, v);
+    int p;
+    for(p = 1; p < 17; p++) {
+        snprintf(s, 26, "%.*g", p, v);
+        if (strtod(s, NULL) == v) break;
+    }
+    snprintf(s, 26, "%.*g", p, v);
+    char* e = strchr(s, 'e');
+    if (e) {
+        *e = 'd';
+        if (e[1] == '+') memmove(e + 1, e + 2, strlen(e + 2) + 1);
+    } else if (v == v && v - v == 0) { // not nan/inf
+        strcat(s, strchr(s, '.') ? "d0" : ".0d0");
+    }
+    return s;
+}
+#endif
 
-    // TODO: add "bigint" or minusint...
-    return IS(x, intint) ? ATTR(intint, x, v) : 0;
+// decimal of a fixed point, the fewest decimals that read back as the same number (max 4)
+static char* fixed2str(lisp x, char s[22]) {
+    int q = GETFIXED(x), d = 1;
+    unsigned int u = q < 0 ? -q : q, fr = u & (FIXED_ONE - 1), m = 10, f;
+    unsigned int i = u >> FIXED_BITS;
+    for(;; d++, m *= 10) {
+        f = (fr * m + FIXED_ONE / 2) >> FIXED_BITS;
+        if (d == 4 || (f * FIXED_ONE + m / 2) / m == fr) break;
+    }
+    if (f == m) { i++; f = 0; }
+    char* p = s + 21;
+    *p = 0;
+    while (d--) { *--p = '0' + f % 10; f /= 10; }
+    *--p = '.';
+    do { *--p = '0' + i % 10; } while (i /= 10);
+    if (q < 0) *--p = '-';
+    return p;
+}
+
+// text of the number x in s
+static char* num2str(lisp x, char s[32]) {
+#ifdef UNIX
+    if (FLOATP(x)) return float2str(x, s);
+#endif
+    return FIXEDP(x) ? fixed2str(x, s) : int2str(x, s);
 }
 
 PRIM eq(lisp a, lisp b);
@@ -965,10 +1890,12 @@ int web_socket = 0;
 int web_one() {
     int r = -1;
     if (!web_socket) return 0;
+    unwind_state u = unwind_save();
     if (setjmp(lisp_break) == 0) {
         r = httpd_next(web_socket, header, body, response);
     } else {
         printf("\n%%web_one.error... recovering...\n");
+        unwind(u);
     }
     // disable longjmp
     memset(lisp_break, 0, sizeof(lisp_break));
@@ -1036,106 +1963,207 @@ static struct stack {
     lisp* envp;
 } stack[MAX_STACK];
 
+// values of compiled functions, arguments and temporaries, see vm_run()
+#define VM_STACK 512
 
-// dummy function that doesn't eval, used instead of eval
-static PRIM noEval(lisp x, lisp* envp) { return x; }
+static lisp vm_stack[VM_STACK];
+static int vm_sp = 0;
 
-PRIM primapply(lisp ff, lisp args, lisp* envp, lisp all, int noeval) {
-    //printf("PRIMAPPLY "); princ(ff); putchar(' '); princ(args); putchar(' '); princ(*envp); terpri();
-    int n = GETPRIMNUM(ff);
-    lisp (*e)(lisp x, lisp* envp) = (noeval && n > 0) ? noEval : evalGC;
-    int an = abs(n);
-
-    int dotrace = tracep(ff);
-    if (!dotrace) {
-        // For optimization these special cases improve speed a lot!
-        if (n == 2) { // eq/plus etc
-            lisp (*fp)(lisp,lisp) = GETPRIMFUNC(ff);
-            return (*fp)(e(car(args), envp), e(car(cdr(args)), envp)); // safe!
-        }
-        if (n == -3) { // if...
-            lisp (*fp)(lisp*,lisp,lisp,lisp) = GETPRIMFUNC(ff);
-            return (*fp)(envp, car(args), car(cdr(args)), car(cdr(cdr(args))));
-        }
-        if (n == -1) { // quote...
-            lisp (*fp)(lisp*,lisp) = GETPRIMFUNC(ff);
-            return (*fp)(envp, car(args));
-        }
-        if (n == 1) {
-            lisp (*fp)(lisp) = GETPRIMFUNC(ff);
-            return (*fp)(e(car(args), envp));
-        }
-        if (n == 3) {
-            lisp (*fp)(lisp,lisp,lisp) = GETPRIMFUNC(ff);
-            return (*fp)(e(car(args), envp), e(car(cdr(args)), envp), e(car(cdr(cdr(args))),envp));
-        }
-        if (n == -7) { // lambda, quite uncommon
-            lisp (*fp)(lisp*,lisp,lisp) = GETPRIMFUNC(ff);
-            return (*fp)(envp, args, all);
-        }
+// libraries compiled to C, see lisp2c(), their constants are roots
+#define MAX_LIBS 8
 
-        // don't do evalist, but allocate array, better for GC
-        if (1 && an > 0 && an <= 6) {
-            if (n < 0) an++; // add one for neval and initial env
-            lisp argv[an];
-            int i;
-            for(i = 0; i < an; i++) {
-                // if noeval, put env first
-                if (i == 0 && n < 0) { 
-                    argv[0] = (lisp)envp;
-                    continue;
-                }
-                lisp a = car(args);
-                if (a && n > 0) a = e(a, envp);
-                argv[i] = a;
-                args = cdr(args);
-            }
-            lisp (*fp)() = GETPRIMFUNC(ff);
-            switch (an) {
-            case 1: return fp(argv[0]);
-            case 2: return fp(argv[0], argv[1]);
-            case 3: return fp(argv[0], argv[1], argv[2]);
-            case 4: return fp(argv[0], argv[1], argv[2], argv[3]);
-            case 5: return fp(argv[0], argv[1], argv[2], argv[3], argv[4]);
-            case 6: return fp(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
-            }
-        }
-    }
-    // above is all optimiziations
-    // this is the old fallback solution, simple and works but expensive
+static struct {
+    char* file;
+    void (*init)(lisp* envp);
+    lisp* consts;
+    int n;
+} libs[MAX_LIBS];
+static int nlibs = 0;
 
-    // prepare arguments
-    if (n >= 0) {
-        args = noeval ? args : evallist(args, envp);
-    } else if (n > -7) { // -1 .. -7 no-eval lambda, put env first
-        // TODO: for NLAMBDA this may not work...  may need a new lisp type
-        args = cons(*envp, args);
-    }
+void lisp_lib(char* file, void (*init)(lisp* envp), lisp* consts, int n) {
+    if (nlibs >= MAX_LIBS) return;
+    libs[nlibs].file = file;
+    libs[nlibs].init = init;
+    libs[nlibs].consts = consts;
+    libs[nlibs].n = n;
+    nlibs++;
+}
 
-    if (dotrace) {
-        indent(trace_level++); printf("---> "); princ(funame(ff));
-        prin1(args); terpri();
+// mark what is being evaluated, GC may be called from inside, like (gc)
+void mark_stack() {
+    int i;
+    for(i = 0; i <= level && i < MAX_STACK; i++) {
+        if (!stack[i].e) break;
+        mark(stack[i].e);
+        if (stack[i].envp) mark(*stack[i].envp);
     }
+    for(i = 0; i < vm_sp; i++) mark(vm_stack[i]);
+    int j;
+    for(i = 0; i < nlibs; i++) for(j = 0; j < libs[i].n; j++) mark(libs[i].consts[j]);
+}
+
+PRIM plus(int n, lisp* argv);
+PRIM times(int n, lisp* argv);
+PRIM minus(lisp a, lisp b);
+PRIM divide(lisp a, lisp b);
+
+// A float that only the prim being called has, because it comes right from
+// an arithmetic prim like the (* a b) in (+ (* a b) c), is put in float_temp
+// and the result is stored in it instead of allocating, see float_ret()
+static lisp float_temp = NULL;
+
+// e gave the value v, is it a float nobody else has? eval puts the prim in the call
+static inline lisp float_fresh(lisp e, lisp v) {
+    if (!FLOATP(v) || !IS(e, conss) || !PRIMP(car(e))) return NULL;
+    void* f = getprimfunc(car(e));
+    return f == plus || f == times || f == minus || f == divide ? v : NULL;
+}
+
+// Prims are called by a caller for their calling convention, GETPRIMNUM()
+// + 7 indexes prim_call[]: n > 0 evaluated args, -n the env and n args
+// not evaluated, 7 a list, -7 the unevaluated list and PRIM_ARGV an argv
+// on vm_stack, no consing. Args are evaluated left to right and pushed on
+// vm_stack, evaluating the next one may GC, popped when the prim returns.
+#define PRIM_CALL lisp ff, lisp args, lisp* envp, lisp all, int noeval
+#define PA_NEXT(v) lisp v = car(args); args = cdr(args); if (!noeval) v = evalGC(v, envp); \
+    if (vm_sp >= VM_STACK) error("VM stack blowup!"); \
+    vm_stack[vm_sp++] = v
+#define PA_NEXTQ(v) lisp v = car(args); args = cdr(args)
+
+static lisp pa_0(PRIM_CALL) { lisp (*fp)() = GETPRIMFUNC(ff); return fp(); }
+static lisp pa_1(PRIM_CALL) {
+    int sp = vm_sp;
+    PA_NEXT(a);
+    lisp (*fp)(lisp) = GETPRIMFUNC(ff);
+    lisp r = fp(a);
+    vm_sp = sp;
+    return r;
+}
+static lisp pa_2(PRIM_CALL) {
+    int sp = vm_sp;
+    lisp ea = car(args);
+    PA_NEXT(a);
+    lisp eb = car(args);
+    PA_NEXT(b);
+    lisp (*fp)(lisp, lisp) = GETPRIMFUNC(ff);
+    if ((fp == minus || fp == divide) && !noeval) float_temp = float_fresh(ea, a) ?: float_fresh(eb, b);
+    lisp r = fp(a, b);
+    vm_sp = sp;
+    return r;
+}
+static lisp pa_3(PRIM_CALL) {
+    int sp = vm_sp;
+    PA_NEXT(a); PA_NEXT(b); PA_NEXT(c);
+    lisp (*fp)(lisp, lisp, lisp) = GETPRIMFUNC(ff);
+    lisp r = fp(a, b, c);
+    vm_sp = sp;
+    return r;
+}
+static lisp pa_4(PRIM_CALL) {
+    int sp = vm_sp;
+    PA_NEXT(a); PA_NEXT(b); PA_NEXT(c); PA_NEXT(d);
+    lisp (*fp)(lisp, lisp, lisp, lisp) = GETPRIMFUNC(ff);
+    lisp r = fp(a, b, c, d);
+    vm_sp = sp;
+    return r;
+}
+static lisp pa_5(PRIM_CALL) {
+    int sp = vm_sp;
+    PA_NEXT(a); PA_NEXT(b); PA_NEXT(c); PA_NEXT(d); PA_NEXT(e);
+    lisp (*fp)(lisp, lisp, lisp, lisp, lisp) = GETPRIMFUNC(ff);
+    lisp r = fp(a, b, c, d, e);
+    vm_sp = sp;
+    return r;
+}
+static lisp pa_6(PRIM_CALL) {
+    int sp = vm_sp;
+    PA_NEXT(a); PA_NEXT(b); PA_NEXT(c); PA_NEXT(d); PA_NEXT(e); PA_NEXT(f);
+    lisp (*fp)(lisp, lisp, lisp, lisp, lisp, lisp) = GETPRIMFUNC(ff);
+    lisp r = fp(a, b, c, d, e, f);
+    vm_sp = sp;
+    return r;
+}
+static lisp pa_7(PRIM_CALL) {
+    lisp (*fp)(lisp*, lisp, lisp) = GETPRIMFUNC(ff);
+    return fp(envp, noeval ? args : evallist(args, envp), all);
+}
 
-    lisp r;
-    if (abs(n) == 7) {
-        lisp (*fp)(lisp*, lisp, lisp) = GETPRIMFUNC(ff);
-        r = fp(envp, args, all);
-    } else {
-        lisp a = args, b = cdr(a), c = cdr(b), d = cdr(c), e = cdr(d), f = cdr(e), g = cdr(f), h = cdr(g), i = cdr(h), j = cdr(i);
-        // with C calling convention it's ok, but maybe not most efficient...
-        lisp (*fp)(lisp, lisp, lisp, lisp, lisp, lisp, lisp, lisp, lisp, lisp) = GETPRIMFUNC(ff);
-        r = fp(car(a), car(b), car(c), car(d), car(e), car(f), car(g), car(h), car(i), car(j));
-    }
+static lisp pa_q1(PRIM_CALL) { lisp (*fp)(lisp*, lisp) = GETPRIMFUNC(ff); return fp(envp, car(args)); }
+static lisp pa_q2(PRIM_CALL) { PA_NEXTQ(a); lisp (*fp)(lisp*, lisp, lisp) = GETPRIMFUNC(ff); return fp(envp, a, car(args)); }
+static lisp pa_q3(PRIM_CALL) { // if...
+    PA_NEXTQ(a); PA_NEXTQ(b);
+    lisp (*fp)(lisp*, lisp, lisp, lisp) = GETPRIMFUNC(ff);
+    return fp(envp, a, b, car(args));
+}
+static lisp pa_q4(PRIM_CALL) {
+    PA_NEXTQ(a); PA_NEXTQ(b); PA_NEXTQ(c);
+    lisp (*fp)(lisp*, lisp, lisp, lisp, lisp) = GETPRIMFUNC(ff);
+    return fp(envp, a, b, c, car(args));
+}
+static lisp pa_q5(PRIM_CALL) {
+    PA_NEXTQ(a); PA_NEXTQ(b); PA_NEXTQ(c); PA_NEXTQ(d);
+    lisp (*fp)(lisp*, lisp, lisp, lisp, lisp, lisp) = GETPRIMFUNC(ff);
+    return fp(envp, a, b, c, d, car(args));
+}
+static lisp pa_q6(PRIM_CALL) {
+    PA_NEXTQ(a); PA_NEXTQ(b); PA_NEXTQ(c); PA_NEXTQ(d); PA_NEXTQ(e);
+    lisp (*fp)(lisp*, lisp, lisp, lisp, lisp, lisp, lisp) = GETPRIMFUNC(ff);
+    return fp(envp, a, b, c, d, e, car(args));
+}
+static lisp pa_q7(PRIM_CALL) { // lambda, cond, progn...
+    lisp (*fp)(lisp*, lisp, lisp) = GETPRIMFUNC(ff);
+    return fp(envp, args, all);
+}
 
-    if (dotrace) {
-        indent(--trace_level); printf("<--- ");
-        prin1(funame(ff)); printf(" ==> "); princ(r); terpri();
+// the argv is the args PA_NEXT pushed on vm_stack
+static lisp pa_argv(PRIM_CALL) {
+    lisp (*fp)(int, lisp*) = GETPRIMFUNC(ff);
+    int sp = vm_sp, arith = fp == plus || fp == times, r;
+    lisp temp = NULL;
+    while (args) {
+        lisp e = car(args);
+        PA_NEXT(a);
+        if (arith && !temp && !noeval) temp = float_fresh(e, a);
+    }
+    lisp* argv = &vm_stack[sp];
+    int n = vm_sp - sp;
+    // (+ a b) and (* a b) of fixnums without a call
+    if (arith && n == 2 && (fp == plus ? FIXADD(argv[0], argv[1], r) : FIXMUL(argv[0], argv[1], r))) {
+        vm_sp = sp;
+        return FIXTAGGED(r);
     }
+    float_temp = temp;
+    lisp v = fp(n, argv);
+    vm_sp = sp;
+    return v;
+}
+
+static lisp (*const prim_call[16])(PRIM_CALL) = {
+    pa_q7, pa_q6, pa_q5, pa_q4, pa_q3, pa_q2, pa_q1,
+    pa_0, pa_1, pa_2, pa_3, pa_4, pa_5, pa_6, pa_7, pa_argv
+};
+
+// traced, args are evaluated to a list first to be printed
+static lisp primapply_trace(lisp ff, lisp args, lisp* envp, lisp all, int noeval) {
+    int n = GETPRIMNUM(ff);
+    if (n > 0 && !noeval) args = evallist(args, envp);
+
+    indent(trace_level++); printf("---> "); princ(funame(ff));
+    prin1(args); terpri();
 
+    lisp r = prim_call[n + 7](ff, args, envp, all, n > 0 || noeval);
+
+    indent(--trace_level); printf("<--- ");
+    prin1(funame(ff)); printf(" ==> "); princ(r); terpri();
     return r;
 }
 
+PRIM primapply(lisp ff, lisp args, lisp* envp, lisp all, int noeval) {
+    //printf("PRIMAPPLY "); princ(ff); putchar(' '); princ(args); putchar(' '); princ(*envp); terpri();
+    if (tracep(ff)) return primapply_trace(ff, args, envp, all, noeval);
+    return prim_call[GETPRIMNUM(ff) + 7](ff, args, envp, all, noeval);
+}
+
 // TODO: not used??? this can be used to implement generators
 static inline lisp mkthunk(lisp e, lisp env) {
     thunk* r = ALLOC(thunk);
@@ -1148,8 +2176,19 @@ static inline lisp mkthunk(lisp e, lisp env) {
 // this implements continuation based evaluation thus maybe allowing tail recursion...
 // these are used to avoid stack growth on self/mutal recursion functions
 // if, lambda, progn etc return these instead of calling eval on the tail
+//
+// They aren't allocated, there is one per level, reduce_immediate() takes
+// out e and env before evaluating, so the next tail call can reuse it.
+// Before each was ALLOC:ed and sfree:d directly after.
+//
+// (fibo 20) ALLOC:ed 43782 immediates (1MB on unix), now none, only the
+// conses binding arguments. (fibo 24) unix 39 ms -> 38 ms.
+static immediate immediates[MAX_STACK + 1] __attribute__ ((aligned (8)));
+
 static inline lisp mkimmediate(lisp e, lisp env) {
-    immediate* r = ALLOC(immediate); //(thunk*)mkthunk(e, env); // inherit from func_TAG
+    immediate* r = &immediates[level];
+    r->tag = immediate_TAG;
+    r->index = -1;
     r->e = e;
     r->env = env;
     return (lisp)r;
@@ -1158,9 +2197,11 @@ static inline lisp mkimmediate(lisp e, lisp env) {
 // these are formed by evaluating a lambda
 PRIM mkfunc(lisp e, lisp env) {
     func* r = ALLOC(func);
+    r->xx = 0;
     r->e = e;
     r->env = env;
     r->name = nil;
+    r->code = nil;
     return (lisp)r;
 }
 
@@ -1182,63 +2223,270 @@ PRIM funame(lisp f) { // fun-name lol (6 char) => funame
 
 ////////////////////////////// GC
 
-#define FLASHP(x) ((unsigned int)next >= (unsigned int)flash_memory && ((unsigned int)next <= (unsigned int)(flash_memory + SPI_FLASH_SIZE_BYTES - FS_ADDRESS)))
+// Marking doesn't recurse in C, the lisp task on esp8266 only has ~2KB stack,
+// deeply nested car chains (xml, alists, code) would blow it. mark_from()
+// follows one child and pushes the other on mark_todo[]. If that's full the
+// object is marked but not scanned, then mark_rescan() scans all marked
+// objects again until nothing more gets marked.
+//
+// (bench-mark 100000) in SPIFFS/bench.lsp, unix:
+//   recursive:     6-7ms, 100000 deep C recursion
+//   mark_todo[]:   4ms, (gc-stats) depth 6
+#define MARK_TODO_MAX 64
+
+lisp mark_todo[MARK_TODO_MAX];
+int mark_todo_count = 0;
+int mark_depth_max = 0;
+static int mark_overflow = 0;
+
+// heap objects with children: thunk, immediate, func, frame (e, env), substring (parent), code (consts)
+#define SCANP(x) (TAG(x) == thunk_TAG || TAG(x) == immediate_TAG || TAG(x) == func_TAG || TAG(x) == frame_TAG || \
+    TAG(x) == code_TAG || (TAG(x) == string_TAG && ATTR(string, x, xx) == STRING_VIEW))
+
+// global binding used by code, not in a cons segment, syms_mark() marks them
+static inline int symbindp(lisp x) {
+    return CONSP(x) && CONS_SEGMENT(x)->self != CONS_SEGMENT(x);
+}
+
+// mark x, return 1 if it has children to scan (cons, thunk, immediate, func, frame, substring)
+static int mark1(lisp x) {
+    if (!x) return 0;
+    if (LONGP(x)) { // mark the rest of the longcons, including last cdr
+        int i = LONG_I(x), n = LONG_N(x) + LONG_T(x);
+        if (LONG_IS(long_used, i)) return 0;
+        for(; n > 0; i++, n--) LONG_SET(long_used, i);
+        return 1;
+    }
+    // -- pointer contains tag, an int may look like a pointer to flash
+    if (INTP(x) || FIXEDP(x) || SYMP(x) || PRIMP(x)) return 0;
+    // -- pointer to FLASH? no follow...
+    if (FLASHP(x)) {
+        printf("[mark.flash %x]\n", (unsigned int)x);
+        return 0;
+    }
+    if (CONSP(x)) {
+        cons_segment* seg = CONS_SEGMENT(x);
+        int i = GETCONS(x) - &seg->cells[0];
+        if (seg->self != seg || i < 0 || i >= CONS_SEGMENT_CELLS) { // pointing to other RAM/FLASH not allocated to cons segment
+            printf("mark.cons.badcons i=%d    %u segments=%d\n", i, (int)x, cons_segments_count);
+            exit(1);
+        }
+        if (CONS_IS_USED(seg, i)) return 0; // already checked!
+        CONS_SET_USED(seg, i);
+        return 1;
+    }
+    // -- generic pointer to heap allocated object with type tag
+    // optimization, we store index position in element
+    int index = x->index;
+    if (index < 0) return 0; // no tracked here
+    if (index >= allocs_next) {
+        printf("\n--- ERROR: mark_deep - corrupted data p=%u   index=%d\n", (unsigned int)x, index);
+        printf("VALUE="); princ(x); terpri();
+    }
+
+    lisp p = allocs[index];
+    if (!p || p != x) {
+        printf("\n-- ERROR: mark_deep - index %d doesn't contain pointer. p=%u\n", index, (unsigned int)x);
+    }
 
-void mark_deep(lisp next, int deep) {
-    while (next) {
-        // -- pointer to FLASH? no follow...
-        if (FLASHP(next)) {
-            printf("[mark.flash %x]\n", (unsigned int)next);
+    if (IS_USED(index)) return 0;
+    SET_USED(index);
+
+    return SCANP(x);
+}
+
+// a is marked, scan it later
+static inline void mark_push(lisp a) {
+    if (mark_todo_count < MARK_TODO_MAX) {
+        mark_todo[mark_todo_count++] = a;
+        if (mark_todo_count > mark_depth_max) mark_depth_max = mark_todo_count;
+    } else {
+        mark_overflow = 1; // a is marked but not scanned
+    }
+}
+
+// scan the children of marked next, and theirs...
+static void mark_from(lisp next) {
+    while (1) {
+        lisp a, b;
+        if (CONSP(next)) {
+            a = GETCONS(next)->car;
+            b = GETCONS(next)->cdr;
+        } else if (LONGP(next)) { // all but last car later
+            int i = LONG_I(next), n = LONG_N(next);
+            for(; n > 1; i++, n--) if (mark1(long_slot(i))) mark_push(long_slot(i));
+            a = long_slot(i);
+            b = LONG_TAIL(next);
+        } else if (TAG(next) == string_TAG) { // substring
+            a = ATTR(stringview, next, parent);
+            b = nil;
+        } else if (TAG(next) == code_TAG) { // consts later
+            int i;
+            for(i = 0; i < ATTR(code, next, nconsts); i++) {
+                lisp k = ATTR(code, next, consts)[i];
+                if (!symbindp(k) && mark1(k)) mark_push(k);
+            }
+            a = b = nil;
+        } else {
+            if (TAG(next) == frame_TAG) { // slots later
+                int i;
+                for(i = 0; i < next->xx; i++) if (mark1(ATTR(frame, next, slots)[i])) mark_push(ATTR(frame, next, slots)[i]);
+            }
+            if (TAG(next) == func_TAG && mark1(ATTR(func, next, code))) mark_push(ATTR(func, next, code));
+            a = ATTR(thunk, next, e);
+            b = ATTR(thunk, next, env);
+        }
+        int ma = mark1(a), mb = mark1(b);
+        if (ma && mb) {
+            mark_push(a);
+            next = b;
+        } else if (ma) {
+            next = a;
+        } else if (mb) {
+            next = b;
+        } else if (mark_todo_count) {
+            next = mark_todo[--mark_todo_count];
+        } else {
             return;
         }
-        // -- pointer contains tag
-        if (INTP(next)) return;
-        if (SYMP(next)) return;
-        if (PRIMP(next)) return;
-	if (CONSP(next)) {
-	    int i = (conss*)next - &conses[0];
-            if (i >= MAX_CONS) { // pointing to other RAM/FLASH not allocated to cons array
-                printf("mark.cons.badcons i=%d    %u max=%d\n", i, (int)next, MAX_CONS);
-                exit(1);
+    }
+}
+
+// mark_todo[] overflowed, scan all marked objects, cheaper than recursion
+static void mark_rescan() {
+    while (mark_overflow) {
+        mark_overflow = 0;
+        cons_segment* seg;
+        for(seg = cons_segments; seg; seg = seg->next) {
+            int i;
+            for(i = 0; i < CONS_SEGMENT_CELLS; i++) {
+                if (CONS_IS_USED(seg, i))
+                    mark_from(MKCONS(&seg->cells[i]));
             }
-            if (CONS_IS_USED(i)) return; // already checked!
-  	    CONS_SET_USED(i);
-  	    mark_deep(car(next), deep+1);
-	    next = cdr(next);
-	    continue;
-	}
-        // -- generic pointer to heap allocated object with type tag
-        // optimization, we store index position in element
-        int index = next->index;
-        if (index < 0) return; // no tracked here
-        if (index >= MAX_ALLOCS) {
-            printf("\n--- ERROR: mark_deep - corrupted data p=%u   index=%d\n", (unsigned int)next, index);
-            printf("VALUE="); princ(next); terpri();
         }
+        int i;
+        for(i = 0; i < longs_size; i++) {
+            lisp v = long_slot(i);
+            if (LONG_IS(long_used, i) && mark1(v)) mark_from(v);
+        }
+        for(i = 0; i < allocs_next; i++) {
+            lisp p = allocs[i];
+            if (p && IS_USED(i) && SCANP(p)) mark_from(p);
+        }
+    }
+}
 
-        lisp p = allocs[index];
-        if (!p || p != next) {
-            printf("\n-- ERROR: mark_deep - index %d doesn't contain pointer. p=%u\n", index, (unsigned int)next);
-            //printf("pppp = 0x%u and next = 0x%u \n", p, next);
-            //princ(next);
-            //return;
-        } 
-        
-        if (IS_USED(index)) return;
+void mark_deep(lisp next, int deep) {
+    if (mark1(next)) mark_from(next);
+    if (mark_overflow) mark_rescan();
+}
 
-        SET_USED(index);
-        //printf("Marked %i deep %i :: p=%u ", index, deep, p); princ(p); terpri();
-            
-        int tag = TAG(p);
-        if (tag == thunk_TAG || tag == immediate_TAG || tag == func_TAG) {
-            mark_deep(ATTR(thunk, p, e), deep+1);
-            next = ATTR(thunk, p, env);
+inline void mark(lisp x) {
+    if (gc_phase == GC_MARK) shade(x); else mark_deep(x, 1);
+}
+
+// incremental GC, see myMalloc
+int gc_sweep_i = 0;
+int gc_swept = 0;
+
+// start a major GC, only roots are shaded, gc_step() does the rest
+static void gc_begin(lisp* envp) {
+    mark_clean();
+    gc_conses_clean();
+    gc_longs_clean();
+    remembered_count = 0;
+    grey_count = 0;
+    gc_drained = 0;
+    gc_phase = GC_MARK;
+    gc_incremental_count++;
+
+    syms_mark();
+    mark_stack();
+    if (envp) mark(*envp);
+}
+
+static void gc_sweep_done() {
+    gc_phase = GC_IDLE;
+    gc_major = 0;
+    gc_major_count++;
+    allocs_young_count = 0;
+    if (allocs_count > allocs_size / 2) allocs_grow();
+    gc_live();
+    mem_usage(gc_swept);
+}
+
+// do budget work of incremental GC, scan grey objects or sweep
+static void gc_work(int budget) {
+    if (gc_phase == GC_MARK) {
+        while (budget-- > 0 && grey_count) {
+            lisp x = grey[--grey_count];
+            if (CONSP(x)) {
+                shade(GETCONS(x)->car);
+                shade(GETCONS(x)->cdr);
+                continue;
+            }
+            if (LONGP(x)) {
+                int i = LONG_I(x), n = LONG_N(x);
+                for(; n > 0; i++, n--) shade(long_slot(i));
+                shade(LONG_TAIL(x));
+                continue;
+            }
+            if (!SCANP(x)) continue;
+            if (TAG(x) == string_TAG) {
+                shade(ATTR(stringview, x, parent));
+            } else if (TAG(x) == code_TAG) {
+                int i;
+                for(i = 0; i < ATTR(code, x, nconsts); i++)
+                    if (!symbindp(ATTR(code, x, consts)[i])) shade(ATTR(code, x, consts)[i]);
+            } else {
+                if (TAG(x) == frame_TAG) {
+                    int i;
+                    for(i = 0; i < x->xx; i++) shade(ATTR(frame, x, slots)[i]);
+                }
+                if (TAG(x) == func_TAG) shade(ATTR(func, x, code));
+                shade(ATTR(thunk, x, e));
+                shade(ATTR(thunk, x, env));
+            }
         }
+        if (!grey_count) gc_drained = 1;
+    } else if (gc_phase == GC_SWEEP) {
+        // conses are swept lazily by cons()
+        while (budget-- > 0 && gc_sweep_i < allocs_next) gc_swept += gc_sweep(gc_sweep_i++);
+        if (gc_sweep_i >= allocs_next) gc_sweep_done();
     }
 }
 
-inline void mark(lisp x) {
-    mark_deep(x, 1);
+void gc_step(int budget) {
+    unsigned int start = clock_us();
+    gc_work(budget);
+    gc_steps++;
+    gc_pause(start, &gc_step_max);
+}
+
+// grey[] is empty, at a safe point rescan the roots and start sweeping
+static void gc_finish(lisp* envp) {
+    syms_mark();
+    mark_stack();
+    if (envp) mark(*envp);
+    gc_work(0x7fffffff);
+    gc_conses(1);
+
+    gc_phase = GC_SWEEP;
+    gc_sweep_i = 0;
+    gc_swept = 0;
+}
+
+// at a safe point (evalGC or idle): begin incremental GC, or finish its marking
+static void gc_safepoint(lisp* envp) {
+    unsigned int start = clock_us();
+    if (gc_phase == GC_MARK && gc_drained) {
+        gc_finish(envp);
+        gc_pause(start, &gc_step_max);
+        return;
+    }
+    if (gc_phase) return;
+    gc_begin(envp);
+    gc_pause(start, &gc_step_max);
 }
 
 ///--------------------------------------------------------------------------------
@@ -1254,7 +2502,7 @@ PRIM consp(lisp a) { return IS(a, conss) ? t : nil; }
 PRIM atomp(lisp a) { return IS(a, conss) ? nil : t; }
 PRIM stringp(lisp a) { return IS(a, string) ? t : nil; }
 PRIM symbolp(lisp a) { return IS(a, symboll) ? t : nil; } // rename struct symbol to symbol?
-PRIM numberp(lisp a) { return IS(a, intint) ? t : nil; } // TODO: extend with float/real
+PRIM numberp(lisp a) { return IS(a, intint) || FIXEDP(a) || FLOATP(a) ? t : nil; }
 PRIM integerp(lisp a) { return IS(a, intint) ? t : nil; }
 PRIM funcp(lisp a) { return IS(a, func) || IS(a, thunk) || IS(a, prim) ? t : nil; }
 
@@ -1265,28 +2513,133 @@ PRIM iota(lisp count, lisp start, lisp step) {
                 iota(mkint(c-1), mkint(getint(start) + (step?getint(step):1)), step));
 }
 
-PRIM plus(lisp *envp, lisp x) {
-    int s = 0;
-    while (x) {
-        s += getint(evalGC(car(x), envp));
-        x = cdr(x);
+// PRIM_ARGV, no intermediate list, (+ a b) of fixnums doesn't even get
+// here, see pa_argv()
+// fixed point value of a number, ints too big to be fixed get a value that mkfixed() rejects
+static long long getq(lisp x) {
+    if (FIXEDP(x)) return GETFIXED(x);
+    long long v = getint64(x);
+    return v > (1 << 20) ? 1LL << 32 : v < -(1 << 20) ? -(1LL << 32) : v * FIXED_ONE;
+}
+
+// no promotion like for ints, out of range is an error
+static lisp mkfixed(long long q) {
+    if (q < -(1 << 27) || q >= (1 << 27)) error("fixed point overflow");
+    return MKFIXED(q);
+}
+
+#ifdef UNIX
+// a float result of arithmetic, stored in float_temp if set, see float_fresh()
+static lisp float_ret(double v) {
+    lisp r = float_temp;
+    float_ops++;
+    if (!r) return mkfloat(v);
+    float_temp = NULL;
+    float_reused++;
+    ATTR(floatt, r, v) = v;
+    return r;
+}
+#endif
+
+// the widest kind of number in argv: 0 ints, 1 fixed point, 2 float
+static int numkind(int n, lisp* argv) {
+    int k = 0;
+    while (n--) {
+        lisp x = *argv++;
+        if (INTP(x)) continue;
+        if (FIXEDP(x)) k = 1;
+        else if (FLOATP(x)) return 2;
     }
-    return mkint(s);
+    return k;
 }
-// because evallist is expensive, these can be quite expensive
-// better not build up intermidate structure... thats why -7 (no eval)
-PRIM times(lisp *envp, lisp x) {
-    int p = 1;
-    while (x) {
-        p *= getint(evalGC(car(x), envp));
-        x = cdr(x);
+
+// overflowing the fixnum promotes to a boxed int, overflowing that is an error,
+// any fixed point argument makes it fixed point, any float float
+PRIM plus(int n, lisp* argv) {
+    int r;
+    if (n == 2 && FIXADD(argv[0], argv[1], r)) return FIXTAGGED(r);
+    long long s = 0;
+    int k = numkind(n, argv);
+#ifdef UNIX
+    if (k == 2) {
+        double f = 0;
+        while (n--) f += getfloat(*argv++);
+        return float_ret(f);
+    }
+#endif
+    if (k) {
+        while (n--) s += getq(*argv++);
+        return mkfixed(s);
+    }
+    while (n--) if (__builtin_add_overflow(s, getint64(*argv++), &s)) error("+.integer overflow");
+    return mkint64(s);
+}
+
+PRIM times(int n, lisp* argv) {
+    int r;
+    if (n == 2 && FIXMUL(argv[0], argv[1], r)) return FIXTAGGED(r);
+    int k = numkind(n, argv);
+#ifdef UNIX
+    if (k == 2) {
+        double f = 1;
+        while (n--) f *= getfloat(*argv++);
+        return float_ret(f);
+    }
+#endif
+    if (k) {
+        long long q = FIXED_ONE;
+        while (n--) q = GETFIXED(mkfixed((q * getq(*argv++) + FIXED_ONE / 2) >> FIXED_BITS));
+        return MKFIXED(q);
+    }
+    long long p = 1;
+    while (n--) if (__builtin_mul_overflow(p, getint64(*argv++), &p)) error("*.integer overflow");
+    return mkint64(p);
+}
+
+PRIM minus(lisp a, lisp b) {
+    int r;
+    if (FIXSUB(a, b, r)) return FIXTAGGED(r);
+#ifdef UNIX
+    if (FLOATP(a) || FLOATP(b)) return float_ret(b ? getfloat(a) - getfloat(b) : -getfloat(a));
+#endif
+    if (FIXEDP(a) || FIXEDP(b)) return mkfixed(b ? getq(a) - getq(b) : -getq(a));
+    long long x = b ? getint64(a) : 0, y = getint64(b ? b : a), d;
+    if (__builtin_sub_overflow(x, y, &d)) error("-.integer overflow");
+    return mkint64(d);
+}
+
+PRIM divide(lisp a, lisp b) {
+    if (INTP(a) && INTP(b) && GETINT(b)) return mkint(GETINT(a) / GETINT(b)); // -2^29 / -1 doesn't fit
+#ifdef UNIX
+    if (FLOATP(a) || FLOATP(b)) return float_ret(getfloat(a) / getfloat(b));
+#endif
+    if (FIXEDP(a) || FIXEDP(b)) {
+        long long q = getq(b);
+        if (!q) error("/.division by zero");
+        return mkfixed(getq(a) * FIXED_ONE / q);
     }
-    return mkint(p);
+    long long y = getint64(b);
+    if (!y) error("/.division by zero");
+    return y == -1 ? minus(a, nil) : mkint64(getint64(a) / y);
 }
 
-PRIM minus(lisp a, lisp b) { return b ? mkint(getint(a) - getint(b)) : mkint(-getint(a)); }
-PRIM divide(lisp a, lisp b) { return mkint(getint(a) / getint(b)); }
-PRIM mod(lisp a, lisp b) { return mkint(getint(a) % getint(b)); }
+PRIM mod(lisp a, lisp b) {
+    if (INTP(a) && INTP(b) && GETINT(b)) return MKINT(GETINT(a) % GETINT(b));
+#ifdef UNIX
+    if (FLOATP(a) || FLOATP(b)) { // no fmod(), not linking libm
+        double x = getfloat(a), y = getfloat(b);
+        return float_ret(x - y * (double)(long long)(x / y));
+    }
+#endif
+    if (FIXEDP(a) || FIXEDP(b)) {
+        long long q = getq(b);
+        if (!q) error("%.division by zero");
+        return mkfixed(getq(a) % q);
+    }
+    long long y = getint64(b);
+    if (!y) error("%.division by zero");
+    return mkint64(y == -1 ? 0 : getint64(a) % y);
+}
 PRIM random_(lisp a, lisp b) {
   // randomize
   int ia = getint(a);
@@ -1329,10 +2682,16 @@ PRIM eq(lisp a, lisp b) {
     // TODO: revisit, if no values on the heap then just return false;
     char ta = TAG(a);
     char tb = TAG(b);
+    // a resolved variable in data is still its name, see resolve()
+    if (ta == var_TAG || tb == var_TAG)
+        return eq(ta == var_TAG ? ATTR(var, a, name) : a, tb == var_TAG ? ATTR(var, b, name) : b);
     if (ta != tb) return nil;
-    // only int needs to be eq with other int even if on heap...
+    // only int needs to be eq with other int even if on heap... and float
+#ifdef UNIX
+    if (ta == floatt_TAG) return getfloat(a) == getfloat(b) ? t : nil;
+#endif
     if (ta != intint_TAG) return nil;
-    if (getint(a) == getint(b)) return t;
+    if (getint64(a) == getint64(b)) return t;
     return nil;
 }
 
@@ -1349,9 +2708,20 @@ int cmp(lisp a, lisp b) {
         lisp r = eq(a, b);
         if (r) return 0;
         char taga = TAG(a), tagb = TAG(b);
+#ifdef UNIX
+        if ((taga == floatt_TAG || tagb == floatt_TAG) && numberp(a) && numberp(b))
+            return getfloat(a) < getfloat(b) ? -1 : getfloat(a) > getfloat(b) ? +1 : 0;
+#endif
+        if ((taga == fixed_TAG && (tagb == fixed_TAG || tagb == intint_TAG)) || (tagb == fixed_TAG && taga == intint_TAG))
+            return getq(a) < getq(b) ? -1 : getq(a) > getq(b) ? +1 : 0;
         if (taga != tagb) return taga < tagb ? -2 : +2;
-        if (taga == intint_TAG) return getint(a) < getint(b) ? -1 : a > b ? +1 : 0;
-        if (taga == string_TAG) return strcmp(getstring(a), getstring(b));
+        if (taga == intint_TAG) return getint64(a) < getint64(b) ? -1 : getint64(a) > getint64(b) ? +1 : 0;
+        if (taga == string_TAG) {
+            if (string_equal(a, b)) return 0;
+            int la = ATTR(string, a, len), lb = ATTR(string, b, len);
+            int r = memcmp(string_chars(a), string_chars(b), la < lb ? la : lb);
+            return r ? r : la - lb;
+        }
         if (SYMP(a) && SYMP(b)) {
           char as[7] = {0}, bs[7] = {0}, *ap = NULL, *bp = NULL;
           ap = HSYMP(a) ? symbol_getString(a) : sym2str(a, as);
@@ -1371,15 +2741,71 @@ PRIM cmp_(lisp a, lisp b) {
     return mkint(cmp(a, b));
 }
 
+// fixnums are compared directly, cmp() only for the rest
 PRIM equal(lisp a, lisp b) {
+    if (INTP(a) && INTP(b)) return a == b ? t : nil;
+    // different hash => not equal, no need to compare
+    if (IS(a, string) && IS(b, string)) return string_equal(a, b) ? t : nil;
     return cmp(a, b) ? nil : t;
 }
 
-PRIM lt (lisp a, lisp b) { return cmp(a, b) <  0 ? t : nil; }
-PRIM lte(lisp a, lisp b) { return cmp(a, b) <= 0 ? t : nil; }
-PRIM gt (lisp a, lisp b) { return cmp(a, b) >  0 ? t : nil; }
-PRIM gte(lisp a, lisp b) { return cmp(a, b) >= 0 ? t : nil; }
+PRIM lt (lisp a, lisp b) { if (INTP(a) && INTP(b)) return GETINT(a) <  GETINT(b) ? t : nil; return cmp(a, b) <  0 ? t : nil; }
+PRIM lte(lisp a, lisp b) { if (INTP(a) && INTP(b)) return GETINT(a) <= GETINT(b) ? t : nil; return cmp(a, b) <= 0 ? t : nil; }
+PRIM gt (lisp a, lisp b) { if (INTP(a) && INTP(b)) return GETINT(a) >  GETINT(b) ? t : nil; return cmp(a, b) >  0 ? t : nil; }
+PRIM gte(lisp a, lisp b) { if (INTP(a) && INTP(b)) return GETINT(a) >= GETINT(b) ? t : nil; return cmp(a, b) >= 0 ? t : nil; }
+
+// Frames
+// ------
+// An env is a list of bindings (name . value), and frames. A function call
+// binds its arguments in a frame, the names are the fargs of the function,
+// the values are slots in the frame, no conses needed. define/let inside
+// still cons bindings onto it. A frame can't be a cons, so only code here
+// should walk an env, use env_find(), not assoc().
+//
+// Every call makes a frame, also with no arguments, so an env without
+// frames is outside of any function, see resolve().
+//
+// A call with 3 arguments was 6 conses (48 bytes on ESP), now one frame of
+// 24 bytes, and a lookup is a walk of the fargs, not of all the bindings.
+#define FRAME_MAX 127 // slots, more are bound as list
+
+// find binding of name in env, returns a cons (i = -1) or frame (slot i), or nil
+static inline lisp env_find(lisp env, lisp name, int* i) {
+    while (env) {
+        if (IS(env, frame)) {
+            lisp names = ATTR(frame, env, names);
+            int j = 0;
+            while (names) {
+                if (!IS(names, conss)) { // (a b . rest)
+                    if (names == name) { *i = j; return env; }
+                    break;
+                }
+                if (car(names) == name) { *i = j; return env; }
+                names = cdr(names);
+                j++;
+            }
+            env = ATTR(frame, env, parent);
+            continue;
+        }
+        lisp bind = car(env);
+        // only works for symbol
+        if (car(bind) == name) { *i = -1; return bind; }
+        env = cdr(env);
+    }
+    return nil;
+}
+
+static inline lisp bind_get(lisp bind, int i) {
+    return i < 0 ? cdr(bind) : ATTR(frame, bind, slots)[i];
+}
+
+static inline void bind_set(lisp bind, int i, lisp v) {
+    if (i < 0) { setcdr(bind, v); return; }
+    ATTR(frame, bind, slots)[i] = v;
+    remember(bind, v);
+}
 
+// bindings (cons) only, not in frames
 inline lisp getBind(lisp* envp, lisp name, int create) {
     //printf("GETBIND: envp=%u global_envp=%u ", (unsigned int)envp, (unsigned int)global_envp); princ(name); terpri();
 
@@ -1387,9 +2813,10 @@ inline lisp getBind(lisp* envp, lisp name, int create) {
     if (create && envp && global_envp && *envp == *global_envp) return hashsym(name, NULL, 0, create);
     if (create) return nil;
 
-    // first search local lexical env
-    lisp bind = assoc(name, *envp);
-    if (bind) return bind;
+    // first search local lexical env, a binding in a frame has no cons to give
+    int i;
+    lisp bind = env_find(*envp, name, &i);
+    if (bind) return i < 0 ? bind : nil;
 
     // second search global env (stored in a hashtable)
     return hashsym(name, NULL, 0, 0); // not create, read only
@@ -1397,50 +2824,54 @@ inline lisp getBind(lisp* envp, lisp name, int create) {
 // magic, this "instantiates" an inline function!
 lisp getBind(lisp* envp, lisp name, int create);
 
-// TODO: measure overhead! (compare to: f871de73834340edb3fa5b26d49e43e373647f9b)
-// (time (fibo 34))
-// - before: 6973
-// - after but nothing in list: 7729
-// - 3 items check make it 600 ms slower
-// - 6 items -> 1300 ms slower...
-//
-// - this function adds maybe 10% overhead
-// - if function return 0 directly still 5% overhead
-// ==> other sourced of changes that slowed down... (like evallist)
+// (time (fibo 34)) scanning *TR in here was 5-10% overhead even with nothing
+// traced, now it's a flag on the name's symbol set by (trace-set! f t) from
+// trace/untrace in env.lsp, and nothing to check unless something is traced.
+// A redefined function keeps it, the count only changes in trace_set().
 static inline int tracep(lisp f) {
-    static lisp vb = 0;
-    if (!vb && global_envp) vb = getBind(global_envp, symbol("*TR"), 1);
-    lisp x = cdr(vb);
-    if (!vb || !x) return 0;
-    lisp fn = funame(f);
-    // inlined member 3 items 3000 ms overhead -> 600 ms!
-    while (x) {
-        if (fn == car(x)) return 1;
-        x = cdr(x);
-    }
-    return 0;
+    if (!trace_count) return 0;
+    if (PRIMP(f)) return getsymtrace(f);
+    lisp b = IS(f, func) ? findsym(ATTR(func, f, name)) : nil;
+    return b && getsymtrace(b);
+}
+
+// (trace-set! f on) f is a func/prim or the name of one, returns its value
+// the binding is made if needed, so f can be traced before it's defined
+PRIM trace_set(lisp f, lisp on) {
+    lisp name = SYMP(f) ? f : funame(f);
+    lisp b = SYMP(name) ? hashsym(name, NULL, 0, 1) : nil;
+    if (!b) return nil;
+    int was = getsymtrace(b);
+    setsymtrace(b, !!on);
+    trace_count += !!on - was;
+    return cdr(b);
 }
 
-// like setqq but returns binding, used by setXX
+// like setqq but returns binding (and slot *ip, see env_find), used by setXX
 // 1. define, de - create binding in current environment
 // 2. set! only modify existing binding otherwise give error
 // 3. setq ??? (allow to define?)
-inline lisp _setqqbind(lisp* envp, lisp name, lisp v, int create) {
-    lisp bind = getBind(envp, name, create);
+inline lisp _setqqbind(lisp* envp, lisp name, lisp v, int create, int* ip) {
+    int i = -1;
+    if (create) global_epoch++;
+    lisp bind = create ? getBind(envp, name, create) : env_find(*envp, name, &i);
+    if (!bind && !create) bind = hashsym(name, NULL, 0, 0);
     //    printf("SETQBIND: found "); princ(name); putchar(' '); princ(bind); terpri();
     if (!bind) {
         //printf("SETQBIND: "); princ(name); putchar(' '); princ(bind); terpri();
         bind = cons(name, nil);
         *envp = cons(bind, *envp);
     }
-    setcdr(bind, v);
+    bind_set(bind, i, v);
+    *ip = i;
     return bind;
 }
 // magic, this "instantiates" an inline function!
-lisp _setqqbind(lisp* envp, lisp name, lisp v, int create);
+lisp _setqqbind(lisp* envp, lisp name, lisp v, int create, int* ip);
     
 inline PRIM _setqq(lisp* envp, lisp name, lisp v) {
-    _setqqbind(envp, name, nil, 0);
+    int i;
+    _setqqbind(envp, name, nil, 0, &i);
     return v;
 }
 // magic, this "instantiates" an inline function!
@@ -1451,11 +2882,15 @@ PRIM _setqq_(lisp* envp, lisp name, lisp v) { return _setqq(envp, name, v); }
 
 inline PRIM _setbang(lisp* envp, lisp name, lisp v) {
     if (!symbolp(name)) { printf("set! of non symbol="); prin1(name); terpri(); error("set! of non atom: "); }
-    v = eval(v, envp);
-    lisp bind = _setqqbind(envp, name, nil, 0);
-    // TODO: evalGC? probably safe as steqqbind changed an existing env
+    // may GC, a loop in there would otherwise fill allocs[] with its frames
+    if (vm_sp >= VM_STACK) error("VM stack blowup!");
+    vm_stack[vm_sp++] = v;
+    v = evalGC(v, envp);
+    vm_sp--;
+    int i;
+    lisp bind = _setqqbind(envp, name, nil, 0, &i);
     // eval using our own named binding to enable recursion
-    setcdr(bind, v);
+    bind_set(bind, i, v);
 
     return v;
 }
@@ -1469,14 +2904,25 @@ PRIM _set(lisp* envp, lisp name, lisp v);
 
 PRIM de(lisp* envp, lisp namebody);
 
+// name of the function being defined, its calls in the body are calls of a lambda, see resolve()
+static lisp resolve_self;
+
 PRIM _define(lisp* envp, lisp args) {
     if (SYMP(car(args))) { // (define a 3)
         lisp name = car(args);
+        lisp v = car(cdr(args)), self = resolve_self;
 
         // like _setq but with create == 1
-        lisp bind = _setqqbind(envp, name, nil, 1);
-        lisp r = eval(car(cdr(args)), envp);
-        setcdr(bind, r);
+        int i;
+        lisp bind = _setqqbind(envp, name, nil, 1, &i);
+        if (IS(v, conss) && car(v) == symbol("lambda")) resolve_self = name;
+        // may GC, as in _setbang(), bind is in *envp, args may be made by de()
+        if (vm_sp >= VM_STACK) error("VM stack blowup!");
+        vm_stack[vm_sp++] = args;
+        lisp r = evalGC(v, envp);
+        vm_sp--;
+        resolve_self = self;
+        bind_set(bind, i, r);
 
         if (IS(r, func)) ((func*)r)->name = name;
         return r;
@@ -1493,59 +2939,90 @@ PRIM de(lisp* envp, lisp namebody) {
 
 lisp reduce_immediate(lisp x);
 
-PRIM apply(lisp f, lisp args) {
-    // TODO: for now, block GC as args could have been built out of thin air!
-    blockGC++; 
+// like apply() but may GC, f and args are kept on vm_stack, is (apply f args)
+PRIM applyGC(lisp f, lisp args) {
+    if (vm_sp + 2 >= VM_STACK) error("VM stack blowup!");
+    vm_stack[vm_sp++] = f;
+    vm_stack[vm_sp++] = args;
 
     lisp e = nil; // dummy
-    // TODO: like eval push on stack so can GC safely?
     lisp x = callfunc(f, args, &e, nil, 1);
     x = reduce_immediate(x);
 
+    vm_sp -= 2;
+    return x;
+}
+
+// safe to call from anywhere, will not GC, as eval(), args may be only in C locals
+PRIM apply(lisp f, lisp args) {
+    blockGC++;
+    lisp x = applyGC(f, args);
     blockGC--;
     return x;
 }
 
+// the functions below keep f, the list and the result on vm_stack, applyGC() may GC
+#define MAP_BEGIN(f, l, r) int sp = vm_sp; if (sp + 3 >= VM_STACK) error("VM stack blowup!"); \
+    vm_stack[vm_sp++] = f; vm_stack[vm_sp++] = l; vm_stack[vm_sp++] = r
+#define MAP_END(r) ({ vm_sp = sp; r; })
+
 PRIM mapc(lisp f, lisp r) {
+    MAP_BEGIN(f, r, nil);
     while (r && consp(r) && funcp(f)) {
-        apply(f, cons(car(r), nil));
+        applyGC(f, cons(car(r), nil));
         r = cdr(r);
     }
-    return nil;
+    return MAP_END(nil);
+}
+
+// (filter p l) or (mapcar m l) as a list in the same order
+static lisp map_filter(lisp f, lisp l, int filter) {
+    if (!l || !f) return l;
+    lisp r = cons(nil, nil), last = r;
+    MAP_BEGIN(f, l, r);
+    for(; l; l = cdr(l)) {
+        lisp a = car(l), v = applyGC(f, cons(a, nil));
+        if (filter && !v) continue;
+        setcdr(last, cons(filter ? a : v, nil));
+        last = cdr(last);
+    }
+    return MAP_END(cdr(r));
 }
 
-PRIM filter(lisp p, lisp l) {
-    if (!l || !p) return l;
-    lisp a = car(l); l = cdr(l);
-    if (p && apply(p, cons(a, nil))) return cons(a, filter(p, l));
-    return filter(p, l);
-}
-PRIM mapcar(lisp m, lisp l) {
-    if (!l || !m) return l;
-    lisp a = car(l); l = cdr(l);
-    a = apply(m, cons(a, nil));
-    return cons(a, mapcar(m, l));
-}
+PRIM filter(lisp p, lisp l) { return map_filter(p, l, 1); }
+PRIM mapcar(lisp m, lisp l) { return map_filter(m, l, 0); }
+
 PRIM reduce(lisp r, lisp l) {
     if (!l || !r) return l;
     lisp a = car(l); l = cdr(l);
-    if (!l) return a;
-    lisp b = car(l); l = cdr(l);
-    lisp v = apply(r, cons(a, cons(b, nil)));
-    return reduce(r, cons(v, l));
+    MAP_BEGIN(r, l, a);
+    while (l) {
+        a = applyGC(r, cons(a, cons(car(l), nil)));
+        vm_stack[sp + 2] = a;
+        l = cdr(l);
+    }
+    return MAP_END(a);
 }
 
 // efficent implementation of filtermapfilterreduce that doesn't build
 // intermidiate lists...
 // TODO: do it by merging, filter+mapc+filter+reduce into one function!
 PRIM filtermapfilterreduce(lisp p, lisp m, lisp mp, lisp r, lisp l) {
-    return reduce(r, filter(mp, mapcar(m, filter(p, l))));
+    MAP_BEGIN(r, mp, m);
+    l = filter(p, l);
+    l = mapcar(m, l);
+    l = filter(mp, l);
+    return MAP_END(reduce(r, l));
 }
 
 PRIM length(lisp r) {
-    if (IS(r, string)) return mkint(strlen(getstring(r)));
+    if (IS(r, string)) return mkint(ATTR(string, r, len));
     if (!IS(r, conss)) return mkint(0);
     int c = 0;
+    while (LONGP(r) && !LONG_FWDS(r)) {
+        c += LONG_N(r);
+        r = LONG_TAIL(r);
+    }
     while (r) {
         c++;
         r = cdr(r);
@@ -1555,12 +3032,11 @@ PRIM length(lisp r) {
 
 // scheme string functions - https://www.gnu.org/software/guile/manual/html_node/Strings.html#Strings
 // common lisp string functions - http://www.lispworks.com/documentation/HyperSpec/Body/f_stgeq_.htm
-PRIM concat(lisp* envp, lisp x) {
+PRIM concat(int n, lisp* argv) {
     // calculate len
-    int len = 1;
-    lisp i = x;
-    while (i) {
-        lisp v = car(i);
+    int len = 0, i;
+    for(i = 0; i < n; i++) {
+        lisp v = argv[i];
         if (INTP(v)) {
             int iv = getint(v);
             // negative
@@ -1570,38 +3046,45 @@ PRIM concat(lisp* envp, lisp x) {
             while ((iv /= 10) > 0) len++;
             // last digit
             len++; 
+        } else if (IS(v, intint) || FIXEDP(v) || FLOATP(v)) {
+            char is[32];
+            len += strlen(num2str(v, is));
         } else {
-            char* s = getstring(v);
+            char* s = "";
             char ss[7] = {0};
             if (HSYMP(v)) s = symbol_getString(v);
             else if (SYMP(v)) s = sym2str(v, ss);
-            len += strlen(s);
+            len += IS(v, string) ? ATTR(string, v, len) : strlen(s);
         }
-        i = cdr(i);
     }
     // build the string
-    char* r = malloc(len), *p = r;
-    *r = 0;
-    i = x;
-    while (i) {
-        lisp v = car(i);
+    string* r = string_alloc(len);
+    char* p = r->s;
+    *p = 0;
+    for(i = 0; i < n; i++) {
+        lisp v = argv[i];
         if (INTP(v)) {
             p += snprintf(p, 20, "%d", getint(v));
+        } else if (IS(v, intint) || FIXEDP(v) || FLOATP(v)) {
+            char is[32], *ip = num2str(v, is);
+            strcpy(p, ip);
+            p += strlen(ip);
         } else {
-            char* s = getstring(v);
+            char* s = IS(v, string) ? string_chars(v) : "";
             char ss[7] = {0};
             if (HSYMP(v)) s = symbol_getString(v);
             else if (SYMP(v)) s = sym2str(v, ss);
-            p = strcat(p, s);
+            int l = IS(v, string) ? ATTR(string, v, len) : strlen(s);
+            memcpy(p, s, l);
+            p += l;
         }
-        i = cdr(i);
     }
-    return mklenstring(r, -len);
+    return string_done(r, p - r->s);
 }
 
 PRIM char_(lisp i) {
     if (IS(i, string)) {
-        return mkint(getstring(i)[0]);
+        return mkint(ATTR(string, i, len) ? string_chars(i)[0] : 0);
     } else if (IS(i, intint)) {
         char s[2] = {0};
         s[0] = getint(i);
@@ -1611,22 +3094,43 @@ PRIM char_(lisp i) {
     return nil;
 }
 
+// strstr for strings that aren't zero terminated
+static char* string_search(char* s, char* end, char* d, int len) {
+    for(end -= len; s <= end; s++)
+        if (*s == *d && !memcmp(s, d, len)) return s;
+    return NULL;
+}
+
+// (substring s start end), end is optional
+PRIM substring(lisp s, lisp start, lisp end) {
+    if (!IS(s, string)) return nil;
+    int len = ATTR(string, s, len);
+    int a = getint(start), b = end ? getint(end) : len;
+    if (a < 0) a = 0;
+    if (b > len) b = len;
+    if (a >= b) return mklenstring("", 0);
+    return mksubstring(s, string_chars(s) + a, b - a);
+}
+
 // optional n, number of entries to return (1..x), 0, <0, nil, non-number => all
+// the entries are substrings of s
 PRIM split(lisp s, lisp d, lisp n) {
+    if (!IS(s, string)) return nil;
     int i = getint(n);
-    char* src = getstring(s);
-    char* delim = getstring(d);
-    int len = strlen(delim);
+    char* src = string_chars(s);
+    char* end = src + getstrlen(s);
+    char* delim = IS(d, string) ? string_chars(d) : "";
+    int len = getstrlen(d);
     lisp r = nil;
     lisp p = r;
     lisp last = nil;
     while (src && (i > 0 || i <= 0)) {
-        char* where = strstr(src, delim);
+        char* where = string_search(src, end, delim, len);
         if (!where) {
-            where = src + strlen(src);
+            where = end;
             i = 1; // will terminate after add
         }
-        lisp m = mklenstring(src, where - src);
+        lisp m = mksubstring(s, src, where - src);
 
         // add conscell at end and add value
         p = cons(nil, nil);
@@ -1683,14 +3187,40 @@ static void skipSpace() {
     nextChar = c;
 }
 
-static int readInt(int v) {
-    unsigned char c = next();
-    while (c && isdigit(c)) {
-        v = v*10 + c-'0';
+// 42, 3.25 fixed point, 1.5d0 or 2e-3 float (unix), c is the first digit
+static lisp readNumber(unsigned char c, int sign) {
+    char s[64];
+    int n = 0, dot = 0, exp = 0;
+    if (sign < 0) s[n++] = '-';
+    while (c) {
+        if (isdigit(c)) ;
+        else if (c == '.' && !dot && !exp) dot = 1;
+#ifdef UNIX
+        else if ((c == 'd' || c == 'e') && !exp) { exp = 1; c = 'e'; }
+        else if ((c == '-' || c == '+') && s[n - 1] == 'e') ;
+#endif
+        else break;
+        if (n >= sizeof(s) - 1) error("read.number too long");
+        s[n++] = c;
         c = next();
     }
     nextChar = c;
-    return v;
+    s[n] = 0;
+#ifdef UNIX
+    if (exp) return mkfloat(strtod(s, NULL));
+#endif
+
+    char* p = s + (sign < 0);
+    long long r = 0;
+    for(; isdigit(*p); p++)
+        if (__builtin_mul_overflow(r, 10, &r) || __builtin_add_overflow(r, sign * (*p - '0'), &r)) error("read.integer overflow");
+    if (*p != '.') return mkint64(r);
+
+    // the decimals of fixed point
+    long long f = 0, d = 1;
+    for(p++; isdigit(*p); p++) if (d < 100000000) { f = f*10 + *p - '0'; d *= 10; }
+    if (r > 1 << 16 || r < -(1 << 16)) error("read.fixed point overflow");
+    return mkfixed(r * FIXED_ONE + sign * ((f * FIXED_ONE + d / 2) / d));
 }
 
 static lisp readString() {
@@ -1703,19 +3233,16 @@ static lisp readString() {
     if (!c) error("string.not_terminated");
     int len = input - start - 1;
 
-    // we modify the copied string as the string above may be constant
-    lisp r = mklenstring(start, len);
-    // remove '\', this may waste a byte or two if any
-    char* from = getstring(r);
-    char* to = from;
-    while (*from) {
+    // copy, removing '\', this may waste a byte or two if any
+    string* r = string_alloc(len);
+    char* from = start;
+    char* to = r->s;
+    while (from < start + len) {
         // TODO: \n \t ...
         if (*from == '\\') from++;
-        *to = *from; // !
-        from++; to++;
+        *to++ = *from++;
     }
-    *from = 0;
-    return r;
+    return string_done(r, to - r->s);
 }
 
 static lisp readSymbol(char c, int o) {
@@ -1774,11 +3301,11 @@ static lisp readx() {
     if (c == '\'') return quote(readx());
     if (c == '(') return readList();
     if (c == ')') return nil;
-    if (isdigit(c)) return mkint(readInt(c - '0'));
+    if (isdigit(c)) return readNumber(c, 1);
     if (c == '-') {
         unsigned char n = next();
         if (isdigit(n))
-            return mkint(-readInt(n - '0'));
+            return readNumber(n, -1);
         else
             return readSymbol(n, -1);
     }
@@ -1789,7 +3316,7 @@ static lisp readx() {
 PRIM reads(char *s) {
     input = s;
     nextChar = 0;
-    return readx();
+    return mklong(readx());
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -1931,7 +3458,8 @@ lisp princ_hlp(lisp x, int readable) {
     int tag = TAG(x);
     // simple one liners
     if (!tag) printf("nil");
-    else if (tag == intint_TAG) printf("%d", getint(x));
+    else if (INTP(x)) printf("%d", getint(x));
+    else if (tag == intint_TAG || tag == fixed_TAG || tag == floatt_TAG) { char s[32]; writes(num2str(x, s)); }
     else if (tag == prim_TAG) { putchar('#'); princ_hlp(*(lisp*)GETPRIM(x), readable); }
     // for now we have two "symbolls" one inline in pointer and another heap allocated
     else if (HSYMP(x)) writes(symbol_getString(x));
@@ -1940,11 +3468,15 @@ lisp princ_hlp(lisp x, int readable) {
     else if (tag == thunk_TAG) { printf("#thunk["); princ_hlp(ATTR(thunk, x, e), readable); putchar(']'); }
     else if (tag == immediate_TAG) { printf("#immediate["); princ_hlp(ATTR(thunk, x, e), readable); putchar(']'); }
     else if (tag == func_TAG) { putchar('#'); princ_hlp(ATTR(func, x, name), readable); }
+    else if (tag == var_TAG) princ_hlp(ATTR(var, x, name), readable);
+    else if (tag == frame_TAG) { printf("#frame["); if (x->xx) princ_binds(x, nil, x->xx); putchar(']'); }
+    else if (tag == code_TAG) printf("#code[%d]", CODE_BYTES(ATTR(code, x, nconsts), ATTR(code, x, nbytes)));
     // string
     else if (tag == string_TAG) {
         if (readable) putchar('"');
-        char* c = ATTR(string, x, p);
-        while (*c) {
+        char* c = string_chars(x);
+        char* end = c + ATTR(string, x, len);
+        while (c < end) {
             if (readable && *c == '\"') putchar('\\');
             putchar(*c); //printf("[%d]", *c);
             c++;
@@ -1998,9 +3530,9 @@ PRIM terpri() { putchar('\n'); return nil; }
 // TODO: make a sprintf, or call it "format".
 // which essentially is printf for lisp, they call it format in elisp
 // TODO: format - http://www.gnu.org/software/mit-scheme/documentation/mit-scheme-ref/Format.html#Format
-PRIM printf_(lisp *envp, lisp all) {
-    char* f = getstring(car(all));
-    all = cdr(all);
+PRIM printf_(int n, lisp* argv) {
+    char* f = getstring(n ? argv[0] : nil);
+    int i = 1;
     while (*f) {
         if (*f == '%') {
             char fmt[16] = {0};
@@ -2009,20 +3541,21 @@ PRIM printf_(lisp *envp, lisp all) {
             while (*f && !isalpha((int)*f) && !*p)
                 *p++ = *f++;
             char type = *p++ = *f++;
+            lisp a = i < n ? argv[i] : nil;
             switch (type) {
             case '%':
                 putchar('%'); break;
             case 's':
-                princ(car(all)); break;
+                princ(a); break;
             case 'S':
-                prin1(car(all)); break;
+                prin1(a); break;
             case 'o': case 'd': case 'x': case 'X': case 'c':
-                printf(fmt, getint(car(all))); break;
+                printf(fmt, getint(a)); break;
             case 'e': case 'f': case 'g': break;
                 // printf(fmt, getfloat(car(x))); break;
             }
             if (type != '%')
-                all = cdr(all);
+                i++;
         } else {
             putchar(*f++);
         }
@@ -2050,6 +3583,7 @@ lisp pp_hlp(lisp e, int indent) {
         a3 = car(l3), l4 = cdr(l3),
         a4 = car(l4);
     if (funame(a1)) a1 = funame(a1); // decompile! haha
+    if (IS(a1, var)) a1 = ATTR(var, a1, name);
     if (symbolp(a1)) {
         if (a1 == symbol("if")) {
             printf("(if "); indent++; pp_hlp(a2, indent+1); nl();
@@ -2099,10 +3633,14 @@ PRIM pp(lisp e) {
 }
 
 static lisp funcapply(lisp f, lisp args, lisp* envp, int noeval);
+static lisp mkvar(lisp name, int slot, lisp bind);
 
 // get value of var, or complain if not defined
 static inline lisp getvar(lisp e, lisp env) {
-    lisp v = getBind(&env, e, 0);
+    int i = -1;
+    lisp v = env_find(env, e, &i);
+    if (v) return bind_get(v, i);
+    v = hashsym(e, NULL, 0, 0);
     if (v) return cdr(v);
 
     printf("\n-- ERROR: Undefined symbol: "); princ(e); terpri();
@@ -2110,17 +3648,80 @@ static inline lisp getvar(lisp e, lisp env) {
     return nil;
 }
 
+// get value of resolved var, no search, see resolve()
+static inline lisp var_get(lisp v, lisp env) {
+    lisp b = ATTR(var, v, bind);
+    if (!INTP(b)) return cdr(b);
+
+    int depth = GETINT(b);
+    int i = v->xx;
+    lisp e = env;
+    while (e) {
+        if (IS(e, frame)) {
+            if (!depth--) return ATTR(frame, e, slots)[i];
+            e = ATTR(frame, e, parent);
+        } else {
+            e = cdr(e); // let/define binding
+        }
+    }
+    return getvar(ATTR(var, v, name), env); // not there?
+}
+
+// Call site cache: the first time a call (f ...) finds f as a global the
+// symbol is replaced by a var of the global binding, later calls get the
+// function with one pointer load, and redefining f takes effect. A builtin
+// prim is put in the call directly, as before.
+//
+// It's only valid as long as no binding of f was created in the env of the
+// call, define/de bumps global_epoch and then it's checked again.
+// (Before, the func itself was put in the call, so redefinition was ignored.)
+//
+// A prim is its name's binding, see mkprim(), it's only used while the name
+// is still bound to it. A function of a compiled library may be redefined,
+// then prim_head() gives the name and the call looks it up again.
+static inline lisp prim_head(lisp h) { return PRIMP(h) && GETPRIM(h)->cdr != h ? GETPRIM(h)->car : h; }
+
+static lisp gethead(lisp e, lisp env) {
+    lisp v = car(e);
+    lisp name = IS(v, var) ? ATTR(var, v, name) : v;
+    int i = -1;
+    lisp b = env_find(env, name, &i);
+    if (b) return bind_get(b, i); // local, a cache keeps missing
+    b = hashsym(name, NULL, 0, 0);
+    lisp f = cdr(b);
+    if (v == name && PRIMP(f) && funame(f) == name) {
+        setcar(e, f); // "macro expansion" lol, as resolve() does
+        return f;
+    }
+    if (v == name) {
+        v = mkvar(name, VAR_CACHE, b);
+        setcar(e, v);
+    }
+    ATTR(var, v, epoch) = global_epoch;
+    return f;
+}
+
 // don't call directly, call evalGC() or eval()
 static inline lisp eval_hlp(lisp e, lisp* envp) {
     if (!e) return e;
     char tag = TAG(e);
     if (tag == symboll_TAG) return getvar(e, *envp);
+    if (tag == var_TAG) return var_get(e, *envp);
     if (tag != conss_TAG) return e;
 
     // find function
     lisp orig = car(e);
     lisp f = orig;
     tag = TAG(f);
+    if (tag == var_TAG) {
+        if (f->xx == VAR_CACHE && ATTR(var, f, epoch) != global_epoch && !INTP(ATTR(var, f, bind))) f = gethead(e, *envp);
+        else f = var_get(f, *envp);
+        tag = TAG(f);
+    } else if (tag == symboll_TAG || (tag == prim_TAG && prim_head(f) != f)) {
+        if (tag == prim_TAG) setcar(e, prim_head(f)); // redefined
+        f = gethead(e, *envp);
+        tag = TAG(f);
+    }
     lisp last = nil; // if eval to exactly same value return, can still loop
     while (f && f!=last && tag!=prim_TAG && tag!=thunk_TAG && tag!=func_TAG) {
         last = f;
@@ -2136,36 +3737,20 @@ static inline lisp eval_hlp(lisp e, lisp* envp) {
     stack[level].e = nil;
     stack[level].envp = nil;
 
-    // we replace it after as no error was generated...
-    if (f != orig) {
-        // "macro expansion" lol (replace with implementation)
-        // TODO: not safe if found through variable (like all!)
-        // TODO: keep on symbol ptr to primitive function/global, also not good?
-        // DEFINE(F,...) will then break many local passed variables
-        // maybe must search all list till find null, then can look on symbol :-(
-        // but that's everytime? actually, not it's a lexical scope!
-        // TODO: only replace if not found in ENV and is on an SYMBOL!
-        if (SYMP(orig) && eq(funame(f), orig))
-            setcar(e, f);
-    }
-
     return r;
 }
 
 // inline this is essential to not have stack grow!
 inline lisp reduce_immediate(lisp x) {
     while (x && IS(x, immediate)) {
-        lisp tofree = x;
+        // the slot is reused by the next immediate of this level
+        lisp e = ATTR(thunk, x, e);
+        lisp env = ATTR(thunk, x, env);
 
         if (trace > 0) // make it visible
-            x = evalGC(ATTR(thunk, x, e), &ATTR(thunk, x, env));
+            x = evalGC(e, &env);
         else
-            x = eval_hlp(ATTR(thunk, x, e), &ATTR(thunk, x, env));
-
-        // immediates are immediately consumed after evaluation, so they can be free:d directly
-        tofree->tag = 0;
-        sfree((void*)tofree, sizeof(thunk), immediate_TAG);
-        used_count--;
+            x = eval_hlp(e, &env);
     }
     return x;
 }
@@ -2195,13 +3780,34 @@ PRIM _eval(lisp e, lisp env) {
 
 lisp mem_usage(int count) {
     // TODO: last number conses not correct new useage
-    if (traceGC) printf(" [GC freed %d used=%d bytes=%d conses=%d]\n", count, used_count, used_bytes, MAX_CONS - cons_count);
+    if (traceGC) printf(" [GC%s freed %d used=%d bytes=%d conses=%d longs=%d]\n", gc_major ? "" : " minor", count, used_count, used_bytes, CONS_TOTAL - cons_count, longs_count);
     return nil;
 }
 
+// what was live after last major GC
+static int live_conses = 0;
+static int live_allocs = 0;
+
+void gc_live() {
+    live_conses = CONS_TOTAL - cons_count;
+    live_allocs = allocs_count;
+}
+
+// minor GCs can't free old garbage, so major GC when it has doubled
+int gc_old_grew() {
+    return CONS_TOTAL - cons_count > 2 * live_conses + MIN_CONS
+        || allocs_count > 2 * live_allocs + INIT_ALLOCS;
+}
+
+// can't grow and little free, can't wait for incremental GC
+static int gc_urgent() {
+    if (cons_count < CONS_TOTAL / 10 && CONS_TOTAL + CONS_SEGMENT_CELLS > cons_max) return 1;
+    return allocs_count > allocs_size * 0.9 && allocs_size >= MAX_ALLOCS;
+}
+
 inline int needGC() {
-    if (cons_count < MAX_CONS * 0.2) return 1;
-    return (allocs_count < MAX_ALLOCS * 0.8) ? 0 : 1;
+    if (cons_count < CONS_TOTAL * 0.2) return 1;
+    return (allocs_count < allocs_size * 0.8) ? 0 : 1;
 }
 // magic, this "instantiates" an inline function!
 int needGC();
@@ -2219,22 +3825,76 @@ int needGC();
 // #772 0x08052d58 in readeval ()
 // #773 0x08048b57 in main ()
 
-// TODO: because of tail call optimization, we can't tell where the error occurred as it's not relevant on the stack???
-PRIM print_detailed_stack(int curr) {
-    int l;
-    // TODO: DONE but too much: using fargs of f can use .envp to print actual arguments!
-    for(l = 0; l < level + 5; l++) {
-        if (!stack[l].e && !stack[l].envp) break;
+// A call run by vm_run() has no expression on stack[], but the number of its
+// first arg on vm_stack, the func is just before it. Its args are there or in
+// its frame. Above level it's left from an error and vm_stack has changed.
+static lisp vm_level(int l) {
+    return INTP(stack[l].e) && l < level ? vm_stack[GETINT(stack[l].e) - 1] : nil;
+}
+
+static lisp* vm_args(int l) {
+    lisp f = vm_level(l);
+    if (!(((code*)ATTR(func, f, code))->flags & CODE_FRAME)) return &vm_stack[GETINT(stack[l].e)];
+    lisp fr = *stack[l].envp; // let bindings may be in front
+    while (!IS(fr, frame)) fr = cdr(fr);
+    return ATTR(frame, fr, slots);
+}
+
+// the expression being evaluated at level l, a VM call is shown as one
+static void prin1_call(int l) {
+    lisp f = vm_level(l);
+    if (!f) { prin1(INTP(stack[l].e) ? nil : stack[l].e); return; }
+    lisp* a = vm_args(l);
+    int i;
+    putchar('('); princ(funame(f) ? funame(f) : f);
+    for(i = 0; i < ((code*)ATTR(func, f, code))->xx; i++) { putchar(' '); prin1(a[i]); }
+    putchar(')');
+}
+
+// the env of level l to evaluate in, a VM call gets its args in a frame in front
+static lisp vm_env(int l) {
+    lisp f = vm_level(l);
+    if (!f || ((code*)ATTR(func, f, code))->flags & CODE_FRAME) return *stack[l].envp;
+    int n = ((code*)ATTR(func, f, code))->xx, i;
+    frame* fr = myMalloc(FRAME_BYTES(n), frame_TAG);
+    fr->tag = frame_TAG;
+    fr->xx = n;
+    fr->names = car(ATTR(func, f, e));
+    fr->parent = *stack[l].envp;
+    for(i = 0; i < n; i++) fr->slots[i] = vm_args(l)[i];
+    return (lisp)fr;
+}
+
+// TODO: because of tail call optimization, we can't tell where the error occurred as it's not relevant on the stack???
+PRIM print_detailed_stack(int curr) {
+    int l;
+    // TODO: DONE but too much: using fargs of f can use .envp to print actual arguments!
+    for(l = 0; l < level + 5; l++) {
+        if (!stack[l].e && !stack[l].envp) break;
+        if (INTP(stack[l].e) && !vm_level(l)) break;
 
         if (!l) terpri();
         if (curr && l == curr-1) printf("==>"); else printf("   ");
         printf("%4d : ", l);
-        prin1(stack[l].e); printf(" ENV: ");
+        prin1_call(l); printf(" ENV: ");
+
+        if (vm_level(l)) {
+            lisp f = vm_level(l), names = car(ATTR(func, f, e));
+            lisp* a = vm_args(l);
+            int i;
+            putchar('['); princ(f);
+            for(i = 0; i < ((code*)ATTR(func, f, code))->xx; i++, names = cdr(names)) {
+                putchar(' '); princ(IS(names, conss) ? car(names) : names); putchar('='); princ(a[i]);
+            }
+            printf("]\n");
+            continue;
+        }
 
         lisp f = car(stack[l].e);
         if (!f) f = stack[l].e;
         lisp* envp = stack[l].envp;
         lisp env = envp ? *envp : nil; // env before
+        if (IS(f, var)) f = var_get(f, env);
         while (f && IS(f, symboll) && !IS(f, func) && !IS(f, thunk) && !IS(f, prim) && !IS(f, immediate)) {
             f = getvar(f, env); // eval?
         }
@@ -2245,16 +3905,13 @@ PRIM print_detailed_stack(int curr) {
             lisp *nenvp = (l+1 < MAX_STACK) ? stack[l+1].envp : NULL;
             lisp nenv = nenvp ? *nenvp : nil;
 
-            if (nenv) {
+            if (nenv && !(l+1 < MAX_STACK && vm_level(l+1))) { // a VM call shows its own
                 lisp def = ATTR(thunk, f, e); // get definition
                 lisp fargs = car(def);
                 //printf("\nFARGS="); princ(fargs); printf("  ENV="); princ(nenv); terpri();
-                while (fargs && nenv) {
-                    putchar(' ');
-                    prin1(car(car(nenv))); putchar('='); prin1(cdr(car(nenv)));
-                    env = cdr(nenv);
-                    fargs = cdr(fargs);
-                }
+                int n = 0;
+                while (fargs) { n++; fargs = IS(fargs, conss) ? cdr(fargs) : nil; }
+                if (n) princ_binds(nenv, nil, n);
             }
             putchar(']');
         } else if (f && IS(f, prim)) {
@@ -2277,7 +3934,7 @@ void print_stack() {
     for(l = 0; l < level; l++) {
         if (!stack[l].e && !stack[l].envp) break;
         if (!l) printf(" @ ");
-        lisp f = car(stack[l].e);
+        lisp f = vm_level(l) ? funame(vm_level(l)) : car(stack[l].e);
         if (f == last) {
             count++;
             continue;
@@ -2298,16 +3955,43 @@ void print_stack() {
     if (last) princ(last);
 }
 
-// prints env and stops at (nil . nil) binding (hides "globals")
+// prints " name=value" of env bindings, only names in fargs if given,
+// at most n (if > 0), stops at (nil . nil) binding (hides "globals")
+static void princ_binds(lisp env, lisp fargs, int n) {
+    // find varargs name
+    lisp varargs = fargs;
+    while (varargs && !symbolp(varargs)) varargs = cdr(varargs);
+
+    while (env) {
+        lisp name, v, names = nil;
+        int i = 0;
+        if (IS(env, frame)) {
+            names = ATTR(frame, env, names);
+            if (!names) { env = ATTR(frame, env, parent); continue; }
+        } else if (!car(car(env))) break;
+        do {
+            if (names) {
+                name = IS(names, conss) ? car(names) : names;
+                v = ATTR(frame, env, slots)[i];
+                names = cdr(names);
+            } else {
+                name = car(car(env));
+                v = cdr(car(env));
+            }
+            if (!fargs || (name && member(name, fargs)) || name == varargs) {
+                putchar(' ');
+                princ(name); putchar('='); princ(v);
+                if (!--n) return;
+            }
+        } while (names && ++i < env->xx);
+        env = IS(env, frame) ? ATTR(frame, env, parent) : cdr(env);
+    }
+}
+
 void print_env(lisp env) {
     indent(level+1);
-    printf(" ENV ");
-    lisp xx = env;
-    while (xx && car(car(xx))) {
-        lisp b = car(xx);
-	princ(car(b)); putchar('='); princ(cdr(b)); putchar(' ');
-	xx = cdr(xx);
-    }
+    printf(" ENV");
+    princ_binds(env, nil, 0);
     terpri();
 }
 
@@ -2315,38 +3999,22 @@ void print_env(lisp env) {
 void print_args(lisp env, lisp f) {
     printf(" (");
     princ(funame(f));
-    lisp fargs = car(fundef(f));
-    // find varargs name
-    lisp varargs = fargs;
-    while (varargs && !symbolp(varargs)) varargs = cdr(varargs);
-
-    lisp xx = env;
-    while (xx && car(car(xx))) {
-        lisp b = car(xx);
-        lisp name = car(b);
-        if ((name && member(name, fargs)) || name == varargs) {
-            putchar(' ');
-            princ(name); putchar('='); princ(cdr(b));
-        }
-	xx = cdr(xx);
-    }
+    princ_binds(env, car(fundef(f)), 0);
     printf(") ");
 }
 
-PRIM evalGC(lisp e, lisp* envp) {
-    if (!e) return e;
-    char tag = TAG(e);
-    // look up variable
-    if (tag == symboll_TAG) return getvar(e, *envp); 
-    if (tag != symboll_TAG && tag != conss_TAG && tag != thunk_TAG) return e;
-
-    if (level >= MAX_STACK) { error("Stack blowup!"); exit(3); }
-
-    stack[level].e = e;
-    stack[level].envp = envp;
-
-    // TODO: move this to function
-    if (!blockGC && needGC()) {
+// GC if needed, called where all live values are reachable from the roots,
+// stack[] and vm_stack[], and *envp
+static inline void gc_check(lisp* envp) {
+    if (!blockGC && dogc && gc_phase) {
+        // incremental GC, complete it if running out of memory
+        if (gc_urgent()) gc(envp);
+        else if (gc_phase == GC_MARK && gc_drained) gc_safepoint(envp);
+    } else if (!blockGC && needGC() && dogc && gc_major && gc_incremental) {
+        gc_safepoint(envp);
+        kbhit();
+    } else if (!blockGC && needGC()) {
+        if (dogc) gc_start();
         mymark(*envp);
         if (trace > 2) printf("%d STACK: ", level);
         int i;
@@ -2361,13 +4029,29 @@ PRIM evalGC(lisp e, lisp* envp) {
         }
         if (trace > 2) terpri();
         mygc();
-        // TODO: address growth?
-        if (needGC()) {
+        // minor GC didn't help gives a major GC next, major GC grows heap
+        if (needGC() && !gc_major) {
             printf("\n[We GC:ed but after GC we need another GC - expect slowdowns!!!]\n");
         }
         // check ctlr-t and maybe at queue (GC issue needs resolve first)
         kbhit();
     }
+}
+
+PRIM evalGC(lisp e, lisp* envp) {
+    if (!e) return e;
+    char tag = TAG(e);
+    // look up variable
+    if (tag == symboll_TAG) return getvar(e, *envp); 
+    if (tag == var_TAG) return var_get(e, *envp);
+    if (tag != symboll_TAG && tag != conss_TAG && tag != thunk_TAG) return e;
+
+    if (level >= MAX_STACK) { error("Stack blowup!"); exit(3); }
+
+    stack[level].e = e;
+    stack[level].envp = envp;
+
+    gc_check(envp);
 
     if (trace > 0) { indent(level); printf("---> "); princ(e); }
     level++;
@@ -2381,200 +4065,2396 @@ PRIM evalGC(lisp e, lisp* envp) {
     if (trace > 0) { indent(level); princ(r); printf(" <--- "); princ(e); }
     if (trace > 0) { print_args(*envp, car(e)); terpri(); terpri(); }
 
-    stack[level].e = nil;
-    stack[level].envp = NULL;
+    stack[level].e = nil;
+    stack[level].envp = NULL;
+    return r;
+}
+
+PRIM if_(lisp* envp, lisp exp, lisp thn, lisp els) {
+    // evalGC is safe here as we don't construct any structes, yet
+    // TODO: how did we get here? primapply does call evallist thus created something...
+    // but we pass ENV on so it should be safe..., it'll mark it!
+    return evalGC(exp, envp) ? mkimmediate(thn, *envp) : mkimmediate(els, *envp);
+}
+
+PRIM cond(lisp* envp, lisp all) {
+    while (all) {
+        lisp nxt = car(all);
+        lisp e = car(nxt);
+        e = evalGC(e, envp);
+        lisp thn = cdr(nxt);
+        if (e) return thn ? progn(envp, thn) : e;
+        all = cdr(all);
+    }
+    return nil;
+}
+
+PRIM case_(lisp* envp, lisp all) {
+    lisp x = evalGC(car(all), envp);
+    all = cdr(all);
+    while (all) {
+        lisp ths = car(all);
+        lisp m = member(x, car(ths));
+        if (m) return progn(envp, cdr(ths));
+        all = cdr(all);
+    }
+    return nil;
+}
+
+PRIM and(lisp* envp, lisp all) {
+    lisp r = nil;
+    while(all) {
+        // TODO: tail call on last?
+        r = evalGC(car(all), envp);
+        if (!r) return nil;
+        all = cdr(all);
+    }
+    return r;
+}
+
+PRIM or(lisp* envp, lisp all) {
+    lisp r = nil;
+    while(all) {
+        // TODO: tail call on last?
+        r = evalGC(car(all), envp);
+        if (r) return r;
+        all = cdr(all);
+    }
+    return nil;
+}
+
+PRIM not(lisp x) {
+    return x ? nil : t;
+}
+
+// Lexical addressing
+// ------------------
+// When lambda (also de, define) creates a func outside of any function call
+// its body is resolved once. Variable references are replaced by a var, a
+// slot in a frame (depth, index) or the global binding, eval_hlp() gets the
+// value without searching the env or the symbol hash. Nested lambdas are
+// resolved with it, as their frames are known.
+//
+// What isn't understood stays a symbol and is looked up as before: names
+// bound by let or define in the body, names in a let around the lambda,
+// globals not defined yet, NLAMBDA, quoted data, arguments of special forms
+// not handled below, and bodies that use eval or env. A resolved body still
+// prints the same. A name not defined yet used as a function is taken to be
+// a function, not an NLAMBDA.
+//
+// fibo does 5 lookups per call, 3 of n (slot 0 in the first frame) and 2 of
+// fibo (global), now without search or hashing. To compare, time (bench-fibo 30) and
+// (bench-closure 100000) from bench.lsp, then (lexical 0) and load it again.
+
+static int lexical = 1;
+
+PRIM lexical_(lisp on) {
+    if (INTP(on)) lexical = getint(on);
+    return mkint(lexical);
+}
+
+PRIM time_(lisp* envp, lisp exp);
+PRIM let(lisp* envp, lisp all);
+PRIM let_star(lisp* envp, lisp all);
+PRIM lambda(lisp* envp, lisp all);
+PRIM nlambda(lisp* envp, lisp all);
+
+typedef struct scope {
+    lisp names; // fargs, or let bindings and defined names (not resolved)
+    int frame; // names are the slots of a frame
+    struct scope* up;
+} scope;
+
+static lisp mkvar(lisp name, int slot, lisp bind) {
+    var* v = ALLOC(var);
+    v->xx = slot;
+    v->name = name;
+    v->bind = bind;
+    v->epoch = 0;
+    return (lisp)v;
+}
+
+// the C function of h if it's a prim or a global bound to one
+static void* resolve_primf(lisp h) {
+    if (SYMP(h)) { lisp b = findsym(h); h = b ? cdr(b) : nil; }
+    else if (IS(h, var) && !INTP(ATTR(var, h, bind))) h = cdr(ATTR(var, h, bind));
+    return PRIMP(h) ? getprimfunc(h) : NULL;
+}
+
+// collect names defined anywhere in x, return 1 if it uses eval or env
+static int resolve_scan(lisp x, lisp* names) {
+    while (IS(x, conss)) {
+        void* fp = resolve_primf(car(x));
+        if (fp == _define || fp == de) {
+            lisp name = car(cdr(x));
+            *names = cons(IS(name, conss) ? car(name) : name, *names);
+        }
+        if (resolve_scan(car(x), names)) return 1;
+        x = cdr(x);
+    }
+    void* fp = resolve_primf(x);
+    return fp && (fp == _eval || fp == _env);
+}
+
+// returns var, or name if it should be looked up, or the prim if head and bound to one
+static lisp resolve_name(lisp name, scope* sc, lisp env, int head) {
+    int depth = 0;
+    for(; sc; sc = sc->up) {
+        lisp x = sc->names;
+        int i = 0;
+        while (x) {
+            lisp n = IS(x, conss) ? car(x) : x; // (a b . rest)
+            if (IS(n, conss)) n = car(n); // let binding (a 3)
+            if (n == name) return sc->frame ? mkvar(name, i, mkint(depth)) : name;
+            x = IS(x, conss) ? cdr(x) : nil;
+            i++;
+        }
+        if (sc->frame) depth++;
+    }
+    int i;
+    if (env_find(env, name, &i)) return name; // let, may be another binding next time
+    lisp bind = findsym(name);
+    if (head && PRIMP(cdr(bind))) return cdr(bind);
+    return bind ? mkvar(name, 0, bind) : name;
+}
+
+static lisp resolve(lisp x, scope* sc, lisp env);
+
+static void resolve_list(lisp x, scope* sc, lisp env) {
+    while (IS(x, conss)) {
+        lisp a = car(x);
+        lisp r = resolve(a, sc, env);
+        if (r != a) setcar(x, r);
+        x = cdr(x);
+    }
+}
+
+// (lambda fargs . body), see frame_bind()
+static void resolve_lambda(lisp fargs, lisp body, scope* sc, lisp env) {
+    lisp defs = nil;
+    if (resolve_scan(body, &defs)) return;
+
+    int n = 0;
+    lisp x = fargs;
+    while (IS(x, conss)) { n++; x = cdr(x); }
+    if (x) n++;
+
+    scope list = { fargs, 0, sc }; // too many, bound below an empty frame
+    scope args = { n > FRAME_MAX ? nil : fargs, 1, n > FRAME_MAX ? &list : sc };
+    scope local = { defs, 0, &args };
+    resolve_list(body, &local, env);
+}
+
+// returns x resolved, forms are changed in place
+static lisp resolve(lisp x, scope* sc, lisp env) {
+    if (SYMP(x)) return resolve_name(x, sc, env, 0);
+    if (!IS(x, conss)) return x;
+
+    lisp h = car(x);
+    lisp args = cdr(x);
+    lisp r = SYMP(h) ? resolve_name(h, sc, env, 1) : resolve(h, sc, env);
+    lisp f = !IS(r, var) ? r : INTP(ATTR(var, r, bind)) ? nil : cdr(ATTR(var, r, bind));
+    if (r != h && !PRIMP(f)) setcar(x, r); // eval_hlp() puts prims there
+
+    // only args of a known lambda are evaluated, an unknown head may become an
+    // NLAMBDA and get them as data, then a var is still eq to its name
+    if (IS(f, func) && !ATTR(func, f, env)) return x; // NLAMBDA
+    if (IS(f, func) || (h == resolve_self && h) || (IS(h, conss) && car(h) == symbol("lambda"))) {
+        resolve_list(args, sc, env);
+        return x;
+    }
+    if (!PRIMP(f)) return x;
+    if (getprimnum(f) > 0) {
+        resolve_list(args, sc, env);
+        return x;
+    }
+
+    void* fp = getprimfunc(f);
+    if (fp == lambda) {
+        resolve_lambda(car(args), cdr(args), sc, env);
+    } else if (fp == de) {
+        resolve_lambda(car(cdr(args)), cdr(cdr(args)), sc, env);
+    } else if (fp == _define) {
+        if (IS(car(args), conss)) resolve_lambda(cdr(car(args)), cdr(args), sc, env);
+        else resolve_list(cdr(args), sc, env);
+    } else if (fp == let || fp == let_star) {
+        scope s = { car(args), 0, sc };
+        lisp b;
+        for(b = car(args); IS(b, conss); b = cdr(b)) resolve_list(cdr(car(b)), &s, env);
+        resolve_list(cdr(args), &s, env);
+    } else if (fp == cond) {
+        for(; IS(args, conss); args = cdr(args)) resolve_list(car(args), sc, env);
+    } else if (fp == case_) {
+        setcar(args, resolve(car(args), sc, env));
+        for(args = cdr(args); IS(args, conss); args = cdr(args)) resolve_list(cdr(car(args)), sc, env);
+    } else if (fp == _setbang) {
+        resolve_list(cdr(args), sc, env);
+    } else if (fp == if_ || fp == and || fp == or || fp == progn || fp == time_) {
+        resolve_list(args, sc, env);
+    }
+    // quote, nlambda and others, args are data
+    return x;
+}
+
+// inside a function call all envs have a frame
+static int framep(lisp env) {
+    while (env && !IS(env, frame)) env = cdr(env);
+    return env != nil;
+}
+
+// essentially this is a quote but it stores the environment so it's a closure!
+PRIM lambda(lisp* envp, lisp all) {
+    if (lexical && !framep(*envp)) resolve_lambda(car(all), cdr(all), NULL, *envp);
+    return mkfunc(all, *envp);
+}
+
+PRIM nlambda(lisp* envp, lisp all) {
+    return mkfunc(all, nil);
+}
+
+PRIM progn(lisp* envp, lisp all) {
+    while (all && cdr(all)) {
+        evalGC(car(all), envp);
+        all = cdr(all);
+    }
+    // only last form needs be tail recursive..., or if have "return"?
+    return mkimmediate(car(all), *envp);
+}
+
+static inline lisp letevallist(lisp args, lisp* envp, lisp extend);
+static inline lisp letstarevallist(lisp args, lisp* envp, lisp extend);
+
+PRIM let(lisp* envp, lisp all) {
+    lisp lenv = letevallist(car(all), envp, *envp);
+    return progn(&lenv, cdr(all));
+}
+
+PRIM let_star(lisp* envp, lisp all) {
+    lisp lenv = letstarevallist(car(all), envp, *envp);
+    return progn(&lenv, cdr(all));
+}
+
+// use bindEvalList unless NLAMBDA
+static inline lisp bindList(lisp fargs, lisp args, lisp env) {
+    // TODO: not recurse!
+    if (!fargs) return env;
+    if (SYMP(args)) return cons(cons(fargs, args), env);
+    lisp b = cons(car(fargs), car(args));
+    // self tail recursion is "goto" - efficient
+    return bindList(cdr(fargs), cdr(args), cons(b, env));
+}
+
+static inline lisp bindEvalList(lisp fargs, lisp args, lisp* envp, lisp extend) {
+    while (fargs) {
+        if (SYMP(fargs)) return cons(cons(fargs, evallist(args, envp)), extend);
+        // This eval cannot be allowed to GC! (since it's part of building a cons structure
+        // TODO: protect ala evallist
+        lisp b = cons(car(fargs), eval(car(args), envp));
+        extend = cons(b, extend);
+        fargs = cdr(fargs);
+        args = cdr(args);
+    }
+    return extend;
+}
+
+// bind fargs to args in a new frame extending parent, evaluate args unless !envp
+static inline lisp frame_bind(lisp fargs, lisp args, lisp* envp, lisp parent) {
+    int n = 0;
+    lisp x = fargs;
+    while (IS(x, conss)) { n++; x = cdr(x); }
+    if (x) n++; // (a b . rest)
+    if (n > FRAME_MAX) { // empty frame on top
+        parent = envp ? bindEvalList(fargs, args, envp, parent) : bindList(fargs, args, parent);
+        fargs = nil;
+        n = 0;
+    }
+
+    // the values go on vm_stack first, evaluating the next one may GC
+    int sp = vm_sp, i;
+    if (sp + n >= VM_STACK) error("VM stack blowup!");
+    for(x = fargs; IS(x, conss); x = cdr(x)) {
+        lisp a = car(args);
+        if (envp) a = evalGC(a, envp);
+        vm_stack[vm_sp++] = a;
+        args = cdr(args);
+    }
+    if (x) vm_stack[vm_sp++] = envp ? evallist(args, envp) : args;
+
+    frame* f = myMalloc(FRAME_BYTES(n), frame_TAG);
+    f->tag = frame_TAG;
+    f->xx = n;
+    f->names = fargs;
+    f->parent = parent;
+    for(i = 0; i < n; i++) f->slots[i] = vm_stack[sp + i];
+    vm_sp = sp;
+    return (lisp)f;
+}
+
+// the bindings made so far are kept on vm_stack, evaluating the next one may GC
+static inline lisp letevallist(lisp args, lisp* envp, lisp extend) {
+    if (vm_sp >= VM_STACK) error("VM stack blowup!");
+    int sp = vm_sp++;
+    while (args) {
+        lisp one = car(args);
+        vm_stack[sp] = extend;
+        lisp r = evalGC(car(cdr(one)), envp);
+        extend = cons(cons(car(one), r), extend);
+        args = cdr(args);
+    }
+    vm_sp = sp;
+    return extend;
+}
+
+static inline lisp letstarevallist(lisp args, lisp* envp, lisp extend) {
+    while (args) {
+        lisp one = car(args);
+        lisp r = evalGC(car(cdr(one)), &extend); // extend is *envp, a root
+        extend = cons(cons(car(one), r), extend);
+        args = cdr(args);
+    }
+    return extend;
+}
+
+static int compile_auto = 0;
+static lisp compile_func(lisp f, int tree);
+static lisp vm_apply(lisp f, lisp args, lisp* envp, int noeval);
+
+static inline lisp funcapply(lisp f, lisp args, lisp* envp, int noeval) {
+    lisp lenv = ATTR(thunk, f, env);
+    lisp l = ATTR(thunk, f, e);
+    //printf("FUNCAPPLY:"); princ(f); printf(" body="); princ(l); printf(" args="); princ(args); printf(" env="); princ(lenv); terpri();
+    lisp fargs = car(l);
+
+    lisp c = ATTR(func, f, code);
+    if (!c && compile_auto && lenv && !framep(lenv)) c = compile_func(f, compile_auto == 2);
+    // the body is gone once compiled, unless compiled while tracing
+    if (IS(c, code) && (!cdr(l) || (!trace && !tracep(f)))) return vm_apply(f, args, envp, noeval);
+
+    if (!lenv) { // !lenv) {
+        //printf("[funcapply NLAMBDA: "); prin1(f); putchar(' '); prin1(args);
+        //printf(" LENV="); prin1(lenv);
+        //printf(" ENV="); prin1(*envp);
+        //printf("]\n");
+        noeval = 1;
+        // put env of caller in front, similary to PRIM -7 function
+        args = cons(*envp, args);
+    }
+
+    // TODO: check if NLAMBDA!
+    if (vm_sp >= VM_STACK) error("VM stack blowup!");
+    vm_stack[vm_sp++] = f; // keeps lenv, evaluating args may GC
+    lenv = frame_bind(fargs, args, noeval ? NULL : envp, lenv);
+    vm_sp--;
+    //printf("NEWENV: "); princ(lenv); terpri();
+
+    int dotrace = tracep(f);
+    if (dotrace) {
+        indent(trace_level++); printf("--->"); print_args(lenv, f); terpri();
+    }
+
+    if (!dotrace) return progn(&lenv, cdr(l)); // tail recurse on rest
+
+    lisp r = reduce_immediate(progn(&lenv, cdr(l)));
+
+    if (dotrace) {
+        indent(--trace_level); printf("<--- ");
+        prin1(funame(f)); printf(" ==> "); princ(r); terpri();
+    }
+    return r;
+}
+
+// TODO: prim apply/funcapply may return immediate... (so users should call apply instead)
+static inline lisp callfunc(lisp f, lisp args, lisp* envp, lisp e, int noeval) {
+    int tag = TAG(f);
+    if (tag == prim_TAG) return primapply(f, args, envp, e, noeval);
+    if (tag == func_TAG) return funcapply(f, args, envp, noeval);
+    if (tag == thunk_TAG) return f; // ignore args
+
+    printf("%% "); princ(f); printf(" did not evaluate to a function in: "); princ(e ? e : cons(f, args));
+    printf(" evaluated to "); princ(cons(f, args)); terpri();
+    error("Not a function");
+    return nil;
+}
+
+// Bytecode compiler
+// -----------------
+// (compile 'f) translates the body of f to bytecode run by vm_run(), a
+// stack machine. (compile 1) compiles a func defined at top level the first
+// time it's called, (compile 0) turns that off. A compiled func is still a
+// func, but its body is dropped, pp shows only the fargs and trace is done
+// by vm_apply(). Compiled while "trace on" the body is kept and interpreted
+// when tracing. Compiled and interpreted functions call each other.
+//
+// A call pushes the func and the arguments on vm_stack[] (a GC root), the
+// arguments stay there and are the variables, no frame is made. let
+// variables get slots after them. Only if a lambda inside uses them, or a
+// form is left to the interpreter (EVAL, it needs to see them), the
+// arguments are put in a frame and let conses bindings, as interpreted.
+// Each call takes a level of stack[] so it shows in backtraces.
+//
+// Variables are found when compiled: a slot, the n:th binding up the env,
+// a global binding, or if not defined yet looked up by name when run.
+// Calls to globals are by the binding, so redefinition takes effect, but
+// builtin prims are called directly. + - * < <= > >= = eq are inline for
+// fixnums.
+//
+// Not compiled: NLAMBDA, bodies using eval, env, define or de.
+//
+// (bench-fibo 30) from bench.lsp, (compile 1) and load it again to compare.
+
+enum {
+    OP_NIL, OP_INT, OP_CONST, // push nil, -128..127, consts[k]
+    OP_ARG, OP_SETARG, // slot i on vm_stack
+    OP_LOCAL, OP_SETLOCAL, // d bindings up the env, frame slot i-1 or (i = 0) the cons
+    OP_GLOBAL, OP_SETGLOBAL, // binding consts[k]
+    OP_LOOKUP, OP_SETLOOKUP, // name consts[k] when run
+    OP_POP,
+    OP_JMP, OP_JNIL, // jump to 16 bit address, JNIL pops
+    OP_JNILK, OP_JTK, // jump if nil/not nil and keep it, else pop
+    OP_PRIM0, OP_PRIM1, OP_PRIM2, OP_PRIM3, OP_PRIM4, OP_PRIM5, OP_PRIM6, // prim consts[k]
+    OP_PRIML, // prim consts[k] of n args given as a list
+    OP_PRIMV, // prim consts[k] of n args given as argv, PRIM_ARGV
+    OP_ADD, OP_MUL, // of n args
+    OP_SUB, OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_EQUAL,
+    OP_CALL, OP_TCALL, // func and n args on stack, TCALL returns the result
+    OP_RET,
+    OP_EVAL, // consts[k] by the interpreter
+    OP_CLOSURE, // lambda consts[k] with code consts[k+1]
+    OP_BIND, OP_UNBIND, // bind n values to names of let bindings consts[k], or unbind n
+};
+
+// scope of variables when compiling
+#define CS_STACK 0 // slots from base on vm_stack
+#define CS_FRAME 1 // a frame
+#define CS_LET 2 // cons bindings, last is first in env
+
+typedef struct cscope {
+    lisp names; // fargs, or let bindings ((a 1) (b 2))
+    int n; // number of names visible, let* adds one at a time
+    int kind;
+    int base;
+    struct comp* c;
+    struct cscope* up;
+} cscope;
+
+typedef struct comp {
+    lisp env; // of func, for variables outside
+    int frame; // args in a frame, let binds conses
+    int needframe; // found it needs a frame, compile again with
+    int fail;
+    int nargs, locals, maxlocals;
+    int depth, maxdepth; // value stack
+    unsigned char* bc;
+    int n, size;
+    int tree; // to nodes, see n_expr()
+    struct node* nodes;
+    int nnodes, nsize;
+    lisp* consts;
+    int nconsts, csize;
+    cscope* sc;
+    struct comp* up; // compiling a lambda inside
+} comp;
+
+static void c_byte(comp* c, int b) {
+    if (c->fail) return;
+    if (c->n >= c->size) {
+        int sz = c->size ? c->size * 2 : 64;
+        unsigned char* bc = realloc(c->bc, sz);
+        if (!bc || sz > 0xffff) { c->fail = 1; return; }
+        c->bc = bc;
+        c->size = sz;
+    }
+    c->bc[c->n++] = b;
+}
+
+// d is the change in depth of value stack
+static void c_op(comp* c, int op, int d) {
+    c_byte(c, op);
+    c->depth += d;
+    if (c->depth > c->maxdepth) c->maxdepth = c->depth;
+}
+
+static void c_arg(comp* c, int a) {
+    if (a < 0 || a > 255) c->fail = 1;
+    c_byte(c, a);
+}
+
+static int c_newconst(comp* c, lisp x) {
+    if (c->nconsts >= c->csize) {
+        int sz = c->csize ? c->csize * 2 : 16;
+        lisp* k = realloc(c->consts, sz * sizeof(lisp));
+        if (!k) { c->fail = 1; return 0; }
+        c->consts = k;
+        c->csize = sz;
+    }
+    c->consts[c->nconsts] = x;
+    return c->nconsts++;
+}
+
+static int c_const(comp* c, lisp x) {
+    int i;
+    for(i = 0; i < c->nconsts; i++) if (c->consts[i] == x) return i;
+    return c_newconst(c, x);
+}
+
+// jump to be patched, chain links all jumps to the same place
+static int c_jump(comp* c, int op, int d, int chain) {
+    c_op(c, op, d);
+    int at = c->n;
+    c_byte(c, chain & 0xff);
+    c_byte(c, (chain >> 8) & 0xff);
+    return at;
+}
+
+// patch chain of jumps to here
+static void c_patch(comp* c, int chain) {
+    while (chain != 0xffff && !c->fail) {
+        int next = c->bc[chain] | (c->bc[chain + 1] << 8);
+        c->bc[chain] = c->n & 0xff;
+        c->bc[chain + 1] = c->n >> 8;
+        chain = next;
+    }
+}
+
+static void c_ret(comp* c, int tail) {
+    if (tail) c_op(c, OP_RET, -1);
+}
+
+// a variable is needed in an env, frames are needed up to (and including) c
+static void c_frames(comp* c) {
+    for(; c; c = c->up) if (!c->frame) c->needframe = 1;
+}
+
+#define V_ARG 0
+#define V_LOCAL 1
+#define V_CELL 2
+#define V_LOOKUP 3
+
+// index of name in names (fargs or let bindings), or -1
+static int c_find(lisp names, int n, lisp name) {
+    int i;
+    for(i = 0; i < n && names; i++) {
+        lisp x = IS(names, conss) ? car(names) : names; // (a b . rest)
+        if (IS(x, conss)) x = car(x); // let binding (a 1)
+        if (x == name) return i;
+        names = IS(names, conss) ? cdr(names) : nil;
+    }
+    return -1;
+}
+
+// find variable, slot *a, or *a bindings up in env slot *b, or the binding *cell
+static int c_var(comp* c, lisp name, int* a, int* b, lisp* cell) {
+    int links = 0;
+    cscope* sc;
+    for(sc = c->sc; sc; sc = sc->up) {
+        int i = c_find(sc->names, sc->n, name);
+        if (i >= 0) {
+            if (sc->c != c) c_frames(c->up);
+            if (sc->kind == CS_STACK) { *a = sc->base + i; return V_ARG; }
+            *a = sc->kind == CS_LET ? links + sc->n - 1 - i : links;
+            *b = sc->kind == CS_LET ? -1 : i;
+            return V_LOCAL;
+        }
+        if (sc->kind == CS_FRAME) links++;
+        if (sc->kind == CS_LET) links += sc->n;
+    }
+
+    comp* top = c;
+    while (top->up) top = top->up;
+    lisp env = top->env;
+    while (env) {
+        if (IS(env, frame)) {
+            int i = c_find(ATTR(frame, env, names), env->xx, name);
+            if (i >= 0) {
+                c_frames(c->up);
+                *a = links;
+                *b = i;
+                return V_LOCAL;
+            }
+            env = ATTR(frame, env, parent);
+        } else {
+            lisp bind = car(env);
+            if (car(bind) == name) { *cell = bind; return V_CELL; }
+            env = cdr(env);
+        }
+        links++;
+    }
+
+    *cell = findsym(name);
+    return *cell ? V_CELL : V_LOOKUP;
+}
+
+// load variable, or if set, store top of stack in it
+static void c_load(comp* c, lisp name, int set) {
+    int a = 0, b = 0;
+    lisp cell = nil;
+    int v = c_var(c, name, &a, &b, &cell);
+    if (v == V_ARG) {
+        c_op(c, set ? OP_SETARG : OP_ARG, !set);
+        c_arg(c, a);
+    } else if (v == V_LOCAL) {
+        c_op(c, set ? OP_SETLOCAL : OP_LOCAL, !set);
+        c_arg(c, a);
+        c_arg(c, b + 1);
+    } else if (v == V_CELL) {
+        c_op(c, set ? OP_SETGLOBAL : OP_GLOBAL, !set);
+        c_arg(c, c_const(c, cell));
+    } else {
+        c_op(c, set ? OP_SETLOOKUP : OP_LOOKUP, !set);
+        c_arg(c, c_const(c, name));
+    }
+}
+
+static void c_expr(comp* c, lisp x, int tail);
+static lisp compile_lambda(lisp all, lisp env, comp* up, int tree);
+
+static void c_body(comp* c, lisp body, int tail) {
+    if (!body) { c_op(c, OP_NIL, 1); c_ret(c, tail); return; }
+    while (IS(cdr(body), conss)) {
+        c_expr(c, car(body), 0);
+        c_op(c, OP_POP, -1);
+        body = cdr(body);
+    }
+    c_expr(c, car(body), tail);
+}
+
+// left to the interpreter
+static void c_eval(comp* c, lisp x, int tail) {
+    c_frames(c);
+    c_op(c, OP_EVAL, 1);
+    c_arg(c, c_const(c, x));
+    c_ret(c, tail);
+}
+
+// (if test then else)
+static void c_if(comp* c, lisp args, int tail) {
+    c_expr(c, car(args), 0);
+    int els = c_jump(c, OP_JNIL, -1, 0xffff);
+    c_expr(c, car(cdr(args)), tail);
+    int end = 0xffff;
+    if (!tail) { end = c_jump(c, OP_JMP, 0, end); c->depth--; }
+    c_patch(c, els);
+    c_expr(c, car(cdr(cdr(args))), tail);
+    c_patch(c, end);
+}
+
+// (cond (test . body) ...)
+static void c_cond(comp* c, lisp args, int tail) {
+    int end = 0xffff;
+    for(; IS(args, conss); args = cdr(args)) {
+        lisp clause = car(args);
+        c_expr(c, car(clause), 0);
+        if (cdr(clause)) {
+            int next = c_jump(c, OP_JNIL, -1, 0xffff);
+            c_body(c, cdr(clause), tail);
+            if (!tail) { end = c_jump(c, OP_JMP, 0, end); c->depth--; }
+            c_patch(c, next);
+        } else {
+            end = c_jump(c, OP_JTK, -1, end);
+        }
+    }
+    c_op(c, OP_NIL, 1);
+    c_patch(c, end);
+    c_ret(c, tail);
+}
+
+// (and ...) (or ...)
+static void c_andor(comp* c, lisp args, int tail, int op) {
+    if (!args) { c_op(c, OP_NIL, 1); c_ret(c, tail); return; }
+    int end = 0xffff;
+    while (IS(cdr(args), conss)) {
+        c_expr(c, car(args), 0);
+        end = c_jump(c, op, -1, end);
+        args = cdr(args);
+    }
+    c_expr(c, car(args), tail);
+    if (end == 0xffff) return;
+    if (tail) c->depth++; // value kept by jumps
+    c_patch(c, end);
+    c_ret(c, tail);
+}
+
+// (let ((a 1) (b 2)) . body), star for let*
+static void c_let(comp* c, lisp args, int tail, int star) {
+    lisp binds = car(args);
+    int n = 0;
+    lisp b;
+    for(b = binds; IS(b, conss); b = cdr(b)) {
+        if (!IS(car(b), conss) || !SYMP(car(car(b)))) { c_eval(c, cons(symbol(star ? "let*" : "let"), args), tail); return; }
+        n++;
+    }
+
+    cscope s = { binds, 0, c->frame ? CS_LET : CS_STACK, c->nargs + c->locals, c, c->sc };
+    if (!c->frame) {
+        c->locals += n;
+        if (c->locals > c->maxlocals) c->maxlocals = c->locals;
+    }
+    if (star) c->sc = &s;
+    int i = 0;
+    for(b = binds; IS(b, conss); b = cdr(b), i++) {
+        c_expr(c, car(cdr(car(b))), 0);
+        if (!c->frame) {
+            c_op(c, OP_SETARG, 0);
+            c_arg(c, s.base + i);
+            c_op(c, OP_POP, -1);
+        } else if (star) {
+            c_op(c, OP_BIND, -1);
+            c_arg(c, c_const(c, b));
+            c_arg(c, 1);
+        }
+        s.n = star ? i + 1 : 0;
+    }
+    if (c->frame && !star && n) {
+        c_op(c, OP_BIND, -n);
+        c_arg(c, c_const(c, binds));
+        c_arg(c, n);
+    }
+    s.n = n;
+    c->sc = &s;
+
+    c_body(c, cdr(args), tail);
+
+    c->sc = s.up;
+    if (!c->frame) c->locals -= n;
+    else if (!tail && n) {
+        c_op(c, OP_UNBIND, 0);
+        c_arg(c, n);
+    }
+}
+
+// (lambda fargs . body)
+static void c_lambda(comp* c, lisp all) {
+    lisp code = compile_lambda(all, c->env, c, 0);
+    if (!code) c_frames(c); // interpreted, needs the env as if it was
+    int k = c_newconst(c, all);
+    c_newconst(c, code);
+    c_op(c, OP_CLOSURE, 1);
+    c_arg(c, k);
+}
+
+// call builtin prim f
+static void c_prim(comp* c, lisp f, lisp x, int tail) {
+    lisp args = cdr(x);
+    void* fp = getprimfunc(f);
+    int an = getprimnum(f);
+    if (an < 0) {
+        if (fp == _quote) {
+            c_op(c, OP_CONST, 1);
+            c_arg(c, c_const(c, car(args)));
+            c_ret(c, tail);
+        }
+        else if (fp == if_) c_if(c, args, tail);
+        else if (fp == cond) c_cond(c, args, tail);
+        else if (fp == and) c_andor(c, args, tail, OP_JNILK);
+        else if (fp == or) c_andor(c, args, tail, OP_JTK);
+        else if (fp == progn) c_body(c, args, tail);
+        else if (fp == let) c_let(c, args, tail, 0);
+        else if (fp == let_star) c_let(c, args, tail, 1);
+        else if (fp == lambda) { c_lambda(c, args); c_ret(c, tail); }
+        else if (fp == _setbang && (SYMP(car(args)) || IS(car(args), var))) {
+            lisp name = car(args);
+            c_expr(c, car(cdr(args)), 0);
+            c_load(c, IS(name, var) ? ATTR(var, name, name) : name, 1);
+            c_ret(c, tail);
+        }
+        else c_eval(c, x, tail);
+        return;
+    }
+
+    int n = 0;
+    lisp a;
+    for(a = args; IS(a, conss); a = cdr(a)) n++;
+    if (an < 7 && n > an) { c_eval(c, x, tail); return; } // only first an are evaluated
+
+    for(a = args; IS(a, conss); a = cdr(a)) c_expr(c, car(a), 0);
+    if (fp == plus || fp == times) {
+        c_op(c, fp == plus ? OP_ADD : OP_MUL, 1 - n);
+        c_arg(c, n);
+        c_ret(c, tail);
+        return;
+    }
+    if (an >= 7) {
+        c_op(c, an == 7 ? OP_PRIML : OP_PRIMV, 1 - n);
+        c_arg(c, c_const(c, f));
+        c_arg(c, n);
+        c_ret(c, tail);
+        return;
+    }
+    for(; n < an; n++) c_op(c, OP_NIL, 1);
+
+    int op = fp == minus ? OP_SUB : fp == lt ? OP_LT : fp == lte ? OP_LE : fp == gt ? OP_GT :
+        fp == gte ? OP_GE : fp == eq ? OP_EQ : fp == equal ? OP_EQUAL : -1;
+    if (op >= 0) {
+        c_op(c, op, -1);
+    } else {
+        c_op(c, OP_PRIM0 + an, 1 - an);
+        c_arg(c, c_const(c, f));
+    }
+    c_ret(c, tail);
+}
+
+static void c_expr(comp* c, lisp x, int tail) {
+    if (c->fail) return;
+    if (IS(x, var)) x = ATTR(var, x, name);
+    if (!x) {
+        c_op(c, OP_NIL, 1);
+    } else if (SYMP(x)) {
+        c_load(c, x, 0);
+    } else if (INTP(x) && GETINT(x) >= -128 && GETINT(x) < 128) {
+        c_op(c, OP_INT, 1);
+        c_byte(c, GETINT(x) & 0xff);
+    } else if (!IS(x, conss)) {
+        c_op(c, OP_CONST, 1);
+        c_arg(c, c_const(c, x));
+    } else {
+        lisp h = prim_head(car(x));
+        lisp name = IS(h, var) ? ATTR(var, h, name) : h;
+        lisp f = PRIMP(h) ? h : nil; // put there by resolve() or gethead()
+        if (SYMP(name)) {
+            int a, b;
+            lisp cell = nil;
+            int v = c_var(c, name, &a, &b, &cell);
+            if (v == V_CELL && cell == findsym(name)) f = cdr(cell);
+        }
+        if (PRIMP(f) && funame(f) == (PRIMP(h) ? funame(h) : name)) { c_prim(c, f, x, tail); return; }
+        if (IS(f, func) && !ATTR(func, f, env)) { c_eval(c, x, tail); return; } // NLAMBDA
+
+        if (SYMP(name)) c_load(c, name, 0); else c_expr(c, h, 0);
+        int n = 0;
+        lisp a;
+        for(a = cdr(x); IS(a, conss); a = cdr(a), n++) c_expr(c, car(a), 0);
+        c_op(c, tail ? OP_TCALL : OP_CALL, tail ? -n - 1 : -n);
+        c_arg(c, n);
+        return;
+    }
+    c_ret(c, tail);
+}
+
+// code object with the consts of c and nbytes after
+static code* c_code(comp* c, int rest, int nbytes) {
+    code* r = myMalloc(CODE_BYTES(c->nconsts, nbytes), code_TAG);
+    r->tag = code_TAG;
+    r->xx = c->nargs;
+    r->flags = (c->frame ? CODE_FRAME : 0) | (rest ? CODE_REST : 0);
+    r->locals = c->maxlocals;
+    r->stack = c->nargs + c->maxlocals + c->maxdepth + 1;
+    r->nconsts = c->nconsts;
+    r->nbytes = nbytes;
+    memcpy(r->consts, c->consts, c->nconsts * sizeof(lisp));
+    return r;
+}
+
+static lisp c_done(comp* c, int rest) {
+    if (c->fail || c->maxdepth + c->nargs + c->maxlocals > 0x7fff) return nil;
+    code* r = c_code(c, rest, c->n);
+    memcpy(CODE_BC(r), c->bc, c->n);
+    return (lisp)r;
+}
+
+// Closure tree
+// ------------
+// (compile 'f 2) compiles f to a tree of nodes instead, (compile 2) does it
+// at first call. Each node has a C function specialized for the shape of
+// the form: argument slot i, (if (< a b) ...), a prim of 2 args... It calls
+// the functions of its children, nothing is dispatched on tags or walked
+// with car/cdr when run. Scopes, variables, prims, calls and tail calls are
+// as for bytecode, vm_run() runs the tree using nd_run(). A node is 9 words,
+// the bytecode is smaller.
+
+typedef struct nctx {
+    lisp* a; // args and let slots on vm_stack
+    lisp* envp;
+    int bp;
+    int tail; // number of args of tail call at bp-1, or -1
+} nctx;
+
+typedef struct node {
+    lisp (*fn)(struct node* n, nctx* x);
+    struct node* a; // children
+    struct node* b;
+    struct node* c;
+    struct node* next; // next arg or form
+    lisp v; // constant, binding, name or prim
+    void* p; // C function of prim, code of lambda
+    int i; // slot, links up the env, or number of args
+    short j; // frame slot + 1, tail call, let*
+    short simple; // can't GC or call
+} node;
+
+#define NEVAL(n, x) ((n)->fn((n), (x)))
+
+// v is computed before, it may push
+#define ND_PUSH(v) do { if (vm_sp >= VM_STACK) error("VM stack blowup!"); vm_stack[vm_sp++] = (v); } while (0)
+
+static lisp vm_run(int bp, int n);
+static inline int vm_compiled(lisp f);
+static lisp vm_callfunc(lisp f, lisp* argv, int n, lisp* envp);
+
+static lisp nd_const(node* n, nctx* x) { return n->v; }
+static lisp nd_arg(node* n, nctx* x) { return x->a[n->i]; }
+static lisp nd_global(node* n, nctx* x) { return cdr(n->v); }
+static lisp nd_lookup(node* n, nctx* x) { return getvar(n->v, *x->envp); }
+
+static inline lisp nd_env(node* n, nctx* x) {
+    lisp e = *x->envp;
+    int d = n->i;
+    while (d--) e = IS(e, frame) ? ATTR(frame, e, parent) : cdr(e);
+    return e;
+}
+
+static lisp nd_local(node* n, nctx* x) {
+    lisp e = nd_env(n, x);
+    return n->j ? ATTR(frame, e, slots)[n->j - 1] : cdr(car(e));
+}
+
+static lisp nd_setarg(node* n, nctx* x) {
+    lisp v = NEVAL(n->a, x);
+    x->a[n->i] = v;
+    return v;
+}
+
+static lisp nd_setlocal(node* n, nctx* x) {
+    lisp v = NEVAL(n->a, x);
+    lisp e = nd_env(n, x);
+    if (n->j) { ATTR(frame, e, slots)[n->j - 1] = v; remember(e, v); }
+    else setcdr(car(e), v);
+    return v;
+}
+
+static lisp nd_setglobal(node* n, nctx* x) {
+    lisp v = NEVAL(n->a, x);
+    setcdr(n->v, v);
+    return v;
+}
+
+static lisp nd_setlookup(node* n, nctx* x) {
+    lisp v = NEVAL(n->a, x);
+    int i;
+    lisp b = env_find(*x->envp, n->v, &i);
+    if (b) bind_set(b, i, v); else setcdr(hashsym(n->v, NULL, 0, 0), v);
+    return v;
+}
+
+// value of n->b, *l gets n->a, kept on vm_stack if n->b may GC
+static inline lisp nd_two(node* n, nctx* x, lisp* l) {
+    lisp a = NEVAL(n->a, x);
+    if (n->b->simple) { *l = a; return NEVAL(n->b, x); }
+    ND_PUSH(a);
+    lisp b = NEVAL(n->b, x);
+    *l = vm_stack[--vm_sp];
+    return b;
+}
+
+static int nd_fresh(node* k);
+
+static lisp nd_sub(node* n, nctx* x) {
+    lisp a, b = nd_two(n, x, &a);
+    int r;
+    if (FIXSUB(a, b, r)) return FIXTAGGED(r);
+    float_temp = FLOATP(a) && nd_fresh(n->a) ? a : FLOATP(b) && nd_fresh(n->b) ? b : NULL;
+    return minus(a, b);
+}
+
+// the sum so far is kept on vm_stack, it may be a boxed number and a child may GC,
+// it's a float only we have once we added to it, or the first arg was fresh
+static lisp nd_add(node* n, nctx* x) {
+    int sp = vm_sp, r, own;
+    node* k = n->a;
+    ND_PUSH(k ? NEVAL(k, x) : MKINT(0));
+    for(own = k && nd_fresh(k), k = k ? k->next : NULL; k; k = k->next, own = 1) {
+        lisp a = NEVAL(k, x), v = vm_stack[sp];
+        if (FIXADD(v, a, r)) { vm_stack[sp] = FIXTAGGED(r); continue; }
+        float_temp = FLOATP(v) && own ? v : FLOATP(a) && nd_fresh(k) ? a : NULL;
+        vm_stack[sp] = plus(2, (lisp[]){ v, a });
+    }
+    vm_sp = sp;
+    return vm_stack[sp];
+}
+
+static lisp nd_mul(node* n, nctx* x) {
+    int sp = vm_sp, r, own;
+    node* k = n->a;
+    ND_PUSH(k ? NEVAL(k, x) : MKINT(1));
+    for(own = k && nd_fresh(k), k = k ? k->next : NULL; k; k = k->next, own = 1) {
+        lisp a = NEVAL(k, x), v = vm_stack[sp];
+        if (FIXMUL(v, a, r)) { vm_stack[sp] = FIXTAGGED(r); continue; }
+        float_temp = FLOATP(v) && own ? v : FLOATP(a) && nd_fresh(k) ? a : NULL;
+        vm_stack[sp] = times(2, (lisp[]){ v, a });
+    }
+    vm_sp = sp;
+    return vm_stack[sp];
+}
+
+// k is arithmetic, a float it gives is only its parent's, see float_ret(),
+// but (+ x) and (* x) give x itself, only two args or more call plus/times
+static int nd_fresh(node* k) {
+    if (k->fn == nd_add || k->fn == nd_mul) return k->a && k->a->next;
+    return k->fn == nd_sub;
+}
+
+// (< a b) and (if (< a b) then else)
+#define ND_CMP(name, op, f) \
+    static lisp nd_##name(node* n, nctx* x) { \
+        lisp a, b = nd_two(n, x, &a); \
+        return INTP(a) && INTP(b) ? (GETINT(a) op GETINT(b) ? t : nil) : f(a, b); \
+    } \
+    static lisp nd_if##name(node* n, nctx* x) { \
+        lisp a, b = nd_two(n->a, x, &a); \
+        int r = INTP(a) && INTP(b) ? GETINT(a) op GETINT(b) : f(a, b) != nil; \
+        return r ? NEVAL(n->b, x) : NEVAL(n->c, x); \
+    }
+
+ND_CMP(lt, <, lt)
+ND_CMP(le, <=, lte)
+ND_CMP(gt, >, gt)
+ND_CMP(ge, >=, gte)
+ND_CMP(eq, ==, eq)
+ND_CMP(equal, ==, equal)
+
+static lisp nd_if(node* n, nctx* x) {
+    return NEVAL(n->a, x) ? NEVAL(n->b, x) : NEVAL(n->c, x);
+}
+
+// clauses are nodes of test a and body b, or no body
+static lisp nd_cond(node* n, nctx* x) {
+    node* k;
+    for(k = n->a; k; k = k->next) {
+        lisp v = NEVAL(k->a, x);
+        if (v) return k->b ? NEVAL(k->b, x) : v;
+    }
+    return nil;
+}
+
+static lisp nd_and(node* n, nctx* x) {
+    node* k;
+    for(k = n->a; k->next; k = k->next) if (!NEVAL(k, x)) return nil;
+    return NEVAL(k, x);
+}
+
+static lisp nd_or(node* n, nctx* x) {
+    node* k;
+    for(k = n->a; k->next; k = k->next) {
+        lisp v = NEVAL(k, x);
+        if (v) return v;
+    }
+    return NEVAL(k, x);
+}
+
+static lisp nd_progn(node* n, nctx* x) {
+    node* k;
+    for(k = n->a; k->next; k = k->next) NEVAL(k, x);
+    return NEVAL(k, x);
+}
+
+// let in slots from i
+static lisp nd_let(node* n, nctx* x) {
+    int i = n->i;
+    node* k;
+    for(k = n->a; k; k = k->next) x->a[i++] = NEVAL(k, x);
+    return NEVAL(n->b, x);
+}
+
+// let in a frame conses the bindings v, let* (j) one at a time
+static lisp nd_bind(node* n, nctx* x) {
+    lisp saved = *x->envp;
+    lisp b = n->v;
+    node* k;
+    if (n->j) {
+        for(k = n->a; k; k = k->next, b = cdr(b)) {
+            lisp v = NEVAL(k, x);
+            *x->envp = cons(cons(car(car(b)), v), *x->envp);
+        }
+    } else {
+        int sp = vm_sp, i;
+        for(k = n->a; k; k = k->next) {
+            lisp v = NEVAL(k, x);
+            ND_PUSH(v);
+        }
+        for(i = sp; i < vm_sp; i++, b = cdr(b)) *x->envp = cons(cons(car(car(b)), vm_stack[i]), *x->envp);
+        vm_sp = sp;
+    }
+    lisp r = NEVAL(n->b, x);
+    *x->envp = saved;
+    return r;
+}
+
+static lisp nd_prim0(node* n, nctx* x) {
+    lisp (*fp)() = n->p;
+    return fp();
+}
+
+static lisp nd_prim1(node* n, nctx* x) {
+    lisp (*fp)(lisp) = n->p;
+    return fp(NEVAL(n->a, x));
+}
+
+static lisp nd_prim2(node* n, nctx* x) {
+    lisp (*fp)(lisp, lisp) = n->p;
+    lisp a, b = nd_two(n, x, &a);
+    return fp(a, b);
+}
+
+// prim of i args, 7 is a list, PRIM_ARGV gets them, args are kept on vm_stack
+static lisp nd_primn(node* n, nctx* x) {
+    int sp = vm_sp, i;
+    node* k;
+    for(k = n->a; k; k = k->next) {
+        lisp v = NEVAL(k, x);
+        ND_PUSH(v);
+    }
+    lisp* a = &vm_stack[sp];
+    lisp r;
+    switch (n->i) {
+    case 3: { lisp (*fp)(lisp, lisp, lisp) = n->p; r = fp(a[0], a[1], a[2]); break; }
+    case 4: { lisp (*fp)(lisp, lisp, lisp, lisp) = n->p; r = fp(a[0], a[1], a[2], a[3]); break; }
+    case 5: { lisp (*fp)(lisp, lisp, lisp, lisp, lisp) = n->p; r = fp(a[0], a[1], a[2], a[3], a[4]); break; }
+    case 6: { lisp (*fp)(lisp, lisp, lisp, lisp, lisp, lisp) = n->p; r = fp(a[0], a[1], a[2], a[3], a[4], a[5]); break; }
+    case PRIM_ARGV: { lisp (*fp)(int, lisp*) = n->p; r = fp(vm_sp - sp, a); break; }
+    default: {
+        lisp (*fp)(lisp*, lisp, lisp) = n->p;
+        lisp l = nil;
+        for(i = vm_sp - 1; i >= sp; i--) l = cons(vm_stack[i], l);
+        vm_stack[sp] = l;
+        vm_sp = sp + 1;
+        r = fp(x->envp, l, nil);
+        break; }
+    }
+    vm_sp = sp;
+    return r;
+}
+
+// call a of i args from b, tail call (j) is done by vm_run()
+static lisp nd_call(node* n, nctx* x) {
+    int bp = vm_sp + 1;
+    if (bp + n->i >= VM_STACK) error("VM stack blowup!");
+    lisp g = NEVAL(n->a, x);
+    vm_stack[vm_sp++] = g;
+    node* k;
+    for(k = n->b; k; k = k->next) {
+        lisp v = NEVAL(k, x);
+        vm_stack[vm_sp++] = v;
+    }
+    g = vm_stack[bp - 1];
+    if (IS(g, func) && vm_compiled(g)) {
+        if (n->j) {
+            memmove(&vm_stack[x->bp - 1], &vm_stack[bp - 1], (n->i + 1) * sizeof(lisp));
+            x->tail = n->i;
+            return nil;
+        }
+        return vm_run(bp, n->i);
+    }
+    lisp r = vm_callfunc(g, &vm_stack[bp], n->i, x->envp);
+    vm_sp = bp - 1;
+    return r;
+}
+
+static lisp nd_eval(node* n, nctx* x) { return evalGC(n->v, x->envp); }
+
+static lisp nd_closure(node* n, nctx* x) {
+    lisp g = mkfunc(n->v, *x->envp);
+    ATTR(func, g, code) = n->p;
+    return g;
+}
+
+// run the nodes of c for the call at bp, *tail gets x.tail
+static lisp nd_run(code* c, int bp, lisp* envp, int* tail) {
+    nctx x = { &vm_stack[bp], envp, bp, -1 };
+    node* root = (node*)CODE_BC(c);
+    lisp r = NEVAL(root, &x);
+    *tail = x.tail;
+    return r;
+}
+
+// nodes are referred to by index + 1 when compiling, see n_done()
+#define NODE(c, i) (&(c)->nodes[(i) - 1])
+#define NREF(i) ((node*)(long)(i))
+
+static int n_new(comp* c, void* fn) {
+    if (c->nnodes >= c->nsize) {
+        int sz = c->nsize ? c->nsize * 2 : 16;
+        node* nodes = realloc(c->nodes, sz * sizeof(node));
+        if (!nodes || sz * sizeof(node) > 0xffff) { c->fail = 1; return 1; }
+        c->nodes = nodes;
+        c->nsize = sz;
+    }
+    node* n = &c->nodes[c->nnodes++];
+    memset(n, 0, sizeof(node));
+    n->fn = fn;
+    return c->nnodes;
+}
+
+static int n_expr(comp* c, lisp x, int tail);
+
+static int n_const(comp* c, lisp v) {
+    int i = n_new(c, nd_const);
+    NODE(c, i)->v = v;
+    NODE(c, i)->simple = 1;
+    if (v) c_const(c, v);
+    return i;
+}
+
+// variable, or if val set it to the value of node val
+static int n_var(comp* c, lisp name, int val) {
+    static void* get[] = { nd_arg, nd_local, nd_global, nd_lookup };
+    static void* set[] = { nd_setarg, nd_setlocal, nd_setglobal, nd_setlookup };
+    int a = 0, b = 0;
+    lisp cell = nil;
+    int v = c_var(c, name, &a, &b, &cell);
+    int i = n_new(c, val ? set[v] : get[v]);
+    node* n = NODE(c, i);
+    n->a = NREF(val);
+    n->v = v == V_CELL ? cell : name;
+    n->i = a;
+    n->j = b + 1;
+    n->simple = !val || NODE(c, val)->simple;
+    c_const(c, n->v);
+    return i;
+}
+
+// nodes of forms in l linked by next, padded with nil to pad forms, *n gets the number
+static int n_list(comp* c, lisp l, int tail, int pad, int* n) {
+    int first = 0, last = 0, i;
+    for(i = 0; IS(l, conss) || i < pad; i++) {
+        int k = IS(l, conss) ? n_expr(c, car(l), tail && !IS(cdr(l), conss)) : n_const(c, nil);
+        if (last) NODE(c, last)->next = NREF(k); else first = k;
+        last = k;
+        l = IS(l, conss) ? cdr(l) : nil;
+    }
+    if (n) *n = i;
+    return first;
+}
+
+static int n_body(comp* c, lisp body, int tail) {
+    if (!IS(body, conss)) return n_const(c, nil);
+    if (!IS(cdr(body), conss)) return n_expr(c, car(body), tail);
+    int i = n_list(c, body, tail, 0, NULL);
+    int r = n_new(c, nd_progn);
+    NODE(c, r)->a = NREF(i);
+    return r;
+}
+
+// left to the interpreter
+static int n_eval(comp* c, lisp x) {
+    c_frames(c);
+    int i = n_new(c, nd_eval);
+    NODE(c, i)->v = x;
+    c_const(c, x);
+    return i;
+}
+
+// (if test then else), a compare test is done by the if
+static int n_if(comp* c, lisp args, int tail) {
+    static void* cmp[] = { nd_lt, nd_le, nd_gt, nd_ge, nd_eq, nd_equal };
+    static void* ifs[] = { nd_iflt, nd_ifle, nd_ifgt, nd_ifge, nd_ifeq, nd_ifequal };
+    int test = n_expr(c, car(args), 0);
+    int thn = n_expr(c, car(cdr(args)), tail);
+    int els = n_expr(c, car(cdr(cdr(args))), tail);
+    void* fn = nd_if;
+    int k;
+    for(k = 0; k < 6; k++) if (NODE(c, test)->fn == cmp[k]) fn = ifs[k];
+    int i = n_new(c, fn);
+    node* n = NODE(c, i);
+    n->a = NREF(test);
+    n->b = NREF(thn);
+    n->c = NREF(els);
+    return i;
+}
+
+static int n_cond(comp* c, lisp args, int tail) {
+    int first = 0, last = 0;
+    for(; IS(args, conss); args = cdr(args)) {
+        lisp clause = car(args);
+        int test = n_expr(c, car(clause), 0);
+        int body = cdr(clause) ? n_body(c, cdr(clause), tail) : 0;
+        int k = n_new(c, NULL);
+        NODE(c, k)->a = NREF(test);
+        NODE(c, k)->b = NREF(body);
+        if (last) NODE(c, last)->next = NREF(k); else first = k;
+        last = k;
+    }
+    int i = n_new(c, nd_cond);
+    NODE(c, i)->a = NREF(first);
+    return i;
+}
+
+static int n_andor(comp* c, lisp args, int tail, void* fn) {
+    if (!IS(args, conss)) return n_const(c, nil);
+    if (!IS(cdr(args), conss)) return n_expr(c, car(args), tail);
+    int first = n_list(c, args, tail, 0, NULL);
+    int i = n_new(c, fn);
+    NODE(c, i)->a = NREF(first);
+    return i;
+}
+
+// (let ((a 1) (b 2)) . body), star for let*, scopes as c_let()
+static int n_let(comp* c, lisp args, int tail, int star) {
+    lisp binds = car(args);
+    int n = 0;
+    lisp b;
+    for(b = binds; IS(b, conss); b = cdr(b)) {
+        if (!IS(car(b), conss) || !SYMP(car(car(b)))) return n_eval(c, cons(symbol(star ? "let*" : "let"), args));
+        n++;
+    }
+
+    cscope s = { binds, 0, c->frame ? CS_LET : CS_STACK, c->nargs + c->locals, c, c->sc };
+    if (!c->frame) {
+        c->locals += n;
+        if (c->locals > c->maxlocals) c->maxlocals = c->locals;
+    }
+    if (star) c->sc = &s;
+    int first = 0, last = 0, i = 0;
+    for(b = binds; IS(b, conss); b = cdr(b), i++) {
+        int k = n_expr(c, car(cdr(car(b))), 0);
+        if (last) NODE(c, last)->next = NREF(k); else first = k;
+        last = k;
+        s.n = star ? i + 1 : 0;
+    }
+    s.n = n;
+    c->sc = &s;
+
+    int body = n_body(c, cdr(args), tail);
+
+    c->sc = s.up;
+    if (!c->frame) c->locals -= n;
+    int r = n_new(c, c->frame ? nd_bind : nd_let);
+    node* nd = NODE(c, r);
+    nd->a = NREF(first);
+    nd->b = NREF(body);
+    nd->v = binds;
+    nd->i = s.base;
+    nd->j = star;
+    c_const(c, binds);
+    return r;
+}
+
+// (lambda fargs . body)
+static int n_lambda(comp* c, lisp all) {
+    lisp code = compile_lambda(all, c->env, c, 1);
+    if (!code) c_frames(c);
+    int i = n_new(c, nd_closure);
+    NODE(c, i)->v = all;
+    NODE(c, i)->p = code;
+    c_newconst(c, all);
+    c_newconst(c, code);
+    return i;
+}
+
+// call builtin prim f, as c_prim()
+static int n_prim(comp* c, lisp f, lisp x, int tail) {
+    lisp args = cdr(x);
+    void* fp = getprimfunc(f);
+    int an = getprimnum(f);
+    int i, n;
+    if (an < 0) {
+        if (fp == _quote) return n_const(c, car(args));
+        if (fp == if_) return n_if(c, args, tail);
+        if (fp == cond) return n_cond(c, args, tail);
+        if (fp == and) return n_andor(c, args, tail, nd_and);
+        if (fp == or) return n_andor(c, args, tail, nd_or);
+        if (fp == progn) return n_body(c, args, tail);
+        if (fp == let) return n_let(c, args, tail, 0);
+        if (fp == let_star) return n_let(c, args, tail, 1);
+        if (fp == lambda) return n_lambda(c, args);
+        if (fp == _setbang && (SYMP(car(args)) || IS(car(args), var))) {
+            lisp name = car(args);
+            int v = n_expr(c, car(cdr(args)), 0);
+            return n_var(c, IS(name, var) ? ATTR(var, name, name) : name, v);
+        }
+        return n_eval(c, x);
+    }
+    if (fp == plus || fp == times) {
+        int first = n_list(c, args, 0, 0, NULL);
+        i = n_new(c, fp == plus ? nd_add : nd_mul);
+        int k;
+        for(k = first, n = 1; k; k = (long)NODE(c, k)->next) n = n && NODE(c, k)->simple;
+        NODE(c, i)->a = NREF(first);
+        NODE(c, i)->simple = n;
+        return i;
+    }
+
+    lisp a;
+    for(n = 0, a = args; IS(a, conss); a = cdr(a)) n++;
+    if (an < 7 && n > an) return n_eval(c, x); // only first an are evaluated
+
+    static void* ops[] = { minus, lt, lte, gt, gte, eq, equal };
+    static void* nds[] = { nd_sub, nd_lt, nd_le, nd_gt, nd_ge, nd_eq, nd_equal };
+    int first = n_list(c, args, 0, an < 7 ? an : 0, NULL);
+    void* fn = an == 0 ? nd_prim0 : an == 1 ? nd_prim1 : an == 2 ? nd_prim2 : nd_primn;
+    int op = -1, k;
+    for(k = 0; k < 7; k++) if (fp == ops[k]) op = k;
+    i = n_new(c, op >= 0 ? nds[op] : fn);
+    node* nd = NODE(c, i);
+    nd->a = NREF(first);
+    if (an == 2) nd->b = NODE(c, first)->next;
+    nd->v = f;
+    nd->p = fp;
+    nd->i = an;
+    nd->simple = op >= 0 && NODE(c, first)->simple && NODE(c, (long)nd->b)->simple;
+    c_const(c, f);
+    return i;
+}
+
+static int n_expr(comp* c, lisp x, int tail) {
+    if (c->fail) return 1;
+    if (IS(x, var)) x = ATTR(var, x, name);
+    if (SYMP(x)) return n_var(c, x, 0);
+    if (!IS(x, conss)) return n_const(c, x);
+
+    lisp h = prim_head(car(x));
+    lisp name = IS(h, var) ? ATTR(var, h, name) : h;
+    lisp f = PRIMP(h) ? h : nil; // put there by resolve() or gethead()
+    if (SYMP(name)) {
+        int a, b;
+        lisp cell = nil;
+        int v = c_var(c, name, &a, &b, &cell);
+        if (v == V_CELL && cell == findsym(name)) f = cdr(cell);
+    }
+    if (PRIMP(f) && funame(f) == (PRIMP(h) ? funame(h) : name)) return n_prim(c, f, x, tail);
+    if (IS(f, func) && !ATTR(func, f, env)) return n_eval(c, x); // NLAMBDA
+
+    int head = SYMP(name) ? n_var(c, name, 0) : n_expr(c, h, 0);
+    int n;
+    int args = n_list(c, cdr(x), 0, 0, &n);
+    int i = n_new(c, nd_call);
+    node* nd = NODE(c, i);
+    nd->a = NREF(head);
+    nd->b = NREF(args);
+    nd->i = n;
+    nd->j = tail;
+    return i;
+}
+
+// the nodes of c in a code object, root first
+static lisp n_done(comp* c, int rest, int root) {
+    if (c->fail || c->nargs + c->maxlocals > 0x7fff) return nil;
+    int nb = c->nnodes * sizeof(node);
+    code* r = c_code(c, rest, nb);
+    r->flags |= CODE_TREE;
+    node* nodes = (node*)CODE_BC(r);
+    memcpy(nodes, c->nodes, nb);
+    nodes[0] = c->nodes[root - 1];
+    int i;
+    #define NFIX(p) ((p) = (p) ? &nodes[(long)(p) - 1] : NULL)
+    for(i = 0; i < c->nnodes; i++) {
+        NFIX(nodes[i].a);
+        NFIX(nodes[i].b);
+        NFIX(nodes[i].c);
+        NFIX(nodes[i].next);
+    }
+    #undef NFIX
+    return (lisp)r;
+}
+
+// compile (fargs . body) with env to bytecode or a tree, returns code or nil
+static lisp compile_lambda(lisp all, lisp env, comp* up, int tree) {
+    lisp fargs = car(all), body = cdr(all);
+    int n = 0;
+    lisp x;
+    for(x = fargs; IS(x, conss); x = cdr(x)) n++;
+    int rest = x != nil;
+    if (rest) n++;
+    lisp defs = nil;
+    if (n > FRAME_MAX || resolve_scan(body, &defs) || defs) return nil;
+
+    lisp r = nil;
+    int frame;
+    for(frame = 0; frame < 2; frame++) {
+        comp c;
+        memset(&c, 0, sizeof(c));
+        c.env = env;
+        c.frame = frame;
+        c.nargs = n;
+        c.tree = tree;
+        c.up = up;
+        cscope s = { fargs, n, frame ? CS_FRAME : CS_STACK, 0, &c, up ? up->sc : NULL };
+        c.sc = &s;
+        if (tree) {
+            n_new(&c, NULL); // root goes here
+            int root = c.fail ? 0 : n_body(&c, body, 1);
+            if (!c.needframe || frame) r = n_done(&c, rest, root);
+        } else {
+            c_body(&c, body, 1);
+            if (!c.needframe || frame) r = c_done(&c, rest);
+        }
+        free(c.bc);
+        free(c.nodes);
+        free(c.consts);
+        if (!c.needframe || frame) break;
+    }
+    return r;
+}
+
+// compile func f, to a tree if tree, returns the code, or 0 if it can't be
+// the body is dropped, only the fargs are kept, unless "trace on"
+static lisp compile_func(lisp f, int tree) {
+    lisp e = ATTR(func, f, e), c = ATTR(func, f, code);
+    if (IS(c, code) && !cdr(e)) return c; // no source left to compile
+    lisp env = ATTR(func, f, env);
+    lisp r = env ? compile_lambda(e, env, NULL, tree) : nil;
+    if (!r) r = mkint(0);
+    ATTR(func, f, code) = r;
+    remember(f, r);
+    if (IS(r, code) && !trace && cdr(e)) { // e may be shared with the lambda form
+        ATTR(func, f, e) = cons(car(e), nil);
+        remember(f, ATTR(func, f, e));
+    }
     return r;
 }
 
-PRIM if_(lisp* envp, lisp exp, lisp thn, lisp els) {
-    // evalGC is safe here as we don't construct any structes, yet
-    // TODO: how did we get here? primapply does call evallist thus created something...
-    // but we pass ENV on so it should be safe..., it'll mark it!
-    return evalGC(exp, envp) ? mkimmediate(thn, *envp) : mkimmediate(els, *envp);
+// (compile 'f) compiles f now, (compile 'f 2) to a tree
+// (compile 1) compiles funcs at first call, (compile 2) to trees, (compile 0) not
+PRIM compile(lisp x, lisp how) {
+    if (INTP(x) || !x) { if (x) compile_auto = getint(x); return mkint(compile_auto); }
+    if (SYMP(x)) { lisp b = findsym(x); x = b ? cdr(b) : nil; }
+    if (!IS(x, func)) return nil;
+    lisp r = compile_func(x, getint(how) == 2);
+    return IS(r, code) ? r : nil;
 }
 
-PRIM cond(lisp* envp, lisp all) {
-    while (all) {
-        lisp nxt = car(all);
-        lisp e = car(nxt);
-        e = evalGC(e, envp);
-        lisp thn = cdr(nxt);
-        if (e) return thn ? progn(envp, thn) : e;
-        all = cdr(all);
+// Stack VM
+// --------
+
+static inline int vm_compiled(lisp f) {
+    lisp c = ATTR(func, f, code);
+    if (!c && compile_auto) {
+        lisp env = ATTR(func, f, env);
+        if (env && !framep(env)) c = compile_func(f, compile_auto == 2);
     }
-    return nil;
+    return IS(c, code) && !trace && !tracep(f);
 }
 
-PRIM case_(lisp* envp, lisp all) {
-    lisp x = evalGC(car(all), envp);
-    all = cdr(all);
-    while (all) {
-        lisp ths = car(all);
-        lisp m = member(x, car(ths));
-        if (m) return progn(envp, cdr(ths));
-        all = cdr(all);
+// call anything else, a list of args is made
+static lisp vm_callfunc(lisp f, lisp* argv, int n, lisp* envp) {
+    lisp args = nil;
+    int i;
+    for(i = n - 1; i >= 0; i--) args = cons(argv[i], args);
+    vm_stack[vm_sp++] = args; // a prim may GC
+    lisp last = nil;
+    while (f && f != last && !IS(f, prim) && !IS(f, thunk) && !IS(f, func)) {
+        last = f;
+        f = evalGC(f, envp);
     }
-    return nil;
+    lisp r = reduce_immediate(callfunc(f, args, envp, nil, 1));
+    vm_sp--;
+    return r;
 }
 
-PRIM and(lisp* envp, lisp all) {
-    lisp r = nil;
-    while(all) {
-        // TODO: tail call on last?
-        r = evalGC(car(all), envp);
-        if (!r) return nil;
-        all = cdr(all);
+// call compiled func f from the interpreter, traced here as it has no body
+static lisp vm_apply(lisp f, lisp args, lisp* envp, int noeval) {
+    int bp = vm_sp + 1, n = 0;
+    if (bp >= VM_STACK) error("VM stack blowup!");
+    vm_stack[vm_sp++] = f;
+    for(; IS(args, conss); args = cdr(args), n++) {
+        lisp a = car(args);
+        if (!noeval) a = evalGC(a, envp);
+        if (vm_sp >= VM_STACK) error("VM stack blowup!");
+        vm_stack[vm_sp++] = a;
+    }
+    int dotrace = tracep(f);
+    if (dotrace) {
+        lisp l = nil;
+        int i;
+        for(i = vm_sp - 1; i >= bp; i--) l = cons(vm_stack[i], l);
+        lisp fr = frame_bind(car(ATTR(func, f, e)), l, NULL, nil);
+        indent(trace_level++); printf("--->"); print_args(fr, f); terpri();
+    }
+    lisp r = vm_run(bp, n);
+    vm_sp = bp - 1;
+    if (dotrace) {
+        indent(--trace_level); printf("<--- ");
+        prin1(funame(f)); printf(" ==> "); princ(r); terpri();
     }
     return r;
 }
 
-PRIM or(lisp* envp, lisp all) {
+#define VM_SYNC() (vm_sp = s - vm_stack)
+#define VM_JUMP() (pc = CODE_BC(c) + (pc[0] | (pc[1] << 8)))
+
+// run the func at vm_stack[bp-1] with its n args from bp
+static lisp vm_run(int bp, int n) {
+    lisp f = vm_stack[bp - 1];
+    lisp env = nil;
+    code* c;
+    unsigned char* pc;
+    lisp* k;
+    lisp* s;
     lisp r = nil;
-    while(all) {
-        // TODO: tail call on last?
-        r = evalGC(car(all), envp);
-        if (r) return r;
-        all = cdr(all);
+    int i;
+
+    if (level >= MAX_STACK) error("Stack blowup!");
+    stack[level].e = MKINT(bp); // no call to show, the debugger finds f and the args, see prin1_call()
+    stack[level].envp = &env;
+    level++;
+
+ again:
+    c = (code*)ATTR(func, f, code);
+    env = ATTR(func, f, env);
+    vm_sp = bp + n;
+    gc_check(&env);
+
+    int na = c->xx;
+    if (bp + c->stack >= VM_STACK) error("VM stack blowup!");
+    if (c->flags & CODE_REST) {
+        lisp rest = nil;
+        for(i = n - 1; i >= na - 1; i--) rest = cons(vm_stack[bp + i], rest);
+        for(i = n; i < na - 1; i++) vm_stack[bp + i] = nil;
+        vm_stack[bp + na - 1] = rest;
+    } else {
+        for(i = n; i < na; i++) vm_stack[bp + i] = nil;
+    }
+    if (c->flags & CODE_FRAME) {
+        frame* fr = myMalloc(FRAME_BYTES(na), frame_TAG);
+        fr->tag = frame_TAG;
+        fr->xx = na;
+        fr->names = car(ATTR(func, f, e));
+        fr->parent = env;
+        for(i = 0; i < na; i++) fr->slots[i] = vm_stack[bp + i];
+        env = (lisp)fr;
+        s = &vm_stack[bp];
+    } else {
+        s = &vm_stack[bp + na];
+        for(i = 0; i < c->locals; i++) *s++ = nil;
+    }
+    if (c->flags & CODE_TREE) {
+        VM_SYNC();
+        r = nd_run(c, bp, &env, &i);
+        if (i < 0) goto ret;
+        f = vm_stack[bp - 1];
+        n = i;
+        goto again;
+    }
+    k = c->consts;
+    pc = CODE_BC(c);
+
+    for(;;) {
+        int op = *pc++;
+        switch (op) {
+        case OP_NIL: *s++ = nil; break;
+        case OP_INT: *s++ = MKINT((signed char)*pc++); break;
+        case OP_CONST: *s++ = k[*pc++]; break;
+        case OP_ARG: *s++ = vm_stack[bp + *pc++]; break;
+        case OP_SETARG: vm_stack[bp + *pc++] = s[-1]; break;
+        case OP_LOCAL: case OP_SETLOCAL: {
+            lisp e = env;
+            int d = *pc++;
+            i = *pc++;
+            while (d--) e = IS(e, frame) ? ATTR(frame, e, parent) : cdr(e);
+            if (op == OP_LOCAL) *s++ = i ? ATTR(frame, e, slots)[i - 1] : cdr(car(e));
+            else if (i) { ATTR(frame, e, slots)[i - 1] = s[-1]; remember(e, s[-1]); }
+            else setcdr(car(e), s[-1]);
+            break; }
+        case OP_GLOBAL: *s++ = cdr(k[*pc++]); break;
+        case OP_SETGLOBAL: setcdr(k[*pc++], s[-1]); break;
+        case OP_LOOKUP: VM_SYNC(); r = getvar(k[*pc++], env); *s++ = r; break;
+        case OP_SETLOOKUP: {
+            lisp name = k[*pc++];
+            lisp b = env_find(env, name, &i);
+            if (b) bind_set(b, i, s[-1]); else setcdr(hashsym(name, NULL, 0, 0), s[-1]);
+            break; }
+        case OP_POP: s--; break;
+        case OP_JMP: VM_JUMP(); break;
+        case OP_JNIL: if (*--s) pc += 2; else VM_JUMP(); break;
+        case OP_JNILK: if (s[-1]) { s--; pc += 2; } else VM_JUMP(); break;
+        case OP_JTK: if (!s[-1]) { s--; pc += 2; } else VM_JUMP(); break;
+        case OP_PRIM0: { lisp (*fp)() = GETPRIMFUNC(k[*pc++]); VM_SYNC(); r = fp(); *s++ = r; break; }
+        case OP_PRIM1: { lisp (*fp)(lisp) = GETPRIMFUNC(k[*pc++]); VM_SYNC(); s[-1] = fp(s[-1]); break; }
+        case OP_PRIM2: { lisp (*fp)(lisp, lisp) = GETPRIMFUNC(k[*pc++]); VM_SYNC(); s[-2] = fp(s[-2], s[-1]); s--; break; }
+        case OP_PRIM3: { lisp (*fp)(lisp, lisp, lisp) = GETPRIMFUNC(k[*pc++]); VM_SYNC(); s[-3] = fp(s[-3], s[-2], s[-1]); s -= 2; break; }
+        case OP_PRIM4: { lisp (*fp)(lisp, lisp, lisp, lisp) = GETPRIMFUNC(k[*pc++]); VM_SYNC(); s[-4] = fp(s[-4], s[-3], s[-2], s[-1]); s -= 3; break; }
+        case OP_PRIM5: { lisp (*fp)(lisp, lisp, lisp, lisp, lisp) = GETPRIMFUNC(k[*pc++]); VM_SYNC(); s[-5] = fp(s[-5], s[-4], s[-3], s[-2], s[-1]); s -= 4; break; }
+        case OP_PRIM6: { lisp (*fp)(lisp, lisp, lisp, lisp, lisp, lisp) = GETPRIMFUNC(k[*pc++]); VM_SYNC(); s[-6] = fp(s[-6], s[-5], s[-4], s[-3], s[-2], s[-1]); s -= 5; break; }
+        case OP_PRIML: {
+            lisp (*fp)(lisp*, lisp, lisp) = GETPRIMFUNC(k[*pc++]);
+            int m = *pc++;
+            lisp l = nil;
+            for(i = 1; i <= m; i++) l = cons(s[-i], l);
+            s -= m;
+            *s++ = l;
+            VM_SYNC();
+            s[-1] = fp(&env, l, nil);
+            break; }
+        case OP_PRIMV: {
+            lisp (*fp)(int, lisp*) = GETPRIMFUNC(k[*pc++]);
+            int m = *pc++;
+            VM_SYNC();
+            r = fp(m, s - m);
+            s -= m;
+            *s++ = r;
+            break; }
+        case OP_ADD: case OP_MUL: {
+            int m = *pc++, v;
+            if (m == 2 && (op == OP_ADD ? FIXADD(s[-2], s[-1], v) : FIXMUL(s[-2], s[-1], v))) { s[-2] = FIXTAGGED(v); s--; break; }
+            s -= m;
+            r = op == OP_ADD ? plus(m, s) : times(m, s);
+            *s++ = r;
+            break; }
+        case OP_SUB: case OP_LT: case OP_LE: case OP_GT: case OP_GE: case OP_EQ: case OP_EQUAL: {
+            lisp b = *--s, a = s[-1];
+            if (INTP(a) && INTP(b)) {
+                int x = GETINT(a), y = GETINT(b);
+                switch (op) {
+                case OP_SUB: r = mkint(x - y); break;
+                case OP_LT: r = x < y ? t : nil; break;
+                case OP_LE: r = x <= y ? t : nil; break;
+                case OP_GT: r = x > y ? t : nil; break;
+                case OP_GE: r = x >= y ? t : nil; break;
+                default: r = x == y ? t : nil; break;
+                }
+            } else {
+                switch (op) {
+                case OP_SUB: r = minus(a, b); break;
+                case OP_LT: r = lt(a, b); break;
+                case OP_LE: r = lte(a, b); break;
+                case OP_GT: r = gt(a, b); break;
+                case OP_GE: r = gte(a, b); break;
+                case OP_EQ: r = eq(a, b); break;
+                default: r = equal(a, b); break;
+                }
+            }
+            s[-1] = r;
+            break; }
+        case OP_CALL: case OP_TCALL: {
+            int m = *pc++;
+            lisp g = s[-m - 1];
+            if (IS(g, func) && vm_compiled(g)) {
+                if (op == OP_TCALL) {
+                    memmove(&vm_stack[bp - 1], s - m - 1, (m + 1) * sizeof(lisp));
+                    f = g;
+                    n = m;
+                    goto again;
+                }
+                VM_SYNC();
+                r = vm_run(s - m - vm_stack, m);
+            } else {
+                VM_SYNC();
+                r = vm_callfunc(g, s - m, m, &env);
+            }
+            s -= m + 1;
+            if (op == OP_TCALL) goto ret;
+            *s++ = r;
+            break; }
+        case OP_RET: r = *--s; goto ret;
+        case OP_EVAL: VM_SYNC(); r = evalGC(k[*pc++], &env); *s++ = r; break;
+        case OP_CLOSURE: {
+            lisp g = mkfunc(k[*pc], env);
+            ATTR(func, g, code) = k[*pc + 1];
+            pc++;
+            *s++ = g;
+            break; }
+        case OP_BIND: {
+            lisp b = k[*pc++];
+            int m = *pc++;
+            lisp* a = s - m;
+            for(i = 0; i < m; i++, b = cdr(b)) env = cons(cons(car(car(b)), a[i]), env);
+            s -= m;
+            break; }
+        case OP_UNBIND: { int m = *pc++; while (m--) env = cdr(env); break; }
+        default:
+            printf("\n%% vm_run: bad opcode %d\n", op);
+            error("vm_run: bad opcode");
+        }
     }
-    return nil;
-}
 
-PRIM not(lisp x) {
-    return x ? nil : t;
+ ret:
+    level--;
+    stack[level].e = nil;
+    stack[level].envp = NULL;
+    vm_sp = bp - 1;
+    return r;
 }
 
-// essentially this is a quote but it stores the environment so it's a closure!
-PRIM lambda(lisp* envp, lisp all) {
-    return mkfunc(all, *envp);
-}
+#ifdef UNIX
+// Lisp to C
+// ---------
+// esp-lisp -c env.lsp env.c compiles the functions of env.lsp to a C file
+// of PRIMs. Link it in and (load "env.lsp") runs its init instead of
+// reading the file, see lisp_lib(), (load "./env.lsp") still reads it.
+//
+// (de f (a b) ...) becomes a PRIM of 2 args, (de f (a . r) ...) one of 7
+// getting a list, an nlambda one of -n or -7 getting the env and the
+// unevaluated args, called by primapply() as any prim. Functions of the
+// file call each other directly and a self tail call is a loop, builtin
+// prims are called directly, anything else by its global binding.
+// Compiled code doesn't GC until it returns, same as mapcar().
+//
+// Other forms, and functions using lambda, eval, define... or calling an
+// nlambda, are kept as source and evaluated by the init.
 
-PRIM nlambda(lisp* envp, lisp all) {
-    return mkfunc(all, nil);
+typedef struct l2cvar {
+    lisp name;
+    int id;
+    struct l2cvar* up;
+} l2cvar;
+
+typedef struct l2cform {
+    char* src;
+    lisp x;
+    lisp name, fargs, body; // of function
+    int arity; // as prim, 8 if not a function
+    int ok; // compiled
+} l2cform;
+
+typedef struct l2c {
+    FILE* out;
+    int fail;
+    l2cform* forms;
+    int nforms;
+    l2cform* self;
+    int loop; // self tail call
+    int ids;
+    int env; // &env is passed, emit it
+    lisp globals, prims, consts; // reversed, index is position from end
+    int nglobals, nprims, nconsts;
+} l2c;
+
+static void l2c_expr(l2c* s, lisp x, l2cvar* sc, int tail);
+
+static char* l2c_name(lisp x, char buf[7]) {
+    return HSYMP(x) ? symbol_getString(x) : sym2str(x, buf);
+}
+
+// name as part of a C identifier
+static void l2c_ident(FILE* f, lisp x) {
+    char buf[7] = {0};
+    char* n = l2c_name(x, buf);
+    for(; *n; n++) {
+        if (isalnum(*n)) fputc(*n, f);
+        else if (*n == '-') fputc('_', f);
+        else if (*n == '?') fputs("_p", f);
+        else if (*n == '!') fputs("_x", f);
+        else fprintf(f, "_%02x", *n & 0xff);
+    }
 }
 
-PRIM progn(lisp* envp, lisp all) {
-    while (all && cdr(all)) {
-        evalGC(car(all), envp);
-        all = cdr(all);
+static void l2c_string(FILE* f, char* s, int len) {
+    fputc('"', f);
+    int i;
+    for(i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c == '\n') fputs("\\n", f);
+        else if (c < ' ' || c > '~') fprintf(f, "\\%03o", c);
+        else fputc(c, f);
     }
-    // only last form needs be tail recursive..., or if have "return"?
-    return mkimmediate(car(all), *envp);
+    fputc('"', f);
+}
+
+// C expression making x, when init runs
+static int l2c_data(FILE* f, lisp x) {
+    char buf[7] = {0};
+    if (!x) fputs("nil", f);
+    else if (INTP(x)) fprintf(f, "MKINT(%d)", GETINT(x));
+    else if (FIXEDP(x)) fprintf(f, "MKFIXED(%d)", GETFIXED(x));
+    else if (IS(x, intint)) fprintf(f, "mkint64(%lldLL)", getint64(x));
+    else if (FLOATP(x)) fprintf(f, "mkfloat(%.17g)", getfloat(x));
+    else if (SYMP(x)) { fputs("symbol(", f); l2c_string(f, l2c_name(x, buf), strlen(l2c_name(x, buf))); fputc(')', f); }
+    else if (IS(x, string)) { fputs("mkstring(", f); l2c_string(f, getstring(x), strlen(getstring(x))); fputc(')', f); }
+    else if (IS(x, conss)) {
+        fputs("cons(", f);
+        if (!l2c_data(f, car(x))) return 0;
+        fputs(", ", f);
+        if (!l2c_data(f, cdr(x))) return 0;
+        fputc(')', f);
+    } else return 0;
+    return 1;
+}
+
+// index of x in *l, added if not there
+static int l2c_index(lisp* l, int* n, lisp x) {
+    int i = *n;
+    lisp p;
+    for(p = *l; p; p = cdr(p)) {
+        i--;
+        if (car(p) == x) return i;
+    }
+    *l = cons(x, *l);
+    return (*n)++;
 }
 
-static inline lisp letevallist(lisp args, lisp* envp, lisp extend);
-static inline lisp letstarevallist(lisp args, lisp* envp, lisp extend);
+static void l2c_const(l2c* s, lisp x) {
+    if (!x) fputs("nil", s->out);
+    else if (INTP(x)) fprintf(s->out, "MKINT(%d)", GETINT(x));
+    else if (FIXEDP(x)) fprintf(s->out, "MKFIXED(%d)", GETFIXED(x));
+    else fprintf(s->out, "k[%d]", l2c_index(&s->consts, &s->nconsts, x));
+}
 
-PRIM let(lisp* envp, lisp all) {
-    lisp lenv = letevallist(car(all), envp, *envp);
-    return progn(&lenv, cdr(all));
+static l2cvar* l2c_find(l2cvar* sc, lisp name) {
+    for(; sc; sc = sc->up) if (sc->name == name) return sc;
+    return NULL;
 }
 
-PRIM let_star(lisp* envp, lisp all) {
-    lisp lenv = letstarevallist(car(all), envp, *envp);
-    return progn(&lenv, cdr(all));
+static void l2c_var(FILE* f, l2cvar* v) {
+    fputs("v_", f);
+    l2c_ident(f, v->name);
+    fprintf(f, "_%d", v->id);
 }
 
-// use bindEvalList unless NLAMBDA
-static inline lisp bindList(lisp fargs, lisp args, lisp env) {
-    // TODO: not recurse!
-    if (!fargs) return env;
-    if (SYMP(args)) return cons(cons(fargs, args), env);
-    lisp b = cons(car(fargs), car(args));
-    // self tail recursion is "goto" - efficient
-    return bindList(cdr(fargs), cdr(args), cons(b, env));
+static l2cform* l2c_fun(l2c* s, lisp name) {
+    int i;
+    for(i = 0; i < s->nforms; i++) if (s->forms[i].ok && s->forms[i].name == name) return &s->forms[i];
+    return NULL;
 }
 
-static inline lisp bindEvalList(lisp fargs, lisp args, lisp* envp, lisp extend) {
-    while (fargs) {
-        if (SYMP(fargs)) return cons(cons(fargs, evallist(args, envp)), extend);
-        // This eval cannot be allowed to GC! (since it's part of building a cons structure
-        // TODO: protect ala evallist
-        lisp b = cons(car(fargs), eval(car(args), envp));
-        extend = cons(b, extend);
-        fargs = cdr(fargs);
-        args = cdr(args);
+static void l2c_body(l2c* s, lisp body, l2cvar* sc, int tail) {
+    if (!IS(body, conss)) { fputs("nil", s->out); return; }
+    if (!IS(cdr(body), conss)) { l2c_expr(s, car(body), sc, tail); return; }
+    fputs("({ ", s->out);
+    for(; IS(body, conss); body = cdr(body)) {
+        l2c_expr(s, car(body), sc, tail && !IS(cdr(body), conss));
+        fputs("; ", s->out);
     }
-    return extend;
+    fputs("})", s->out);
 }
 
-static inline lisp letevallist(lisp args, lisp* envp, lisp extend) {
-    while (args) {
-        lisp one = car(args);
-        // This eval cannot be allowed to GC! (since it's part of building a cons structure
-        // TODO: protect ala evallist
-        lisp r = eval(car(cdr(one)), envp);
-        extend = cons(cons(car(one), r), extend);
-        args = cdr(args);
+static int l2c_len(lisp args, int max) {
+    int n = 0;
+    for(; IS(args, conss) && n < max; args = cdr(args)) n++;
+    return n;
+}
+
+// args evaluated in order to _id..., returns how many
+static int l2c_args(l2c* s, lisp args, l2cvar* sc, int max, int id) {
+    int n = 0;
+    for(; IS(args, conss) && n < max; args = cdr(args), n++) {
+        fprintf(s->out, "lisp _%d = ", id + n);
+        l2c_expr(s, car(args), sc, 0);
+        fputs("; ", s->out);
     }
-    return extend;
+    return n;
 }
 
-static inline lisp letstarevallist(lisp args, lisp* envp, lisp extend) {
-    while (args) {
-        lisp one = car(args);
-        // This eval cannot be allowed to GC! (since it's part of building a cons structure
-        // TODO: protect ala evallist
-        lisp r = eval(car(cdr(one)), &extend);
-        extend = cons(cons(car(one), r), extend);
-        args = cdr(args);
+// n args _id... padded with nil to an
+static void l2c_argv(l2c* s, int id, int n, int an) {
+    int i;
+    for(i = 0; i < an; i++) {
+        if (i) fputs(", ", s->out);
+        if (i < n) fprintf(s->out, "_%d", id + i); else fputs("nil", s->out);
     }
-    return extend;
 }
 
-static inline lisp funcapply(lisp f, lisp args, lisp* envp, int noeval) {
-    lisp lenv = ATTR(thunk, f, env);
-    lisp l = ATTR(thunk, f, e);
-    //printf("FUNCAPPLY:"); princ(f); printf(" body="); princ(l); printf(" args="); princ(args); printf(" env="); princ(lenv); terpri();
-    lisp fargs = car(l);
+static void l2c_list(l2c* s, int id, int n) {
+    if (!n) { fputs("nil", s->out); return; }
+    fputs("list(", s->out);
+    l2c_argv(s, id, n, n);
+    fputs(", END)", s->out);
+}
 
-    if (!lenv) { // !lenv) {
-        //printf("[funcapply NLAMBDA: "); prin1(f); putchar(' '); prin1(args);
-        //printf(" LENV="); prin1(lenv);
-        //printf(" ENV="); prin1(*envp);
-        //printf("]\n");
-        noeval = 1;
-        // put env of caller in front, similary to PRIM -7 function
-        args = cons(*envp, args);
+// (let ((a 1) (b 2)) . body), star for let*
+static void l2c_let(l2c* s, lisp args, l2cvar* sc, int tail, int star) {
+    lisp b;
+    int n = 0;
+    for(b = car(args); IS(b, conss); b = cdr(b)) {
+        if (!IS(car(b), conss) || !SYMP(car(car(b)))) { s->fail = 1; return; }
+        n++;
+    }
+    l2cvar vars[n ? n : 1];
+    l2cvar* inner = sc;
+    int i = 0;
+    fputs("({ ", s->out);
+    for(b = car(args); IS(b, conss); b = cdr(b), i++) {
+        vars[i].name = car(car(b));
+        vars[i].id = s->ids++;
+        fputs("lisp ", s->out);
+        l2c_var(s->out, &vars[i]);
+        fputs(" = ", s->out);
+        l2c_expr(s, car(cdr(car(b))), star ? inner : sc, 0);
+        fputs("; ", s->out);
+        vars[i].up = inner;
+        inner = &vars[i];
+    }
+    l2c_body(s, cdr(args), inner, tail);
+    fputs("; })", s->out);
+}
+
+// (and ...) (or ...)
+static void l2c_andor(l2c* s, lisp args, l2cvar* sc, int tail, int or) {
+    if (!IS(args, conss)) { fputs("nil", s->out); return; }
+    if (!IS(cdr(args), conss)) { l2c_expr(s, car(args), sc, tail); return; }
+    int r = s->ids++;
+    fprintf(s->out, "({ lisp _%d = ", r);
+    l2c_expr(s, car(args), sc, 0);
+    fputs("; ", s->out);
+    for(args = cdr(args); IS(args, conss); args = cdr(args)) {
+        fprintf(s->out, "if (%s_%d) _%d = ", or ? "!" : "", r, r);
+        l2c_expr(s, car(args), sc, tail && !IS(cdr(args), conss));
+        fputs("; ", s->out);
+    }
+    fprintf(s->out, "_%d; })", r);
+}
+
+static void l2c_cond(l2c* s, lisp args, l2cvar* sc, int tail) {
+    if (!IS(args, conss)) { fputs("nil", s->out); return; }
+    lisp clause = car(args);
+    if (cdr(clause)) {
+        fputs("(", s->out);
+        l2c_expr(s, car(clause), sc, 0);
+        fputs(" ? ", s->out);
+        l2c_body(s, cdr(clause), sc, tail);
+        fputs(" : ", s->out);
+        l2c_cond(s, cdr(args), sc, tail);
+        fputs(")", s->out);
+    } else {
+        int r = s->ids++;
+        fprintf(s->out, "({ lisp _%d = ", r);
+        l2c_expr(s, car(clause), sc, 0);
+        fprintf(s->out, "; _%d ? _%d : ", r, r);
+        l2c_cond(s, cdr(args), sc, tail);
+        fputs("; })", s->out);
     }
+}
 
-    // TODO: check if NLAMBDA!
-    lenv = noeval ? bindList(fargs, args, lenv) : bindEvalList(fargs, args, envp, lenv);
-    //printf("NEWENV: "); princ(lenv); terpri();
+// call of a builtin prim f
+static void l2c_prim(l2c* s, lisp f, lisp args, l2cvar* sc) {
+    void* fp = getprimfunc(f);
+    int an = getprimnum(f);
+    int id = s->ids;
+    if (an < 0 || fp == _eval || fp == evallist) { s->fail = 1; return; } // gets the env, may GC
 
-    int dotrace = tracep(f);
-    if (dotrace) {
-        indent(trace_level++); printf("--->"); print_args(lenv, f); terpri();
+    s->ids += l2c_len(args, an >= 7 ? 255 : an);
+    fputs("({ ", s->out);
+    int n = l2c_args(s, args, sc, an >= 7 ? 255 : an, id);
+    if (fp == nullp || fp == not) {
+        fprintf(s->out, n ? "_%d ? nil : t; })" : "t; })", id);
+        return;
     }
+    int p = l2c_index(&s->prims, &s->nprims, f);
+    char* op = fp == lt ? "<" : fp == lte ? "<=" : fp == gt ? ">" : fp == gte ? ">=" : fp == eq ? "==" : NULL;
+    char* fix = fp == plus ? "ADD" : fp == minus ? "SUB" : fp == times ? "MUL" : NULL;
+    if (op && n == 2) fprintf(s->out, "INTP(_%d) && INTP(_%d) ? (GETINT(_%d) %s GETINT(_%d) ? t : nil) : ", id, id + 1, id, op, id + 1);
+    if (fix && n == 2) fprintf(s->out, "int _r; FIX%s(_%d, _%d, _r) ? FIXTAGGED(_r) : ", fix, id, id + 1);
+    fprintf(s->out, "p[%d](", p);
+    if (an == 7) {
+        fputs("&env, ", s->out);
+        s->env = 1;
+        l2c_list(s, id, n);
+        fputs(", nil", s->out);
+    } else if (an == PRIM_ARGV) {
+        fprintf(s->out, "%d, (lisp[]){ ", n);
+        l2c_argv(s, id, n, n ? n : 1);
+        fputs(" }", s->out);
+    } else {
+        l2c_argv(s, id, n, an);
+    }
+    fputs("); })", s->out);
+}
+
+// call of function g of the file
+static void l2c_call(l2c* s, l2cform* g, lisp args, l2cvar* sc, int tail) {
+    int an = g->arity, id = s->ids;
+    if (an < 0) { s->fail = 1; return; } // nlambda, needs our env
+    s->ids += l2c_len(args, an == 7 ? 255 : an);
+    fputs("({ ", s->out);
+    int n = l2c_args(s, args, sc, an == 7 ? 255 : an, id);
+    if (tail && g == s->self && an < 7) {
+        int i = 0;
+        lisp p;
+        for(p = g->fargs; IS(p, conss); p = cdr(p), i++) {
+            l2cvar v = { car(p), i, NULL };
+            l2c_var(s->out, &v);
+            if (i < n) fprintf(s->out, " = _%d; ", id + i); else fputs(" = nil; ", s->out);
+        }
+        fputs("goto top; nil; })", s->out);
+        s->loop = 1;
+        return;
+    }
+    fputs("f_", s->out);
+    l2c_ident(s->out, g->name);
+    fprintf(s->out, "_%d(", (int)(g - s->forms));
+    if (an == 7) {
+        fputs("&env, ", s->out);
+        s->env = 1;
+        l2c_list(s, id, n);
+        fputs(", nil", s->out);
+    } else {
+        l2c_argv(s, id, n, an);
+    }
+    fputs("); })", s->out);
+}
 
-    if (!dotrace) return progn(&lenv, cdr(l)); // tail recurse on rest
-
-    lisp r = reduce_immediate(progn(&lenv, cdr(l)));
+static void l2c_expr(l2c* s, lisp x, l2cvar* sc, int tail) {
+    if (s->fail) return;
+    if (!x || INTP(x)) { l2c_const(s, x); return; }
+    if (SYMP(x)) {
+        l2cvar* v = l2c_find(sc, x);
+        if (v) { l2c_var(s->out, v); return; }
+        fprintf(s->out, "cdr(g[%d])", l2c_index(&s->globals, &s->nglobals, x));
+        return;
+    }
+    if (!IS(x, conss)) { l2c_const(s, x); return; }
+
+    lisp h = car(x), args = cdr(x);
+    if (SYMP(h) && !l2c_find(sc, h)) {
+        lisp b = findsym(h);
+        lisp f = b ? cdr(b) : nil;
+        l2cform* g = l2c_fun(s, h);
+        if (g) { l2c_call(s, g, args, sc, tail); return; }
+        if (PRIMP(f) && funame(f) == h) {
+            void* fp = getprimfunc(f);
+            if (fp == _quote && getprimnum(f) < 0) l2c_const(s, car(args));
+            else if (fp == if_) {
+                fputs("(", s->out);
+                l2c_expr(s, car(args), sc, 0);
+                fputs(" ? ", s->out);
+                l2c_expr(s, car(cdr(args)), sc, tail);
+                fputs(" : ", s->out);
+                l2c_expr(s, car(cdr(cdr(args))), sc, tail);
+                fputs(")", s->out);
+            }
+            else if (fp == cond) l2c_cond(s, args, sc, tail);
+            else if (fp == and) l2c_andor(s, args, sc, tail, 0);
+            else if (fp == or) l2c_andor(s, args, sc, tail, 1);
+            else if (fp == progn) l2c_body(s, args, sc, tail);
+            else if (fp == let) l2c_let(s, args, sc, tail, 0);
+            else if (fp == let_star) l2c_let(s, args, sc, tail, 1);
+            else if (fp == _setbang && SYMP(car(args))) {
+                l2cvar* v = l2c_find(sc, car(args));
+                int r = s->ids++;
+                fprintf(s->out, "({ lisp _%d = ", r);
+                l2c_expr(s, car(cdr(args)), sc, 0);
+                fputs("; ", s->out);
+                if (v) l2c_var(s->out, v);
+                else fprintf(s->out, "setcdr(g[%d], _%d)", l2c_index(&s->globals, &s->nglobals, car(args)), r);
+                if (v) fprintf(s->out, " = _%d", r);
+                fprintf(s->out, "; _%d; })", r);
+            }
+            else l2c_prim(s, f, args, sc);
+            return;
+        }
+        if (IS(f, func) && !ATTR(func, f, env)) { s->fail = 1; return; } // nlambda
+    }
 
-    if (dotrace) {
-        indent(--trace_level); printf("<--- ");
-        prin1(funame(f)); printf(" ==> "); princ(r); terpri();
+    // call the value
+    int id = s->ids;
+    s->ids += 1 + l2c_len(args, 255);
+    fputs("({ ", s->out);
+    l2c_args(s, cons(h, nil), sc, 1, id);
+    int n = l2c_args(s, args, sc, 255, id + 1);
+    fprintf(s->out, "apply(_%d, ", id);
+    l2c_list(s, id + 1, n);
+    fputs("); })", s->out);
+}
+
+// (de name fargs . body) or (define name (lambda/nlambda fargs . body))
+static void l2c_form(l2cform* fm) {
+    lisp x = fm->x, n = car(cdr(x)), v = car(cdr(cdr(x)));
+    fm->arity = 8;
+    if (!IS(x, conss) || !SYMP(n)) return;
+    int nl = 0;
+    if (car(x) == symbol("de")) {
+        fm->fargs = v;
+        fm->body = cdr(cdr(cdr(x)));
+    } else if (car(x) == symbol("define") && IS(v, conss) && (car(v) == symbol("lambda") || car(v) == symbol("nlambda"))) {
+        nl = car(v) == symbol("nlambda");
+        fm->fargs = car(cdr(v));
+        fm->body = cdr(cdr(v));
+    } else return;
+    fm->name = n;
+
+    int k = 0;
+    lisp a;
+    for(a = fm->fargs; IS(a, conss); a = cdr(a)) {
+        if (!SYMP(car(a)) || !car(a)) return;
+        k++;
     }
-    return r;
+    if (a && !SYMP(a)) return;
+    if (nl) fm->arity = !a && k > 1 && k <= 7 ? -(k - 1) : -7;
+    else fm->arity = !a && k <= 6 ? k : 7;
+}
+
+// compile function fm, 1 if ok, written to out if out
+static int l2c_function(l2c* s, l2cform* fm, FILE* out) {
+    char* buf = NULL;
+    size_t len = 0;
+    s->out = open_memstream(&buf, &len);
+    s->fail = 0;
+    s->self = fm;
+    s->loop = 0;
+
+    // params, ids are positions, see l2c_call()
+    int an = fm->arity, n = 0, i;
+    l2cvar vars[FRAME_MAX + 1];
+    l2cvar* sc = NULL;
+    lisp a;
+    for(a = fm->fargs; a && n <= FRAME_MAX; n++) {
+        vars[n].name = IS(a, conss) ? car(a) : a;
+        vars[n].id = n;
+        vars[n].up = sc;
+        sc = &vars[n];
+        a = IS(a, conss) ? cdr(a) : nil;
+    }
+    s->ids = n;
+    for(a = fm->fargs; IS(a, conss); a = cdr(a));
+    int rest = a != nil; // (a . rest) or rest
+    if (n > FRAME_MAX) s->fail = 1;
+
+    if (an == -7) fputs("    args = cons(*envp, args); // nlambda gets env first\n", s->out);
+    if (an == 7 || an == -7) {
+        for(i = 0; i < n; i++) {
+            fputs("    lisp ", s->out);
+            l2c_var(s->out, &vars[i]);
+            fputs(rest && i == n - 1 ? " = args;\n" : " = car(args); args = cdr(args);\n", s->out);
+        }
+    } else if (an < 0) {
+        fputs("    lisp ", s->out);
+        l2c_var(s->out, &vars[0]);
+        fputs(" = *envp;\n", s->out);
+    }
+    fputs("    lisp r = ", s->out);
+    l2c_body(s, fm->body, sc, 1);
+    fputs(";\n    blockGC--;\n    return r;\n", s->out);
+    fclose(s->out);
+
+    if (!s->fail && out) {
+        fputs("static PRIM f_", out);
+        l2c_ident(out, fm->name);
+        fprintf(out, "_%d(", (int)(fm - s->forms));
+        if (an == 7 || an == -7) fputs("lisp* envp, lisp args, lisp all", out);
+        if (an < 0 && an > -7) fputs("lisp* envp", out);
+        if (an < 7 && an > -7) {
+            for(i = an < 0; i < n; i++) {
+                if (i) fputs(", ", out);
+                fputs("lisp ", out);
+                l2c_var(out, &vars[i]);
+            }
+        }
+        fputs(") {\n", out);
+        fputs("    blockGC++; // values are in C locals, lisp called from here may not GC\n", out);
+        if (s->loop) fputs(" top:\n", out);
+        fputs(buf, out);
+        fputs("}\n\n", out);
+    }
+    free(buf);
+    return !s->fail;
+}
+
+// process_file callback, p is the l2c state
+static int l2c_collect(void* p, char* src, char* filename, int startno, int endno, int v) {
+    l2c* s = p;
+    char* c = src;
+    while (c && isspace(*c)) c++;
+    if (!c || !*c || *c == ';') return 0;
+    s->forms = realloc(s->forms, (s->nforms + 1) * sizeof(l2cform));
+    l2cform* fm = &s->forms[s->nforms++];
+    memset(fm, 0, sizeof(*fm));
+    fm->src = strdup(src);
+    fm->x = reads(src);
+    l2c_form(fm);
+    return 0;
 }
 
-// TODO: prim apply/funcapply may return immediate... (so users should call apply instead)
-static inline lisp callfunc(lisp f, lisp args, lisp* envp, lisp e, int noeval) {
-    int tag = TAG(f);
-    if (tag == prim_TAG) return primapply(f, args, envp, e, noeval);
-    if (tag == func_TAG) return funcapply(f, args, envp, noeval);
-    if (tag == thunk_TAG) return f; // ignore args
+// compile file lsp to C file c, 0 if ok
+int lisp2c(char* lsp, char* c) {
+    l2c s;
+    memset(&s, 0, sizeof(s));
+    dogc = 0;
 
-    printf("%% "); princ(f); printf(" did not evaluate to a function in: "); princ(e ? e : cons(f, args));
-    printf(" evaluated to "); princ(cons(f, args)); terpri();
-    error("Not a function");
-    return nil;
+    if (process_file(&s, lsp, l2c_collect, 0) < 0) return 1;
+
+    // compile until no more fail, a call to a failed one fails
+    int i, changed = 1;
+    for(i = 0; i < s.nforms; i++) s.forms[i].ok = s.forms[i].arity != 8;
+    while (changed) {
+        changed = 0;
+        for(i = 0; i < s.nforms; i++) {
+            if (!s.forms[i].ok) continue;
+            s.globals = s.prims = s.consts = nil;
+            s.nglobals = s.nprims = s.nconsts = 0;
+            if (!l2c_function(&s, &s.forms[i], NULL)) { s.forms[i].ok = 0; changed = 1; }
+        }
+    }
+
+    FILE* out = fopen(c, "w");
+    if (!out) { perror(c); return 1; }
+    char* file = strrchr(lsp, '/') ? strrchr(lsp, '/') + 1 : lsp;
+    fprintf(out, "// %s compiled by esp-lisp -c, don't edit, see lisp2c() in lisp.c\n\n", file);
+    fputs("#include <stddef.h>\n#include \"lisp.h\"\n\n", out);
+
+    char* buf = NULL;
+    size_t len = 0;
+    FILE* fns = open_memstream(&buf, &len);
+    s.globals = s.prims = s.consts = nil;
+    s.nglobals = s.nprims = s.nconsts = 0;
+    s.env = 0;
+    for(i = 0; i < s.nforms; i++) if (s.forms[i].ok) l2c_function(&s, &s.forms[i], fns);
+    fclose(fns);
+
+    if (s.env) fputs("static lisp env; // for prims getting one\n", out);
+    fprintf(out, "static lisp k[%d]; // constants\n", s.nconsts + 1);
+    if (s.nglobals) fprintf(out, "static lisp g[%d]; // global bindings\n", s.nglobals);
+    if (s.nprims) fprintf(out, "static lisp (*p[%d])(); // builtin prims\n", s.nprims);
+    fputs("\n", out);
+    for(i = 0; i < s.nforms; i++) {
+        l2cform* fm = &s.forms[i];
+        if (!fm->ok) continue;
+        fputs("static PRIM f_", out);
+        l2c_ident(out, fm->name);
+        fprintf(out, "_%d();\n", i);
+    }
+    fputs("\n", out);
+    fputs(buf, out);
+    free(buf);
+
+    lisp l;
+    char nb[7] = {0};
+    fputs("static void init(lisp* envp) {\n", out);
+    for(l = s.globals, i = s.nglobals; l; l = cdr(l)) {
+        fprintf(out, "    g[%d] = hashsym(symbol(", --i);
+        l2c_string(out, l2c_name(car(l), nb), strlen(l2c_name(car(l), nb)));
+        fputs("), NULL, 0, 1);\n", out);
+    }
+    for(l = s.prims, i = s.nprims; l; l = cdr(l)) {
+        fprintf(out, "    p[%d] = getprimfunc(cdr(hashsym(symbol(", --i);
+        lisp n = funame(car(l));
+        l2c_string(out, l2c_name(n, nb), strlen(l2c_name(n, nb)));
+        fputs("), NULL, 0, 1)));\n", out);
+    }
+    for(l = s.consts, i = s.nconsts; l; l = cdr(l)) {
+        fprintf(out, "    k[%d] = ", --i);
+        if (!l2c_data(out, car(l))) { fprintf(stderr, "%% lisp2c: can't make constant\n"); fclose(out); return 1; }
+        fputs(";\n", out);
+    }
+    for(i = 0; i < s.nforms; i++) {
+        l2cform* fm = &s.forms[i];
+        if (fm->ok) {
+            char* n = l2c_name(fm->name, nb);
+            fputs("    _setbang(envp, symbol(", out);
+            l2c_string(out, n, strlen(n));
+            fputs("), mkprim(", out);
+            l2c_string(out, n, strlen(n));
+            fprintf(out, ", %d, f_", fm->arity);
+            l2c_ident(out, fm->name);
+            fprintf(out, "_%d));\n", i);
+        } else {
+            fputs("    evalGC(reads(", out);
+            l2c_string(out, fm->src, strlen(fm->src));
+            fputs("), envp);\n", out);
+        }
+        free(fm->src);
+    }
+    fputs("}\n\n", out);
+    fputs("static void __attribute__((constructor)) reg() {\n", out);
+    fputs("    lisp_lib(", out);
+    l2c_string(out, file, strlen(file));
+    fprintf(out, ", init, k, %d);\n}\n", s.nconsts + 1);
+    fclose(out);
+
+    int ok = 0;
+    for(i = 0; i < s.nforms; i++) {
+        if (s.forms[i].arity == 8) continue;
+        char* n = l2c_name(s.forms[i].name, nb);
+        if (s.forms[i].ok) ok++; else fprintf(stderr, "%% %s: not compiled\n", n);
+    }
+    fprintf(stderr, "%% %s: %d functions compiled to %s\n", file, ok, c);
+    free(s.forms);
+    return 0;
 }
+#endif
 
 static PRIM test(lisp*);
 
 // ticks are counted up in idle() function, as well as this one, they are semi-unique per run
 static long lisp_ticks = 0;
-PRIM ticks() { return mkint(lisp_ticks++ & 0xffffffff); } // TODO: mklong?
+PRIM ticks() { return mkint64(lisp_ticks++); }
 
 PRIM clock_() { return mkint(clock_ms()); }
 
@@ -2611,6 +6491,15 @@ PRIM load(lisp* envp, lisp name, lisp verbosity) {
     int v = getint(verbosity);
     if (v > 0) printf("\n========================= %s\n", filename);
 
+    // compiled in, runs instead
+    int i;
+    for(i = 0; i < nlibs; i++) {
+        if (strcmp(libs[i].file, filename)) continue;
+        libs[i].init(envp);
+        global_envp = savedenvp;
+        return name;
+    }
+
     // no gcc style innner functions with outer variables.. .:-(
     int evalIt(void* p, char* s, char* filename, int startno, int endno, int v) {
         if (!s || !s[0] || s[0] == ';') return 0;
@@ -2618,6 +6507,7 @@ PRIM load(lisp* envp, lisp name, lisp verbosity) {
         lisp* envp = p;
         jmp_buf saved;
         memcpy(&saved, &lisp_break, sizeof(saved));
+        unwind_state u = unwind_save();
         if (setjmp(lisp_break) == 0) {
             lisp e = reads(s);
             lisp r = evalGC(e, envp);
@@ -2628,6 +6518,7 @@ PRIM load(lisp* envp, lisp name, lisp verbosity) {
             memcpy(&lisp_break, &saved, sizeof(saved));
         } else {
             fprintf(stderr, "\n%%======ERROR IN SCRIPT/LOAD====== %s :%d-%d>\n%s", filename, startno, endno, s);
+            unwind(u);
             memcpy(&lisp_break, &saved, sizeof(saved));
             return -1;
         }
@@ -3063,28 +6954,22 @@ lisp serializeLisp(lisp x, lisp* buffer, int *n) {
     //}
 
     // self representive inside pointer
-    if (!x || INTP(x) || SYMP(x)) return x;
+    if (!x || INTP(x) || FIXEDP(x) || SYMP(x)) return x;
 
     if (IS(x, string)) {
-        // string is simple, just serialize a "heap" object with, pointer (to next cells)
-        int sz = sizeof(string);
-        memcpy(buffer, x, sz);
-        // point to next cell
-        sz = (sz + 3) / 4;
-        *n -= sz;
-        lisp* p = buffer + sz;
-        lisp s = (lisp) p;
-        buffer[1] = s;
-        int len = strlen(getstring(x));
-
-        int ilen = (len + 4) & ~3;
-        int iz = ilen / 4;
+        // string is simple, just serialize a "heap" object with the characters inline
+        int len = getstrlen(x);
+        int iz = (sizeof(string) + len + 1 + 3) / 4;
         if (*n <= 2 + iz) return symbol("*FULL*");
-        strncpy((char*)s, getstring(x), len);
-        *n -= 2 + iz;
+        string* s = (string*)buffer;
+        memcpy(s, x, sizeof(string));
+        s->xx = 0;
+        memcpy(s->s, string_chars(x), len);
+        s->s[len] = 0;
+        *n -= iz;
         return (lisp)buffer;
     }
-    if (CONSP(x)) {
+    if (IS(x, conss)) {
         // TODO: what if buffer not aligned? cons need be lisp[2] (8 bytes boundary)
         if ((unsigned int)buffer & 7) {
             printf("serializeLisp: not aligned\n");
@@ -3126,7 +7011,7 @@ PRIM flashArray(lisp *serialized, int len) {
         //printf("%2d : %d [%x] : ", i, o, (unsigned int)p); prin1(p); terpri();
 
         where[i] = p;
-        if (INTP(p) || SYMP(p))
+        if (INTP(p) || FIXEDP(p) || SYMP(p))
             ; // TODO: skip over inline symbol...
         else if (stringp(p))
             ; // TODO: skip over inline string...
@@ -3222,15 +7107,18 @@ PRIM flash(lisp s, lisp o) {
 
 PRIM fibb(lisp n);
 
+// 0 skips the startup prompt, esp-lisp -c sets it, see lisp2c()
+int lisp_prompt = 1;
+
 // returns an env with functions
 lisp lisp_init() {
     nil = 0;
-    int verbose;
+    int verbose = 0;
 
     init_symbols();
 
     // enable to observer startup sequence
-    if (1) {
+    if (lisp_prompt) {
         char* f = readline("PRESS RETURN>", 2);
         if (f) {
             verbose = (f[0] != 0);
@@ -3249,6 +7137,8 @@ lisp lisp_init() {
 
     // TODO: this is a leak!!!
     allocs_next = 0;
+    allocs_free_count = 0;
+    allocs_young_count = 0;
 
     // need to before gc_cons_init()...
     _FREE_ = symbol("*FREE*");
@@ -3280,9 +7170,9 @@ lisp lisp_init() {
 
     // mathy stuff
     DEFPRIM(iota, 3, iota);
-    DEFPRIM(+, -7, plus);
+    DEFPRIM(+, PRIM_ARGV, plus);
     DEFPRIM(-, 2, minus);
-    DEFPRIM(*, -7, times);
+    DEFPRIM(*, PRIM_ARGV, times);
     DEFPRIM(/, 2, divide);
     DEFPRIM(%, 2, mod);
 
@@ -3314,7 +7204,7 @@ lisp lisp_init() {
     DEFPRIM(princ, 1, princ);
     DEFPRIM(prin1, 1, prin1);
     DEFPRIM(print, 1, print);
-    DEFPRIM(printf, 7, printf_);
+    DEFPRIM(printf, PRIM_ARGV, printf_);
     DEFPRIM(pp, 1, pp); // TODO: pprint?
     DEFPRIM(with-putc, -7, with_putc);
     DEFPRIM(with-fd, -7, with_fd);
@@ -3332,9 +7222,10 @@ lisp lisp_init() {
 
     DEFPRIM(list, 7, _quote);
     DEFPRIM(length, 1, length);
-    DEFPRIM(concat, 7, concat); // scheme: string-append/string-concatenate
+    DEFPRIM(concat, PRIM_ARGV, concat); // scheme: string-append/string-concatenate
     DEFPRIM(char, 1, char_); // scheme: integer->char
     DEFPRIM(split, 3, split); // scheme: string-split
+    DEFPRIM(substring, 3, substring);
     DEFPRIM(assoc, 2, assoc);
     DEFPRIM(member, 2, member);
     DEFPRIM(mapcar, 2, mapcar);
@@ -3352,7 +7243,7 @@ lisp lisp_init() {
     DEFPRIM(progn, -7, progn);
     DEFPRIM(eval, 2, _eval);
     DEFPRIM(evallist, 2, evallist);
-    DEFPRIM(apply, 2, apply);
+    DEFPRIM(apply, 2, applyGC);
     DEFPRIM(env, -7, _env);
 
     DEFPRIM(read, 1, read_);
@@ -3370,6 +7261,7 @@ lisp lisp_init() {
     DEFPRIM(fundef, 1, fundef);
     DEFPRIM(funenv, 1, funenv);
     DEFPRIM(funame, 1, funame);
+    DEFPRIM(trace-set!, 2, trace_set);
 
     // define
     // defun
@@ -3389,7 +7281,14 @@ lisp lisp_init() {
     DEFPRIM(adc, 0, adc);
 
     // system stuff
-    DEFPRIM(gc, -1, gc);
+    DEFPRIM(gc, -1, gc_full);
+    DEFPRIM(cons-max, 1, cons_max_);
+    DEFPRIM(lexical, 1, lexical_);
+    DEFPRIM(compile, 2, compile);
+    DEFPRIM(gc-stats, 1, gc_stats);
+#ifdef UNIX
+    DEFPRIM(float-stats, 1, float_stats);
+#endif
     DEFPRIM(test, -7, test);
 
     DEFPRIM(ticks, 1, ticks);
@@ -3438,7 +7337,7 @@ lisp lisp_init() {
     // debugging - http://www.gnu.org/software/mit-scheme/documentation/mit-scheme-user/Debugging-Aids.html 
     // http://www.gnu.org/software/mit-scheme/documentation/mit-scheme-user/Command_002dLine-Debugger.html#Command_002dLine-Debugger
     // TODO: set-trace! set-break! http://www.lilypond.org/doc/v2.19/Documentation/contributor/debugging-scheme-code
-    DEFPRIM(pstack, 0, print_detailed_stack); 
+    DEFPRIM(pstack, 1, print_detailed_stack);
     DEFPRIM(break, 1, breakpoint);
     // unbound: foo
     //   (restart 3) ask and return other value
@@ -3468,7 +7367,7 @@ lisp lisp_init() {
     // DEFPRIM(atrun, -1, atrun); // no reason for user to call (yet)
 
     // DEFPRIM(imacs, -1, imacs_); // link in the imacs?
-    DEFPRIM(syms, 0, syms); // TODO: rename to apropos?
+    DEFPRIM(syms, 1, syms); // TODO: rename to apropos?
     DEFPRIM(fib, 1, fibb);
 
     //DEFPRIM(readit, 0, readit);
@@ -3539,13 +7438,14 @@ void error(char* msg) {
                 printf("  ERROR: %d\n", error_level);
                 printf("  LEVEL: %d\n", l-1);
                 printf("  STACK: "); print_stack(); terpri();
-                printf("CURRENT: "); prin1(stack[l].e); terpri();
+                printf("CURRENT: "); prin1_call(l); terpri();
                 if (stack[l].envp) {
+                    lisp env = vm_env(l);
                     printf("    ENV: ");
-                    prin1(_env(stack[l].envp, nil)); terpri();
+                    prin1(_env(&env, nil)); terpri();
                 }
             }
-            print(stack[l].e); terpri();
+            terpri(); prin1_call(l); putchar(' '); terpri();
             char* ln = NULL;
             while (l > 0) {
                 if (ln) free(ln);
@@ -3581,7 +7481,8 @@ void error(char* msg) {
                     printf("??? level=%d l=%d r=>", level, l);
                     prin1(r); terpri();
                     
-                    prin1(evalGC(r, stack[l].envp)); terpri();
+                    lisp env = vm_env(l);
+                    prin1(evalGC(r, &env)); terpri();
                     level--;
                 } else {
                     // TODO() if any error above (like aslfkjasdf) it'll mess up the stack?
@@ -3623,6 +7524,21 @@ void error(char* msg) {
     }
 }
 
+static unwind_state unwind_save() {
+    return (unwind_state){ level, vm_sp, blockGC, resolve_self };
+}
+
+// drop the levels and vm_stack slots of the evaluation that was aborted,
+// they'd stay GC roots, as run() does for the top level
+static void unwind(unwind_state u) {
+    level = u.level;
+    vm_sp = u.vm_sp;
+    blockGC = u.blockGC;
+    resolve_self = u.resolve_self;
+    stack[level].e = nil;
+    stack[level].envp = NULL;
+}
+
 void run(char* s, lisp* envp) {
     if (setjmp(lisp_break) == 0) {
         lisp r = reads(s);
@@ -3635,6 +7551,8 @@ void run(char* s, lisp* envp) {
         // enableGC and kill stack
         blockGC = 0;
         level = 0;
+        vm_sp = 0;
+        resolve_self = nil;
         trace_level = 0;
         stack[0].e = nil;
         stack[0].envp = NULL;
@@ -3657,7 +7575,12 @@ void run(char* s, lisp* envp) {
 
 void maybeGC() {
     if (blockGC || !global_envp) return;
-    if (needGC()) gc(global_envp);
+    if (gc_phase) {
+        gc_step(GC_IDLE_BUDGET);
+        if (gc_phase == GC_MARK && gc_drained) gc_safepoint(global_envp);
+    } else if (needGC()) {
+        if (gc_major && gc_incremental) gc_safepoint(global_envp); else gc(global_envp);
+    }
 }
 
 void handleInterrupts() {
@@ -3946,6 +7869,24 @@ void testss(lisp* envp , char* what, char* expect) {
     testee(envp, reads(what), reads(expect));
 }
 
+// what should give an error, caught like in load
+void testerror(lisp* envp , char* what) {
+    printf("TEST: %s\n=> ", what);
+    jmp_buf saved;
+    memcpy(&saved, &lisp_break, sizeof(saved));
+    unwind_state u = unwind_save();
+    int failed = 1;
+    if (setjmp(lisp_break) == 0) {
+        princ(eval(reads(what), envp));
+    } else {
+        unwind(u);
+        failed = 0;
+    }
+    memcpy(&lisp_break, &saved, sizeof(saved));
+    printf("\nexpected: error\n");
+    printf("status: %s\n\n", failed ? "failed" : "passed");
+}
+
 // TODO: implement, (port 8080) => p, (listen p) (http @) (close @)
 //   https://github.com/SuperHouse/esp-open-rtos/commit/147257efa472307608019f04f38f8ebadadd7c01
 //   http://john.freml.in/teepeedee2-vs-picolisp
@@ -4043,16 +7984,45 @@ static PRIM test(lisp* e) {
     TEST(((lambda (n) 37) 99), 37);
     TEST(((lambda (n) n) 99), 99);
     TEST(((lambda (a) ((lambda (n) (+ n a)) 33)) 66), 99); // lexical scoping
+    TEST(((lambda (a) (let ((a 1)) (+ a a))) 66), 2); // let isn't resolved
+    TEST((((lambda (a) (lambda () a)) 42)), 42); // depth 1, no args frame
 
     // recursion
     DEFINE(fac, (lambda (n) (if (= n 0) 1 (* n (fac (- n 1))))));
     TEST((fac 6), 720);
-    TEST((fac 21), 952369152);
+    TEST((fac 20), 2432902008176640000);
+    TEST_ERROR((fac 21)); // doesn't fit in 64 bits
+    TEST((progn (compile (quote fac)) (fac 6)), 720); // bytecode
+    TEST((progn (compile (quote fac) 2) (fac 6)), 720); // closure tree
+
+    // fixnums promote to boxed ints at +-2^29
+    TEST((+ 536870911 1), 536870912);
+    TEST((- -536870912 1), -536870913);
+    TEST((* 536870912 2), 1073741824);
+    TEST((- 536870912 1), 536870911);
+    TEST((< 536870912 536870913), t);
+    TEST((< 536870913 536870912), nil);
+    TEST((= 5000000000 5000000000), t);
+    TEST((= 5000000000 5000000001), nil);
+    TEST((eq (+ 536870911 1) 536870912), t);
+    TEST((read "123456789012"), 123456789012);
+    TEST((concat 123456789012 " " -123456789012), "123456789012 -123456789012");
+    TEST_ERROR((/ 5000000000 0));
+    TEST_ERROR((/ 7 0));
+    TEST_ERROR((% 5000000000 0));
+    TEST_ERROR((% 7 0));
 
     // tail recursion optimization test (don't blow up stack!)
     DEFINE(bb, (lambda (b) (+ b 3)));
     DEFINE(aa, (lambda (a) (bb a)));
     TEST((aa 7), 10);
+    DEFINE(bb, (lambda (b) (+ b 4))); // redefined, call site in aa sees it
+    TEST((aa 7), 11);
+    DEFINE(gg, (lambda (a) a));
+    DEFINE(ff, (lambda (x) (gg x)));
+    TEST((ff 3), 3);
+    DEFINE(gg, (nlambda (e a) a)); // now gets x as data, the var is eq to its name
+    TEST((eq (ff 3) (quote x)), t);
 
     DEFINE(tail, (lambda (n s) (if (eq n 0) s (tail (- n 1) (+ s 1)))));
     TEST(tail, xyz);
@@ -4101,6 +8071,18 @@ static PRIM test(lisp* e) {
     TEST((list 1 2 (let ((a (+ 1 a)) (b a)) (list a (+ b b))) 5 (+(+ a (+ a a))), (1 2 (3 4) 5 6)));
     TEST(a, 2);
 
+#ifdef UNIX
+    // floats, (+ x) is x itself, the result of * can't be stored in it
+    DEFINE(y, 1.5d0);
+    DEFINE(g, (lambda (x) (* (+ x) 2)));
+    DEFINE(h, (lambda (x) (+ (* x) 1)));
+    TEST((g y), 3.0d0);
+    TEST((progn (compile (quote g) 2) (g y)), 3.0d0); // closure tree
+    TEST(y, 1.5d0);
+    TEST((progn (compile (quote h) 2) (h y)), 2.5d0);
+    TEST(y, 1.5d0);
+#endif
+
 #else
     printf("%%Tests have been commented out.\n");
 #endif
@@ -19,9 +19,14 @@ typedef struct {
 #define thunk_TAG 6
 #define immediate_TAG 7
 #define func_TAG 8
+#define frame_TAG 9
+#define var_TAG 10
+#define code_TAG 11
+#define fixed_TAG 12 // inline only, see FIXEDP()
+#define floatt_TAG 13
 #define MAX_TAGS 16
 
-#define TAG(x) ({ lisp _x = (x); !_x ? 0 : INTP(_x) ? intint_TAG : CONSP(_x) ? conss_TAG : SYMP(_x) ? symboll_TAG : HSYMP(_x) ? symboll_TAG : PRIMP(_x) ? prim_TAG : ((lisp)_x)->tag; })
+#define TAG(x) ({ lisp _x = (x); !_x ? 0 : INTP(_x) ? intint_TAG : FIXEDP(_x) ? fixed_TAG : (CONSP(_x) || LONGP(_x)) ? conss_TAG : SYMP(_x) ? symboll_TAG : HSYMP(_x) ? symboll_TAG : PRIMP(_x) ? prim_TAG : ((lisp)_x)->tag; })
 #define ALLOC(type) ({type* x = myMalloc(sizeof(type), type ## _TAG); x->tag = type ## _TAG; x;})
 #define ATTR(type, x, field) ((type*)x)->field
 #define IS(x, type) (x && TAG(x) == type ## _TAG)
@@ -30,10 +35,36 @@ typedef struct {
 #define GETINT(x) (((signed int)x) >> 2)
 #define MKINT(i) ((lisp)((((unsigned int)(i)) << 2) | 1))
 
+// fixnum arithmetic directly on the tagged values, r is an int that gets the tagged result,
+// false if a or b isn't a fixnum or it overflows (then use plus/minus/times that box, see mkint64())
+// (4x+1) + (4y+1) - 1 == 4(x+y)+1 overflows 32 bits exactly when x+y overflows 30 bits
+#define FIXADD(a, b, r) (INTP(a) && INTP(b) && !__builtin_add_overflow((int)(a), (int)(b) - 1, &(r)))
+#define FIXSUB(a, b, r) (INTP(a) && INTP(b) && !__builtin_sub_overflow((int)(a), (int)(b) - 1, &(r)))
+#define FIXMUL(a, b, r) (INTP(a) && INTP(b) && !__builtin_mul_overflow(GETINT(a), (int)(b) - 1, &(r)) && ((r) += 1))
+#define FIXTAGGED(r) ((lisp)(unsigned int)(r))
+
+// fixed point Q16.12 stored inline in the pointer, 3.25 is MKFIXED(3.25 * FIXED_ONE)
+#define FIXEDP(x) ((((unsigned int)x) & 15) == 4)
+#define GETFIXED(x) (((signed int)x) >> 4)
+#define MKFIXED(q) ((lisp)((((unsigned int)(q)) << 4) | 4))
+#define FIXED_BITS 12
+#define FIXED_ONE (1 << FIXED_BITS)
+
+// boxed double, only on the unix build, the ESP has no FPU (use fixed point),
+// there FLOATP() is 0 and the float code isn't compiled, no soft doubles or strtod
+#ifdef UNIX
+  #define FLOATP(x) IS(x, floatt)
+#else
+  #define FLOATP(x) 0
+#endif
+
 #define CONSP(x) ((((unsigned int)x) & 7) == 2)
 #define GETCONS(x) ((conss*)(((unsigned int)x) & ~2))
 #define MKCONS(x) ((lisp)(((unsigned int)x) | 2))
 
+// longcons, a cdr-coded list, IS(x, conss) is true for it too, see mklong()
+#define LONGP(x) ((((unsigned int)x) & 15) == 12)
+
 #define SYMP(x) ((((unsigned int)x) & 3) == 3) // true for HSYMP too!
 #define HSYMP(x) ((((unsigned int)x) & 0xff) == 0xff)
 
@@ -47,6 +78,12 @@ lisp mkprim(char* name, int n, void *f);
 
 lisp mkint(int v);
 int getint(lisp x);
+lisp mkint64(long long v);
+long long getint64(lisp x);
+#ifdef UNIX
+lisp mkfloat(double v);
+double getfloat(lisp x);
+#endif
 lisp mkprim(char* name, int n, void *f);
 lisp symbol(char* s);
 lisp quote(lisp x);
@@ -76,11 +113,13 @@ lisp progn(lisp* envp, lisp all);
 PRIM prin1(lisp x);
 PRIM princ(lisp x);
 PRIM print(lisp x);
-PRIM printf_(lisp *envp, lisp all);
+PRIM printf_(int n, lisp* argv);
 PRIM terpri();
 
 lisp car(lisp x);
 lisp cdr(lisp x);
+PRIM cons(lisp a, lisp b);
+PRIM mkstring(char* s);
 
 PRIM _setbang(lisp* envp, lisp name, lisp v);
 
@@ -94,6 +133,12 @@ lisp list(lisp first, ...);
 PRIM _define(lisp* envp, lisp args);
 PRIM de(lisp* envp, lisp namebody);
 PRIM reads(char *s);
+lisp mklong(lisp x);
+
+// library compiled to C by esp-lisp -c, (load file) runs init instead, consts are GC roots
+void lisp_lib(char* file, void (*init)(lisp* envp), lisp* consts, int n);
+int lisp2c(char* lsp, char* c);
+extern int lisp_prompt;
 
 // User, macros, assume a "globaL" env variable implicitly, and updates it
 #define SET(sname, val) _setbang(envp, sname, val)
@@ -106,13 +151,19 @@ PRIM reads(char *s);
 #define PRINT(what) ({ princ(EVAL(what)); terpri(); })
 #define SHOW(what) ({ printf(#what " => "); princ(EVAL(what)); terpri(); })
 #define TEST(what, expect) testss(envp, #what, #expect)
+#define TEST_ERROR(what) testerror(envp, #what)
+// argn: n fun(a1..an) evaluated, -n fun(envp, a1..an) not evaluated, 7 fun(envp, args, all)
+// evaluated list, -7 not evaluated, PRIM_ARGV fun(argc, argv) evaluated, see primapply()
+#define PRIM_ARGV 8
 #define DEFPRIM(fname, argn, fun) _setbang(envp, symbol(#fname), mkprim(#fname, argn, fun))
 
 // symbol (internalish) functions
 void init_symbols();
 lisp hashsym(lisp sym, char* optionalString, int len, int create_binding);
+lisp findsym(lisp sym);
 lisp symbol_len(char* start, int len);
 void syms_mark();
+int syms_bytes();
 PRIM syms(lisp f);
 
 char* sym2str(lisp s, char name[7]); // be aware this only fork for SYMP(s)
@@ -121,6 +172,8 @@ char* symbol_getString(lisp s); // be aware this only works for !SYMP(s) && IS(s
 // TODO: inline or macro
 int getprimnum(lisp p);
 void* getprimfunc(lisp p);
+int getsymtrace(lisp p);
+void setsymtrace(lisp p, int on);
 
 // memory mgt
 void error(char* msg);
@@ -132,6 +185,7 @@ void* myMalloc(int bytes, int tag);
 char* my_strndup(char* s, int len); // calls myMalloc
 
 lisp evalGC(lisp e, lisp *envp); // maybe not call directly... not safe if you've done a cons unless you mark it first...
+extern int blockGC; // > 0 no GC, eval() and apply() increment it, as do functions compiled to C
 void mark(lisp x);
 
 #endif
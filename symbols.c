@@ -90,18 +90,15 @@ char* sym2str(lisp s, char name[7]) {
     return &name[0];
 }
 
+static lisp symbol_intern(char* s, int len);
+
 lisp symbol_len(char *s, int len) {
     if (s && len == 3 && strncmp(s, "nil", len) == 0) return nil; // hack, to keep nil==0
     lisp sym = str2sym(s, len);
     if (sym) return sym;
 
-    // string doesn't fit inside pointer, hash the name
-    unsigned long h = larsons_hash(s, len);
-    h = (h ^ (h >> 16) ^ (h << 16)) & 0xffffff; // 24 bits
-    sym = (lisp)(h << 8 | 0xfff); // lower 8 bits all set! (and one 0)
-    // TODO: detect collission!!!!
-    hashsym(sym, s, len, 1); // create binding
-    return sym;
+    // string doesn't fit inside pointer, intern the name
+    return symbol_intern(s, len);
 }
 
 // use char* as string as already in RAM/ROM/program memory, no need copy
@@ -199,87 +196,202 @@ lisp symbol(char* s) {
 typedef struct { // a "super-cons" (scons)
     lisp symbol; // car.car (also used as the name of PRIM function)
     lisp value;  // car.cdr
-    lisp next;   // cdr - linked list of ones in same bucket
+    lisp next;   // cdr - non-nil if the name is traced, see setsymtrace() (was the linked list of ones in same bucket)
     lisp extra;  // used to store PRIM primitive function pointer, if not prim, TODO: may not be needed, hmmm // how to?
     char s[0];   // only if HSYMP(symbol), then allocated
 } symbol_val;
 
 #define GETSYM(p) ((symbol_val*) (((unsigned int)(p)) & ~7))
 
-// be aware this only works for !SYMP(s) && IS(s, symboll)
-char* symbol_getString(lisp s) {
-    if (!HSYMP(s)) return "*NOTSYMBOL*";
-    lisp hs = hashsym(s, NULL, 0, 0); // no create binding
-    symbol_val* sv = GETSYM(hs);
-    return (char*)&(sv->s);
+// The symbol table is open addressing with linear probing. Each slot keeps
+// the symbol bits inline next to its symbol_val pointer, so a probe compares
+// within the slot array and only touches the symbol_val on a hit. 8 bytes
+// per slot, a 32 byte cache line holds 4 consecutive probes.
+//
+// The symbol_val:s themselves never move (bindings are MKCONS pointers to
+// them and prims are MKPRIM pointers), only the slot array is reallocated
+// when growing. They're also appended to a dense array, so syms_mark() is a
+// linear scan without walking empty slots.
+//
+// Before, it was 63 chained buckets, with a few hundred definitions loaded
+// from SPIFFS the chains were 5-10 long.
+typedef struct {
+    lisp symbol;
+    symbol_val* val;
+} sym_slot;
+
+// power of 2, grows by doubling when more than 3/4 full
+#define SYM_SLOTS_INIT 256
+
+static sym_slot* sym_slots = NULL;
+static unsigned int sym_mask = 0; // slots - 1
+static int sym_count = 0;
+
+static symbol_val** sym_vals = NULL; // dense, in order of creation
+static int sym_vals_size = 0;
+static int sym_used = 0; // in sym_slots, long symbols aren't
+
+static int sym_shift = 32; // 32 - log2(slots)
+
+// inline symbols are regular in their low bits (always 11 or 0xff) and 3ASCII
+// ones keep their characters in the top bits, so fold the top down, multiply
+// by the golden ratio and take the high bits (fibonacci hashing)
+#define SYM_HASH(sym) (((((unsigned int)(sym) >> 16) ^ (unsigned int)(sym)) * 2654435761u) >> sym_shift)
+
+static void syms_grow() {
+    unsigned int n = sym_slots ? (sym_mask + 1) * 2 : SYM_SLOTS_INIT;
+    sym_slot* t = calloc(n, sizeof(sym_slot));
+    if (!t) error("%% syms_grow: out of memory");
+    sym_shift = 32;
+    while ((1u << (32 - sym_shift)) < n) sym_shift--;
+    unsigned int i;
+    for(i = 0; sym_slots && i <= sym_mask; i++) {
+        lisp sym = sym_slots[i].symbol;
+        if (!sym) continue;
+        unsigned int j = SYM_HASH(sym) & (n - 1);
+        while (t[j].symbol) j = (j + 1) & (n - 1);
+        t[j] = sym_slots[i];
+    }
+    free(sym_slots);
+    sym_slots = t;
+    sym_mask = n - 1;
 }
 
-// http://stackoverflow.com/questions/664014/what-integer-hash-function-are-good-that-accepts-an-integer-hash-key
-//static unsigned int int_hash(unsigned int x) {
-//    x = ((x >> 16) ^ x) * 0x45d9f3b;
-//    x = ((x >> 16) ^ x) * 0x45d9f3b;
-//    x = ((x >> 16) ^ x);
-//    return x;
-//}
+// add to sym_vals[]
+static symbol_val* syms_new(lisp sym, char* s, int len) {
+    if (sym_count >= sym_vals_size) {
+        int n = sym_vals_size ? sym_vals_size * 2 : SYM_SLOTS_INIT / 2;
+        symbol_val** v = realloc(sym_vals, n * sizeof(symbol_val*));
+        if (!v) error("%% syms_new: out of memory");
+        sym_vals = v;
+        sym_vals_size = n;
+    }
 
-// cannot be 2^N (because we're dealing with ascii and it's regularity in bits)
-#define SYM_SLOTS 63
-//#define SYM_SLOTS 31
-//#define SYM_SLOTS 2
+    symbol_val* nw = myMalloc(sizeof(symbol_val) + len + 1, -1);
+    nw->symbol = sym;
+    nw->value = nil;
+    nw->next = nil;
+    nw->extra = nil;
+    if (len) {
+        //printf("STRING: %s\n", s);
+        strncpy((char*)&(nw->s), s, len);
+        *((char*)&(nw->s) + len) = 0; // need to terminate explicitly
+    }
+    sym_vals[sym_count++] = nw;
+    return nw;
+}
+
+// Symbols longer than 6 characters don't fit in the pointer. They're interned
+// by name, a hit compares the names so different names never collide, and the
+// symbol is the index of its symbol_val in sym_vals[]:
+//   pointer = iiiiiiiiiiiiiiiiiiiiiiii11111111 = 24 bits index
+// the name and binding are one load away, see hashsym() and symbol_getString().
+// (Before, it was a 24 bit hash of the name, two names could be the same symbol.)
+typedef struct {
+    unsigned long hash; // larsons_hash() of name
+    symbol_val* val;
+} long_slot;
+
+#define LONG_SLOTS_INIT 64
+#define HSYM_INDEX(s) (((unsigned int)(s)) >> 8)
+
+static long_slot* long_slots = NULL;
+static unsigned int long_mask = 0; // slots - 1
+static int long_count = 0;
+
+static void long_grow() {
+    unsigned int n = long_slots ? (long_mask + 1) * 2 : LONG_SLOTS_INIT;
+    long_slot* t = calloc(n, sizeof(long_slot));
+    if (!t) error("%% long_grow: out of memory");
+    unsigned int i;
+    for(i = 0; long_slots && i <= long_mask; i++) {
+        if (!long_slots[i].val) continue;
+        unsigned int j = long_slots[i].hash & (n - 1);
+        while (t[j].val) j = (j + 1) & (n - 1);
+        t[j] = long_slots[i];
+    }
+    free(long_slots);
+    long_slots = t;
+    long_mask = n - 1;
+}
+
+static lisp symbol_intern(char* s, int len) {
+    if ((long_count + 1) * 4 > (long_mask + 1) * 3) long_grow();
+    unsigned long h = larsons_hash(s, len);
+    h ^= h >> 16;
+    unsigned int i = h & long_mask;
+    symbol_val* sv;
+    while ((sv = long_slots[i].val)) {
+        if (long_slots[i].hash == h && strncmp(sv->s, s, len) == 0 && !sv->s[len]) return sv->symbol;
+        i = (i + 1) & long_mask;
+    }
+    if (sym_count >= 1 << 24) error("%% symbol_intern: too many symbols");
+    lisp sym = (lisp)((sym_count << 8) | 0xff); // lower 8 bits all set!
+    long_slots[i].hash = h;
+    long_slots[i].val = syms_new(sym, s, len);
+    long_count++;
+    return sym;
+}
 
-// afterInit=14716 when using ARRAY
-// afterInit=14264 ... lost (- 14716 14264) = 452 bytes (80*4 bytes overhead of malloc)
-// BUT TOTAL => (- 14262 12104) 2158 bytes saved!!!! 
-symbol_val** symbol_hash; // malloc to align correctly on esp8266
+// be aware this only works for !SYMP(s) && IS(s, symboll)
+char* symbol_getString(lisp s) {
+    if (!HSYMP(s) || HSYM_INDEX(s) >= sym_count) return "*NOTSYMBOL*";
+    return sym_vals[HSYM_INDEX(s)]->s;
+}
 
-// TODO: generlize for lisp type ARRAY and HASH!!!
+int syms_bytes() {
+    return (sym_slots ? (sym_mask + 1) * sizeof(sym_slot) : 0) + sym_vals_size * sizeof(symbol_val*)
+        + (long_slots ? (long_mask + 1) * sizeof(long_slot) : 0);
+}
 
 // returns a "binding" as a "conss" (same structure, but isn't)
-// optionalString if given is used to create a new entry/check collision if not inline symbol pointer
+// optionalString is only used in error message, long symbols are created by symbol_intern()
 lisp hashsym(lisp sym, char* optionalString, int len, int create_binding) {
-    if (!symbol_hash) {
-        symbol_hash = myMalloc(SYM_SLOTS * sizeof(symbol_val*), -1);
-        memset(symbol_hash, 0, SYM_SLOTS * sizeof(symbol_val*));
-    }
+    if (!sym_slots) syms_grow();
     if (!sym) return nil;
 
-    unsigned long h = (unsigned long) sym; // inline characters, or hashed symbol, just use the bits as is
     if (!SYMP(sym)) {
         printf("\n\n%% hashsym.error: unknown type of symbol (%s): ", optionalString); princ(sym); terpri();
         exit(1);
     }
-    h = h % SYM_SLOTS;
-    symbol_val* s = symbol_hash[h];
-    while (s && s->symbol != sym) s = (symbol_val*)s->next;
-    if (s) {
-        if (optionalString && HSYMP(h)) { // hashed name - check is same!!!
-            // TODO: check, and if error do WHAT?
-            // if not same, means collision, it's serious
-            // (ly unprobable, but may happen, 290 words english collide out of 99171)
-        }
+    if (HSYMP(sym)) { // long symbol, no probe, see symbol_intern()
+        if (HSYM_INDEX(sym) < sym_count) return MKCONS(sym_vals[HSYM_INDEX(sym)]);
+        printf("\n\n%% hashsym.error: not an interned symbol: %08x\n", (unsigned int)sym);
+        exit(1);
+    }
+    unsigned int h = SYM_HASH(sym) & sym_mask;
+    lisp x;
+    while ((x = sym_slots[h].symbol) && x != sym) h = (h + 1) & sym_mask;
+    symbol_val* s = sym_slots[h].val;
+    if (create_binding < 0) return x ? MKCONS(s) : nil; // findsym()
+    if (x) {
         return MKCONS(s);
     } else if (!create_binding) {
         printf("%% Symbol unbound: "); princ(sym);
         error("%% Symbol unbound"); // this will show stack and go back toplevel
         return nil;
     } else {
-        // not there, insert first
-        symbol_val* nw = myMalloc(sizeof(symbol_val) + len + 1, -1);
-        nw->symbol = sym;
-        nw->value = nil;
-        nw->next = (lisp) symbol_hash[h];
-        nw->extra = nil;
-        if (len) {
-            //printf("STRING: %s\n", optionalString);
-            strncpy((char*)&(nw->s), optionalString, len);
-            *((char*)&(nw->s) + len) = 0; // need to terminate explicitly
+        if ((sym_used + 1) * 4 > (sym_mask + 1) * 3) {
+            syms_grow();
+            h = SYM_HASH(sym) & sym_mask;
+            while (sym_slots[h].symbol) h = (h + 1) & sym_mask;
         }
-        symbol_hash[h] = nw;
+
+        // not there, insert in the free slot, inline symbols have no string
+        symbol_val* nw = syms_new(sym, NULL, 0);
+        sym_slots[h].symbol = sym;
+        sym_slots[h].val = nw;
+        sym_used++;
 
         return MKCONS(nw); // pretend it's a cons!
     }
 }
 
+// like hashsym but only finds an existing binding, nil if none (no error)
+lisp findsym(lisp sym) {
+    return SYMP(sym) ? hashsym(sym, NULL, 0, -1) : nil;
+}
+
 void init_symbols() {
     // initialize symbol stuff with allocate one real symbol
     hashsym(nil, NULL, 0, 0);
@@ -296,11 +408,11 @@ lisp mkprim(char* name, int n, void *f) {
     symbol_val* prim = (symbol_val*) (((unsigned int)s) & ~2); // GETCONS()
     
     prim->value = nil; // set later anyway
-    if ((unsigned int)f & 15 || abs(n) > 7) {
+    if ((unsigned int)f & 15 || n < -7 || n > PRIM_ARGV) {
         printf("\n\n%% Function: %s %d not aligned %d = %x, need specify LISP\n", name, n, (unsigned int)f, (unsigned int)f);
         exit(1);
     }
-    // maybe don't need -7 .. 7, will require 4 bits!
+    // -7 .. PRIM_ARGV in 4 bits
     prim->extra = f + n + 7;
     return MKPRIM(prim);
 }
@@ -315,41 +427,67 @@ inline void* getprimfunc(lisp p) {
     return (void*)((unsigned int)(prim->extra) & ~15);
 }
 
+// p is a prim or a binding from hashsym(), both are the symbol_val of the name
+int getsymtrace(lisp p) {
+    return GETSYM(p)->next != nil;
+}
+
+void setsymtrace(lisp p, int on) {
+    GETSYM(p)->next = on ? (lisp)1 : nil;
+}
+
 void syms_mark() {
     int i;
-    for(i = 0; i < SYM_SLOTS; i++) {
-        symbol_val* s = symbol_hash[i];
-        while (s && s->symbol) {
-            if (s->value) mark(s->value);
-            s = (symbol_val*)s->next;
-        }
+    for(i = 0; i < sym_count; i++) {
+        lisp v = sym_vals[i]->value;
+        if (v) mark(v);
     }
 }
 
-// print the slots
+// print the symbols and the table's probe lengths
 // TODO: maybe call it apropos? http://www.gnu.org/software/mit-scheme/documentation/mit-scheme-user/Debugging-Aids.html
 // TODO: https://groups.csail.mit.edu/mac/ftpdir/scheme-7.4/doc-html/scheme_11.html#SEC97
 // symbol? symbol->string intern inter-soft string->symbol symbol-append symbol-hash symbol-hash-mod symbol<?
 PRIM syms(lisp f) {
-    int n = 0;
     int i;
-    for(i = 0; i < SYM_SLOTS; i++) {
-        symbol_val* s = symbol_hash[i];
-        if (!f) printf("%3d : ", i);
-        int nn = 0;
-        while (s && s->symbol) {
-            nn++;
-            if (!f) {
-                princ(s->symbol); putchar('='); princ(s->value); putchar(' ');
-            } else {
-                // TODO: may run out of memory... GC?
-                apply(f, list(s->symbol, s->value, mkint(i), END));
+    for(i = 0; i < sym_count; i++) {
+        symbol_val* s = sym_vals[i];
+        // probe length = distance from the hash slot to where it's stored
+        int probe = 0; // long symbol, direct
+        if (!HSYMP(s->symbol)) {
+            unsigned int h = SYM_HASH(s->symbol) & sym_mask, j = h;
+            while (sym_slots[j].val != s) j = (j + 1) & sym_mask;
+            probe = ((j - h) & sym_mask) + 1;
+        }
+        if (!f) {
+            princ(s->symbol); putchar('='); princ(s->value); putchar(' ');
+        } else {
+            // TODO: may run out of memory... GC?
+            apply(f, list(s->symbol, s->value, mkint(probe), END));
+        }
+    }
+    if (!f) {
+        // probes needed for a hit, and for a miss (walking up to an empty slot)
+        int hits = 0, hitmax = 0, misses = 0, missmax = 0;
+        unsigned int j;
+        for(j = 0; j <= sym_mask; j++) {
+            if (sym_slots[j].symbol) {
+                int p = ((j - (SYM_HASH(sym_slots[j].symbol) & sym_mask)) & sym_mask) + 1;
+                hits += p;
+                if (p > hitmax) hitmax = p;
             }
-            s = (symbol_val*)s->next;
+            int m = 1;
+            while (sym_slots[(j + m - 1) & sym_mask].symbol) m++;
+            misses += m;
+            if (m > missmax) missmax = m;
         }
-        n += nn;
-        if (!f) printf(" --- #%d\n", nn);
+        int slots = sym_mask + 1;
+        printf("\n--- %d symbols, %d slots (%d%% full), %d long symbols (no probe), %d bytes\n",
+               sym_used, slots, sym_used * 100 / slots, long_count, syms_bytes());
+        printf("--- probes hit: avg %d.%02d max %d, miss: avg %d.%02d max %d\n",
+               sym_used ? hits / sym_used : 0, sym_used ? hits * 100 / sym_used % 100 : 0, hitmax,
+               misses / slots, misses * 100 / slots % 100, missmax);
     }
     
-    return mkint(n);
+    return mkint(sym_count);
 }